@@ -0,0 +1,411 @@
+//
+// Created by cinea on 24-2-29.
+//
+// 简单的HTTP/1.1压测工具，不依赖ForumGate的代码。
+//   keepalive: 每个连接发一个请求、读一个响应，循环
+//   pipeline:  每个连接一次写出depth个请求，再依次读回depth个响应
+//   churn:     每个请求都重新建立连接（Connection: close）
+// 结果以JSON输出到标准输出或--out指定的文件。
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/beast/http.hpp>
+
+namespace beast = boost::beast; // from <boost/beast.hpp>
+namespace http = beast::http; // from <boost/beast/http.hpp>
+namespace net = boost::asio; // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+using clock_type = std::chrono::steady_clock;
+
+enum class load_mode
+{
+    keepalive,
+    pipeline,
+    churn,
+};
+
+struct load_options
+{
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    std::string target = "/";
+    std::string name; // 写进结果里，方便区分不同场景
+    load_mode mode = load_mode::keepalive;
+    size_t connections = 64;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t depth = 16; // pipeline模式下每批的请求数
+    std::chrono::seconds duration{10};
+    std::chrono::seconds timeout{10};
+    std::string out;
+};
+
+// 每个线程一份，线程结束后再合并
+struct load_stats
+{
+    uint64_t requests{0};
+    uint64_t errors{0};
+    uint64_t non_2xx{0};
+    uint64_t connects{0};
+    uint64_t bytes{0};
+    std::vector<uint32_t> latencies_us;
+
+    void merge(const load_stats& other)
+    {
+        requests += other.requests;
+        errors += other.errors;
+        non_2xx += other.non_2xx;
+        connects += other.connects;
+        bytes += other.bytes;
+        latencies_us.insert(latencies_us.end(), other.latencies_us.begin(), other.latencies_us.end());
+    }
+};
+
+class load_client : public std::enable_shared_from_this<load_client>
+{
+    beast::tcp_stream stream_;
+    const tcp::resolver::results_type& endpoints_;
+    const load_options& options_;
+    const std::string& request_;
+    load_stats& stats_;
+    const clock_type::time_point deadline_;
+
+    beast::flat_buffer buffer_;
+    std::optional<http::response_parser<http::string_body>> parser_;
+    size_t pending_{0};
+    clock_type::time_point sent_;
+
+public:
+    load_client(net::io_context& ioc, const tcp::resolver::results_type& endpoints, const load_options& options,
+                const std::string& request, load_stats& stats, const clock_type::time_point deadline):
+        stream_(ioc), endpoints_(endpoints), options_(options), request_(request), stats_(stats),
+        deadline_(deadline)
+    {
+    }
+
+    void run()
+    {
+        do_connect();
+    }
+
+private:
+    [[nodiscard]] size_t batch() const
+    {
+        return options_.mode == load_mode::pipeline ? options_.depth : 1;
+    }
+
+    void do_connect()
+    {
+        if (clock_type::now() >= deadline_)
+            return;
+
+        buffer_.clear();
+        stream_.expires_after(options_.timeout);
+        stream_.async_connect(endpoints_, beast::bind_front_handler(&load_client::on_connect, shared_from_this()));
+    }
+
+    void on_connect(const beast::error_code& ec, const tcp::endpoint&)
+    {
+        if (ec)
+            return on_error();
+
+        stats_.connects++;
+        stream_.socket().set_option(tcp::no_delay(true));
+        do_write();
+    }
+
+    void do_write()
+    {
+        pending_ = batch();
+        sent_ = clock_type::now();
+
+        stream_.expires_after(options_.timeout);
+        net::async_write(stream_, net::buffer(request_),
+                         beast::bind_front_handler(&load_client::on_write, shared_from_this()));
+    }
+
+    void on_write(const beast::error_code& ec, size_t)
+    {
+        if (ec)
+            return on_error();
+
+        do_read();
+    }
+
+    void do_read()
+    {
+        parser_.emplace();
+        parser_->body_limit(boost::none);
+
+        stream_.expires_after(options_.timeout);
+        http::async_read(stream_, buffer_, *parser_,
+                         beast::bind_front_handler(&load_client::on_read, shared_from_this()));
+    }
+
+    void on_read(const beast::error_code& ec, const size_t bytes)
+    {
+        if (ec)
+            return on_error();
+
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - sent_);
+        stats_.requests++;
+        stats_.bytes += bytes;
+        stats_.latencies_us.push_back(static_cast<uint32_t>(std::min<int64_t>(latency.count(), UINT32_MAX)));
+
+        const auto& res = parser_->get();
+        if (res.result_int() / 100 != 2)
+            stats_.non_2xx++;
+
+        if (--pending_ > 0)
+            return do_read();
+
+        if (options_.mode == load_mode::churn || !res.keep_alive())
+            return reconnect();
+
+        if (clock_type::now() >= deadline_)
+            return close();
+
+        do_write();
+    }
+
+    void on_error()
+    {
+        // 到时间以后被取消的请求不算错误
+        if (clock_type::now() < deadline_)
+            stats_.errors++;
+        reconnect();
+    }
+
+    void reconnect()
+    {
+        close();
+        do_connect();
+    }
+
+    void close()
+    {
+        beast::error_code ec;
+        stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+        stream_.close();
+    }
+};
+
+namespace
+{
+    std::string make_request(const load_options& options)
+    {
+        http::request<http::empty_body> req{http::verb::get, options.target, 11};
+        req.set(http::field::host, options.host);
+        req.set(http::field::user_agent, "ForumGateLoad");
+        req.keep_alive(options.mode != load_mode::churn);
+
+        std::ostringstream oss;
+        oss << req;
+
+        std::string request;
+        const auto one = oss.str();
+        for (size_t i = 0; i < (options.mode == load_mode::pipeline ? options.depth : 1); i++)
+            request += one;
+        return request;
+    }
+
+    uint64_t percentile(const std::vector<uint32_t>& sorted, const double p)
+    {
+        if (sorted.empty())
+            return 0;
+        const auto index = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1));
+        return sorted[index];
+    }
+
+    const char* mode_name(const load_mode mode)
+    {
+        switch (mode)
+        {
+        case load_mode::keepalive: return "keepalive";
+        case load_mode::pipeline: return "pipeline";
+        case load_mode::churn: return "churn";
+        }
+        return "";
+    }
+
+    std::string json_escape(const std::string& value)
+    {
+        std::string out;
+        for (const auto c : value)
+        {
+            if (c == '"' || c == '\\')
+                out += '\\';
+            out += c;
+        }
+        return out;
+    }
+
+    std::string to_json(const load_options& options, load_stats& stats, const double elapsed)
+    {
+        auto& latencies = stats.latencies_us;
+        std::sort(latencies.begin(), latencies.end());
+
+        uint64_t total = 0;
+        for (const auto l : latencies)
+            total += l;
+
+        char buf[1024];
+        std::snprintf(
+            buf, sizeof(buf),
+            "{\"name\":\"%s\",\"mode\":\"%s\",\"target\":\"%s\",\"connections\":%zu,\"threads\":%zu,"
+            "\"depth\":%zu,\"duration_s\":%.3f,\"requests\":%llu,\"errors\":%llu,\"non_2xx\":%llu,"
+            "\"connects\":%llu,\"rps\":%.1f,\"bytes_per_s\":%.1f,"
+            "\"latency_us\":{\"min\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,"
+            "\"max\":%llu}}",
+            json_escape(options.name).c_str(), mode_name(options.mode), json_escape(options.target).c_str(),
+            options.connections, options.threads, options.mode == load_mode::pipeline ? options.depth : 1,
+            elapsed, static_cast<unsigned long long>(stats.requests),
+            static_cast<unsigned long long>(stats.errors), static_cast<unsigned long long>(stats.non_2xx),
+            static_cast<unsigned long long>(stats.connects),
+            static_cast<double>(stats.requests) / elapsed, static_cast<double>(stats.bytes) / elapsed,
+            static_cast<unsigned long long>(latencies.empty() ? 0 : latencies.front()),
+            latencies.empty() ? 0.0 : static_cast<double>(total) / static_cast<double>(latencies.size()),
+            static_cast<unsigned long long>(percentile(latencies, 0.5)),
+            static_cast<unsigned long long>(percentile(latencies, 0.9)),
+            static_cast<unsigned long long>(percentile(latencies, 0.99)),
+            static_cast<unsigned long long>(percentile(latencies, 0.999)),
+            static_cast<unsigned long long>(latencies.empty() ? 0 : latencies.back()));
+        return buf;
+    }
+
+    void usage()
+    {
+        std::cerr <<
+            "Usage: ForumGateLoad [--host 127.0.0.1] [--port 8080] [--target /] [--name NAME]\n"
+            "                     [--mode keepalive|pipeline|churn] [--connections 64] [--threads N]\n"
+            "                     [--depth 16] [--duration 10] [--timeout 10] [--out FILE]\n";
+    }
+
+    bool parse_args(const int argc, char* argv[], load_options& options)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string key = argv[i];
+            if (i + 1 >= argc)
+                return false;
+            const std::string value = argv[++i];
+
+            if (key == "--host") options.host = value;
+            else if (key == "--port") options.port = value;
+            else if (key == "--target") options.target = value;
+            else if (key == "--name") options.name = value;
+            else if (key == "--connections") options.connections = std::stoul(value);
+            else if (key == "--threads") options.threads = std::stoul(value);
+            else if (key == "--depth") options.depth = std::stoul(value);
+            else if (key == "--duration") options.duration = std::chrono::seconds(std::stoul(value));
+            else if (key == "--timeout") options.timeout = std::chrono::seconds(std::stoul(value));
+            else if (key == "--out") options.out = value;
+            else if (key == "--mode")
+            {
+                if (value == "keepalive") options.mode = load_mode::keepalive;
+                else if (value == "pipeline") options.mode = load_mode::pipeline;
+                else if (value == "churn") options.mode = load_mode::churn;
+                else return false;
+            }
+            else
+                return false;
+        }
+
+        options.threads = std::clamp<size_t>(options.threads, 1, std::max<size_t>(options.connections, 1));
+        options.depth = std::max<size_t>(options.depth, 1);
+        if (options.name.empty())
+            options.name = mode_name(options.mode);
+        return true;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    load_options options;
+    try
+    {
+        if (!parse_args(argc, argv, options))
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    catch (const std::exception&)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    const auto request = make_request(options);
+
+    tcp::resolver::results_type endpoints;
+    try
+    {
+        net::io_context ioc;
+        tcp::resolver resolver(ioc);
+        endpoints = resolver.resolve(options.host, options.port);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "resolve: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // 每个线程一个io_context，连接平均分配，统计数据不需要加锁
+    std::vector<std::unique_ptr<net::io_context>> contexts;
+    std::vector<load_stats> stats(options.threads);
+    for (size_t i = 0; i < options.threads; i++)
+        contexts.push_back(std::make_unique<net::io_context>(1));
+
+    const auto start = clock_type::now();
+    const auto deadline = start + options.duration;
+    for (size_t i = 0; i < options.connections; i++)
+    {
+        const auto t = i % options.threads;
+        std::make_shared<load_client>(*contexts[t], endpoints, options, request, stats[t], deadline)->run();
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < options.threads; i++)
+    {
+        threads.emplace_back([&ioc = *contexts[i], deadline]
+        {
+            // 到时间后停掉，未完成的请求直接丢弃
+            net::steady_timer timer(ioc, deadline);
+            timer.async_wait([&ioc](const beast::error_code&) { ioc.stop(); });
+            ioc.run();
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    const auto elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    load_stats total;
+    for (const auto& s : stats)
+        total.merge(s);
+
+    const auto json = to_json(options, total, elapsed);
+    if (options.out.empty())
+    {
+        std::cout << json << std::endl;
+    }
+    else
+    {
+        std::ofstream out(options.out);
+        out << json << std::endl;
+    }
+
+    return total.requests > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
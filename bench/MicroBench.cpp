@@ -0,0 +1,164 @@
+//
+// Created by cinea on 24-2-29.
+//
+// 热路径上的微基准。JSON输出：ForumGateMicroBench --benchmark_format=json
+//
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include <date-rfc/date-rfc.h>
+#include <toml.hpp>
+
+#include "Gateway.h"
+#include "MimeTable.h"
+#include "StaticFileHandler.h"
+#include "../libs/MimeTypes/MimeTypes.h"
+
+namespace
+{
+    constexpr size_t file_size = 4096;
+    constexpr size_t miss_files = 1024; // 远大于静态文件缓存的容量，轮流读取时每次都不命中
+
+    // 在临时目录里准备静态文件和网关配置，进程退出时删除
+    struct bench_fixture
+    {
+        std::filesystem::path root;
+        std::vector<std::filesystem::path> files;
+
+        bench_fixture()
+        {
+            root = std::filesystem::temp_directory_path() / ("forum-gate-bench-" + std::to_string(::getpid()));
+            std::filesystem::create_directories(root / "assets");
+
+            const std::string content(file_size, 'x');
+            for (size_t i = 0; i < miss_files; i++)
+            {
+                files.push_back(root / "assets" / ("chunk-" + std::to_string(i) + ".js"));
+                std::ofstream(files.back(), std::ios::binary) << content;
+            }
+
+            std::ofstream(root / "app_config.toml") <<
+                "metrics_path = \"/metrics\"\n"
+                "[[proxy]]\nprefix = \"/s3\"\nurl = \"http://127.0.0.1:9000\"\n"
+                "[[proxy]]\nprefix = \"/api\"\nurl = \"http://127.0.0.1:9002\"\n"
+                "[[proxy]]\nprefix = \"/card\"\nurl = \"http://127.0.0.1:9000/forum/user-avatar\"\nexpires = \"12h\"\n"
+                "[[proxy]]\nprefix = \"/meili\"\nurl = \"http://127.0.0.1:7700\"\n";
+            init_gateway(toml::parse((root / "app_config.toml").string()));
+        }
+
+        ~bench_fixture()
+        {
+            std::error_code ec;
+            std::filesystem::remove_all(root, ec);
+        }
+    };
+
+    bench_fixture& fixture()
+    {
+        static bench_fixture f;
+        return f;
+    }
+}
+
+static void BM_StaticFileHit(benchmark::State& state)
+{
+    const auto& path = fixture().files.front();
+    beast::error_code ec;
+    get_static_file(path, std::nullopt, ec); // 先放进缓存
+
+    for (auto _ : state)
+    {
+        auto result = get_static_file(path, std::nullopt, ec);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * file_size));
+}
+BENCHMARK(BM_StaticFileHit);
+
+static void BM_StaticFileMiss(benchmark::State& state)
+{
+    const auto& files = fixture().files;
+    beast::error_code ec;
+    size_t i = 0;
+
+    for (auto _ : state)
+    {
+        auto result = get_static_file(files[i++ % files.size()], std::nullopt, ec);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * file_size));
+}
+BENCHMARK(BM_StaticFileMiss);
+
+const char* mime_paths[] = {
+    "/www/index.html", "/www/assets/index-4f2a.js", "/www/assets/index-9c1e.css", "/www/favicon.ico",
+    "/www/assets/logo.svg", "/www/assets/font.woff2", "/www/upload/photo.jpeg", "/www/README",
+};
+
+static void BM_MimeType(benchmark::State& state)
+{
+    size_t i = 0;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(mime_type(mime_paths[i++ % std::size(mime_paths)]));
+}
+BENCHMARK(BM_MimeType);
+
+// 原来的二分查找，用来对比
+static void BM_MimeTypeLegacy(benchmark::State& state)
+{
+    size_t i = 0;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(MimeTypes::getType(mime_paths[i++ % std::size(mime_paths)]));
+}
+BENCHMARK(BM_MimeTypeLegacy);
+
+static void BM_RouteMatch(benchmark::State& state)
+{
+    fixture();
+    const beast::string_view targets[] = {
+        "/api/v1/posts?page=2", "/assets/index-4f2a.js", "/meili/indexes/posts/search", "/card/42.png",
+        "/s3/forum/attachments/1.zip", "/metrics", "/", "/user/profile",
+    };
+    size_t i = 0;
+
+    for (auto _ : state)
+        benchmark::DoNotOptimize(gateway_route(targets[i++ % std::size(targets)]));
+}
+BENCHMARK(BM_RouteMatch);
+
+static void BM_FormatRfc1123(benchmark::State& state)
+{
+    const std::time_t t = 1709136000;
+
+    for (auto _ : state)
+    {
+        std::ostringstream oss;
+        oss << date::format_rfc1123(t);
+        benchmark::DoNotOptimize(oss.str());
+    }
+}
+BENCHMARK(BM_FormatRfc1123);
+
+static void BM_ParseRfc1123(benchmark::State& state)
+{
+    const std::string str = "Wed, 28 Feb 2024 16:00:00 GMT";
+
+    for (auto _ : state)
+    {
+        std::time_t t;
+        std::istringstream iss(str);
+        iss >> date::format_rfc1123(t);
+        benchmark::DoNotOptimize(t);
+    }
+}
+BENCHMARK(BM_ParseRfc1123);
+
+BENCHMARK_MAIN();
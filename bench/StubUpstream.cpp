@@ -0,0 +1,180 @@
+//
+// Created by cinea on 24-2-29.
+//
+// 压测用的假上游：对任何请求都返回固定大小的200响应，可以加上固定延迟。
+//
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/beast/http.hpp>
+
+namespace beast = boost::beast; // from <boost/beast.hpp>
+namespace http = beast::http; // from <boost/beast/http.hpp>
+namespace net = boost::asio; // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+
+struct stub_options
+{
+    std::string address = "127.0.0.1";
+    unsigned short port = 9090;
+    size_t body_size = 1024;
+    std::chrono::milliseconds delay{0};
+    size_t threads = 1;
+};
+
+class stub_session : public std::enable_shared_from_this<stub_session>
+{
+    beast::tcp_stream stream_;
+    net::steady_timer timer_;
+    beast::flat_buffer buffer_;
+    http::request<http::string_body> req_;
+    http::response<http::string_body> res_;
+    const stub_options& options_;
+    const std::string& body_;
+
+public:
+    stub_session(tcp::socket&& socket, const stub_options& options, const std::string& body):
+        stream_(std::move(socket)), timer_(stream_.get_executor()), options_(options), body_(body)
+    {
+    }
+
+    void run()
+    {
+        net::dispatch(stream_.get_executor(),
+                      beast::bind_front_handler(&stub_session::do_read, shared_from_this()));
+    }
+
+private:
+    void do_read()
+    {
+        req_ = {};
+        stream_.expires_after(std::chrono::seconds(30));
+        http::async_read(stream_, buffer_, req_, beast::bind_front_handler(&stub_session::on_read, shared_from_this()));
+    }
+
+    void on_read(const beast::error_code& ec, size_t)
+    {
+        if (ec)
+            return do_close();
+
+        if (options_.delay.count() == 0)
+            return do_write();
+
+        timer_.expires_after(options_.delay);
+        timer_.async_wait([self = shared_from_this()](const beast::error_code&) { self->do_write(); });
+    }
+
+    void do_write()
+    {
+        res_ = http::response<http::string_body>{http::status::ok, req_.version()};
+        res_.set(http::field::server, "ForumGateStubUpstream");
+        res_.set(http::field::content_type, "text/plain");
+        res_.keep_alive(req_.keep_alive());
+        res_.body() = body_;
+        res_.prepare_payload();
+
+        http::async_write(stream_, res_, beast::bind_front_handler(&stub_session::on_write, shared_from_this()));
+    }
+
+    void on_write(const beast::error_code& ec, size_t)
+    {
+        if (ec || !res_.keep_alive())
+            return do_close();
+
+        do_read();
+    }
+
+    void do_close()
+    {
+        beast::error_code ec;
+        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+    }
+};
+
+class stub_listener : public std::enable_shared_from_this<stub_listener>
+{
+    net::io_context& ioc_;
+    tcp::acceptor acceptor_;
+    const stub_options& options_;
+    const std::string& body_;
+
+public:
+    stub_listener(net::io_context& ioc, const tcp::endpoint& endpoint, const stub_options& options,
+                  const std::string& body):
+        ioc_(ioc), acceptor_(ioc), options_(options), body_(body)
+    {
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(net::socket_base::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen(net::socket_base::max_listen_connections);
+    }
+
+    void run()
+    {
+        acceptor_.async_accept(net::make_strand(ioc_),
+                               beast::bind_front_handler(&stub_listener::on_accept, shared_from_this()));
+    }
+
+private:
+    void on_accept(const beast::error_code& ec, tcp::socket socket)
+    {
+        if (!ec)
+        {
+            socket.set_option(tcp::no_delay(true));
+            std::make_shared<stub_session>(std::move(socket), options_, body_)->run();
+        }
+
+        run();
+    }
+};
+
+int main(int argc, char* argv[])
+{
+    stub_options options;
+    try
+    {
+        for (int i = 1; i + 1 < argc; i += 2)
+        {
+            const std::string key = argv[i];
+            const std::string value = argv[i + 1];
+            if (key == "--address") options.address = value;
+            else if (key == "--port") options.port = static_cast<unsigned short>(std::stoul(value));
+            else if (key == "--body-size") options.body_size = std::stoul(value);
+            else if (key == "--delay-ms") options.delay = std::chrono::milliseconds(std::stoul(value));
+            else if (key == "--threads") options.threads = std::max<size_t>(std::stoul(value), 1);
+            else throw std::invalid_argument(key);
+        }
+    }
+    catch (const std::exception&)
+    {
+        std::cerr << "Usage: ForumGateStubUpstream [--address 127.0.0.1] [--port 9090] [--body-size 1024]\n"
+            "                             [--delay-ms 0] [--threads 1]\n";
+        return EXIT_FAILURE;
+    }
+
+    const std::string body(options.body_size, 'x');
+
+    net::io_context ioc{static_cast<int>(options.threads)};
+    std::make_shared<stub_listener>(ioc, tcp::endpoint{net::ip::make_address(options.address), options.port},
+                                    options, body)->run();
+
+    net::signal_set signals(ioc, SIGINT, SIGTERM);
+    signals.async_wait([&ioc](const beast::error_code&, int) { ioc.stop(); });
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < options.threads; i++)
+        threads.emplace_back([&ioc] { ioc.run(); });
+    ioc.run();
+
+    for (auto& thread : threads)
+        thread.join();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# 在本机启动ForumGate和假上游，依次跑各个压测场景，结果合并成一个JSON数组。
+# 用法: run_load.sh <ForumGate> <ForumGateLoad> <ForumGateStubUpstream> <输出文件>
+#
+# 可以用环境变量调整：BENCH_DURATION（秒）、BENCH_CONNECTIONS、BENCH_THREADS、BENCH_PORT、BENCH_UPSTREAM_PORT
+#
+
+set -e
+
+if [ $# -ne 4 ]; then
+    echo "Usage: $0 <ForumGate> <ForumGateLoad> <ForumGateStubUpstream> <output.json>" >&2
+    exit 1
+fi
+
+gate=$(realpath "$1")
+load=$(realpath "$2")
+stub=$(realpath "$3")
+out=$4
+
+duration=${BENCH_DURATION:-10}
+connections=${BENCH_CONNECTIONS:-64}
+threads=${BENCH_THREADS:-4}
+port=${BENCH_PORT:-18080}
+upstream_port=${BENCH_UPSTREAM_PORT:-19090}
+
+work=$(mktemp -d)
+gate_pid=
+stub_pid=
+cleanup() {
+    [ -n "$gate_pid" ] && kill "$gate_pid" 2>/dev/null
+    [ -n "$stub_pid" ] && kill "$stub_pid" 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# 静态文件：一个小的index.html和一个几十KB的脚本
+mkdir -p "$work/www/assets"
+printf '<!doctype html><html><head><title>bench</title></head><body><div id="app"></div></body></html>\n' \
+    > "$work/www/index.html"
+head -c 65536 /dev/zero | tr '\0' 'x' > "$work/www/assets/app.js"
+
+cat > "$work/app_config.toml" <<CONFIG
+address = "127.0.0.1"
+port = $port
+doc_root = "$work/www"
+threads = $threads
+metrics_path = "/metrics"
+
+[log]
+access_log = ""
+
+[[proxy]]
+prefix = "/api"
+url = "http://127.0.0.1:$upstream_port"
+CONFIG
+
+"$stub" --port "$upstream_port" --threads 2 &
+stub_pid=$!
+(cd "$work" && exec "$gate") &
+gate_pid=$!
+sleep 1
+
+run() {
+    name=$1
+    shift
+    echo "bench: $name" >&2
+    "$load" --port "$port" --connections "$connections" --duration "$duration" --name "$name" "$@" \
+        --out "$work/$name.json"
+}
+
+run static-small-keepalive --target /index.html --mode keepalive
+run static-small-pipeline --target /index.html --mode pipeline --depth 16
+run static-small-churn --target /index.html --mode churn
+run static-large-keepalive --target /assets/app.js --mode keepalive
+run spa-fallback-keepalive --target /posts/42 --mode keepalive
+run proxy-keepalive --target /api/ping --mode keepalive
+run proxy-churn --target /api/ping --mode churn
+
+{
+    echo "["
+    first=1
+    for f in "$work"/*.json; do
+        [ $first -eq 1 ] || echo ","
+        first=0
+        cat "$f"
+    done
+    echo "]"
+} > "$out"
+
+echo "bench: results written to $out" >&2
@@ -0,0 +1,307 @@
+//
+// Created by cinea on 24-2-28.
+//
+
+#include "AccessLog.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <boost/core/ignore_unused.hpp>
+
+gate_logger gate_log;
+
+namespace
+{
+    constexpr size_t line_size = 512;
+    constexpr size_t batch_lines = 256; // 一次writev最多多少行
+
+    using line = std::array<char, line_size>;
+
+    void copy_truncated(char* dest, const size_t size, const std::string_view& src)
+    {
+        const auto n = std::min(src.size(), size - 1);
+        std::memcpy(dest, src.data(), n);
+        dest[n] = '\0';
+    }
+
+    // 格式化时间，同一秒内的记录复用上次的结果
+    const char* format_time(const std::chrono::system_clock::time_point time)
+    {
+        static thread_local std::time_t last = -1;
+        static thread_local char buf[32];
+
+        const auto t = std::chrono::system_clock::to_time_t(time);
+        if (t != last)
+        {
+            std::tm tm{};
+            gmtime_r(&t, &tm);
+            std::strftime(buf, sizeof(buf), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+            last = t;
+        }
+        return buf;
+    }
+
+    size_t format_record(const log_record& record, line& out)
+    {
+        int n;
+        if (record.type == log_record::kind::access)
+        {
+            const auto remote = record.remote.is_unspecified() ? std::string("-") : record.remote.to_string();
+            n = std::snprintf(out.data(), out.size(), "%s - - [%s] \"%s %s HTTP/%u.%u\" %u %llu %.3f\n",
+                              remote.c_str(), format_time(record.time), record.method, record.text,
+                              record.version / 10, record.version % 10, record.status,
+                              static_cast<unsigned long long>(record.bytes),
+                              static_cast<double>(record.duration_us) / 1000.0);
+        }
+        else
+        {
+            n = std::snprintf(out.data(), out.size(), "[%s] %s\n", format_time(record.time), record.text);
+        }
+
+        if (n < 0)
+            return 0;
+
+        // 被截断时保证以换行结尾
+        if (static_cast<size_t>(n) >= out.size())
+        {
+            out[out.size() - 2] = '\n';
+            return out.size() - 1;
+        }
+        return static_cast<size_t>(n);
+    }
+
+    void write_lines(const int fd, const std::vector<line>& lines, const std::vector<size_t>& sizes)
+    {
+        if (fd < 0 || lines.empty())
+            return;
+
+        std::array<iovec, batch_lines> iov{};
+        for (size_t i = 0; i < lines.size(); i++)
+        {
+            iov[i].iov_base = const_cast<char*>(lines[i].data());
+            iov[i].iov_len = sizes[i];
+        }
+
+        // 处理写了一部分的情况
+        auto* first = iov.data();
+        auto count = static_cast<int>(lines.size());
+        while (count > 0)
+        {
+            auto written = ::writev(fd, first, count);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            while (count > 0 && static_cast<size_t>(written) >= first->iov_len)
+            {
+                written -= static_cast<ssize_t>(first->iov_len);
+                first++;
+                count--;
+            }
+            if (count > 0)
+            {
+                first->iov_base = static_cast<char*>(first->iov_base) + written;
+                first->iov_len -= written;
+            }
+        }
+    }
+}
+
+gate_logger::~gate_logger()
+{
+    stop();
+}
+
+void gate_logger::start(const log_options& options)
+{
+    if (running_.load())
+        return;
+
+    options_ = options;
+    open_files();
+
+    running_.store(true);
+    writer_ = std::thread([this] { run(); });
+}
+
+void gate_logger::stop()
+{
+    if (!running_.exchange(false))
+        return;
+
+    wake_.notify_one();
+    if (writer_.joinable())
+        writer_.join();
+
+    close_files();
+}
+
+void gate_logger::reopen()
+{
+    reopen_.store(true);
+    wake_.notify_one();
+}
+
+spsc_ring<log_record>& gate_logger::local()
+{
+    thread_local spsc_ring<log_record>* ring = nullptr;
+    if (!ring)
+    {
+        std::lock_guard guard(rings_mutex_);
+        rings_.push_back(std::make_unique<spsc_ring<log_record>>(options_.buffer_records));
+        ring = rings_.back().get();
+    }
+    return *ring;
+}
+
+void gate_logger::push(const log_record& record)
+{
+    if (!local().push(record))
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void gate_logger::access(const boost::asio::ip::address& remote, const std::string_view method,
+                         const std::string_view target, const unsigned version, const unsigned status,
+                         const uint64_t bytes, const std::chrono::steady_clock::duration duration)
+{
+    if (!access_enabled())
+        return;
+
+    log_record record;
+    record.type = log_record::kind::access;
+    record.time = std::chrono::system_clock::now();
+    record.remote = remote;
+    record.status = status;
+    record.version = version;
+    record.bytes = bytes;
+    record.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    copy_truncated(record.method, sizeof(record.method), method);
+    copy_truncated(record.text, sizeof(record.text), target);
+
+    push(record);
+}
+
+void gate_logger::error(const std::string_view what, const std::string_view message)
+{
+    log_record record;
+    record.type = log_record::kind::error;
+    record.time = std::chrono::system_clock::now();
+
+    const auto n = std::min(what.size(), sizeof(record.text) - 1);
+    std::memcpy(record.text, what.data(), n);
+    const auto rest = std::string(": ").append(message);
+    copy_truncated(record.text + n, sizeof(record.text) - n, rest);
+
+    if (!running_.load(std::memory_order_relaxed))
+    {
+        // 还没启动（比如读配置、绑定端口时），直接写标准错误
+        line out;
+        const auto size = format_record(record, out);
+        boost::ignore_unused(::write(STDERR_FILENO, out.data(), size));
+        return;
+    }
+
+    push(record);
+}
+
+void gate_logger::open_files()
+{
+    auto open_log = [](const std::string& path)
+    {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            const auto message = "log: cannot open '" + path + "': " + std::strerror(errno) + "\n";
+            boost::ignore_unused(::write(STDERR_FILENO, message.data(), message.size()));
+        }
+        return fd;
+    };
+
+    access_fd_ = options_.access_log.empty() ? -1 : open_log(options_.access_log);
+    error_fd_ = options_.error_log.empty() ? STDERR_FILENO : open_log(options_.error_log);
+}
+
+void gate_logger::close_files()
+{
+    if (access_fd_ >= 0)
+        ::close(access_fd_);
+    if (error_fd_ >= 0 && error_fd_ != STDERR_FILENO)
+        ::close(error_fd_);
+
+    access_fd_ = -1;
+    error_fd_ = -1;
+}
+
+void gate_logger::run()
+{
+    std::unique_lock lock(wake_mutex_);
+    while (running_.load())
+    {
+        wake_.wait_for(lock, options_.flush_interval);
+        lock.unlock();
+
+        if (reopen_.exchange(false))
+        {
+            flush();
+            close_files();
+            open_files();
+        }
+        flush();
+
+        lock.lock();
+    }
+
+    // 退出前把剩下的都写出去
+    flush();
+}
+
+void gate_logger::flush()
+{
+    std::vector<spsc_ring<log_record>*> rings;
+    {
+        std::lock_guard guard(rings_mutex_);
+        for (const auto& ring : rings_)
+            rings.push_back(ring.get());
+    }
+
+    std::vector<line> access_lines, error_lines;
+    std::vector<size_t> access_sizes, error_sizes;
+    access_lines.reserve(batch_lines);
+    error_lines.reserve(batch_lines);
+
+    auto drain = [](const int fd, std::vector<line>& lines, std::vector<size_t>& sizes)
+    {
+        write_lines(fd, lines, sizes);
+        lines.clear();
+        sizes.clear();
+    };
+
+    log_record record;
+    for (auto* ring : rings)
+    {
+        while (ring->pop(record))
+        {
+            const bool is_access = record.type == log_record::kind::access;
+            auto& lines = is_access ? access_lines : error_lines;
+            auto& sizes = is_access ? access_sizes : error_sizes;
+
+            sizes.push_back(format_record(record, lines.emplace_back()));
+
+            if (lines.size() == batch_lines)
+                drain(is_access ? access_fd_ : error_fd_, lines, sizes);
+        }
+    }
+
+    drain(access_fd_, access_lines, access_sizes);
+    drain(error_fd_, error_lines, error_sizes);
+}
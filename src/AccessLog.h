@@ -0,0 +1,106 @@
+//
+// Created by cinea on 24-2-28.
+//
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <boost/asio/ip/address.hpp>
+
+#include "utils/SpscRing.hpp"
+
+struct log_options
+{
+    std::string access_log; // 为空时不记录访问日志
+    std::string error_log; // 为空时写到标准错误
+    size_t buffer_records{4096}; // 每个线程的缓冲区能放多少条，满了就丢弃
+    std::chrono::milliseconds flush_interval{100};
+};
+
+/**
+ * \brief 固定大小的日志记录，IO线程只做拷贝，格式化交给后台线程。
+ */
+struct log_record
+{
+    enum class kind : unsigned char { access, error };
+
+    kind type{kind::access};
+    std::chrono::system_clock::time_point time;
+
+    boost::asio::ip::address remote;
+    unsigned status{0};
+    unsigned version{11};
+    uint64_t bytes{0};
+    uint64_t duration_us{0};
+    char method[16]{};
+    char text[256]{}; // 访问日志是请求目标，错误日志是错误信息
+};
+
+/**
+ * \brief 异步日志。
+ *
+ * 每个线程往自己的无锁环形缓冲区里写记录，后台线程定期批量格式化并用writev追加写入文件。
+ * 缓冲区满时直接丢弃，不会阻塞IO线程。
+ */
+class gate_logger
+{
+    log_options options_;
+
+    std::mutex rings_mutex_;
+    std::vector<std::unique_ptr<spsc_ring<log_record>>> rings_;
+
+    std::atomic_bool running_{false};
+    std::atomic_bool reopen_{false};
+    std::atomic_uint64_t dropped_{0};
+
+    int access_fd_{-1};
+    int error_fd_{-1};
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::thread writer_;
+
+public:
+    ~gate_logger();
+
+    void start(const log_options& options);
+    void stop();
+
+    // 重新打开日志文件，配合logrotate使用
+    void reopen();
+
+    [[nodiscard]] bool access_enabled() const
+    {
+        return running_.load(std::memory_order_relaxed) && !options_.access_log.empty();
+    }
+
+    void access(const boost::asio::ip::address& remote, std::string_view method, std::string_view target,
+                unsigned version, unsigned status, uint64_t bytes, std::chrono::steady_clock::duration duration);
+
+    void error(std::string_view what, std::string_view message);
+
+    [[nodiscard]] uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    spsc_ring<log_record>& local();
+    void push(const log_record& record);
+
+    void open_files();
+    void close_files();
+
+    void run();
+    void flush();
+};
+
+extern gate_logger gate_log;
+
+#endif //ACCESSLOG_H
@@ -0,0 +1,359 @@
+//
+// Created by cinea on 24-3-8.
+//
+
+#include "Admin.h"
+
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <cstdio>
+#include <optional>
+#include <unistd.h>
+#include <boost/url.hpp>
+
+#include "ConnectionManager.h"
+#include "Gateway.h"
+#include "Metrics.h"
+#include "StaticFileHandler.h"
+#include "Trace.h"
+#include "Upgrade.h"
+
+namespace
+{
+    using admin_request = http::request<http::string_body>;
+    using admin_response = http::response<http::string_body>;
+
+    admin_response json_response(const admin_request& req, const http::status status, std::string body)
+    {
+        admin_response res{status, req.version()};
+        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res.set(http::field::content_type, "application/json");
+        res.set(http::field::cache_control, "no-store");
+        res.keep_alive(req.keep_alive());
+        res.body() = std::move(body);
+        res.prepare_payload();
+        return res;
+    }
+
+    admin_response error_response(const admin_request& req, const http::status status, const std::string_view message)
+    {
+        std::string body = "{\"error\":";
+        append_json_string(body, message);
+        body += '}';
+        return json_response(req, status, std::move(body));
+    }
+
+    void append_connections(std::string& out)
+    {
+        const auto& options = conn_manager.options();
+        out += "{\"active\":" + std::to_string(conn_manager.active());
+        out += ",\"idle\":" + std::to_string(conn_manager.idle());
+        out += ",\"max_connections\":" + std::to_string(options.max_connections);
+        out += ",\"max_keep_alive\":" + std::to_string(options.max_keep_alive);
+        out += ",\"draining\":";
+        out += conn_manager.draining() ? "true" : "false";
+        out += '}';
+    }
+
+    // 缓存的键是doc_root/./path，显示时只留下请求的路径
+    void append_file(std::string& out, const std::string& root, const static_cache_entry& entry)
+    {
+        const std::string_view path(entry.path);
+        out += "{\"path\":";
+        append_json_string(out, path.starts_with(root) ? path.substr(root.size()) : path);
+        out += ",\"bytes\":" + std::to_string(entry.size);
+        out += ",\"hits\":" + std::to_string(entry.hits);
+        out += ",\"last_modified\":";
+        append_json_string(out, entry.last_modified);
+        out += '}';
+    }
+
+    void append_cache(std::string& out, const std::string& root, const size_t top)
+    {
+        auto entries = static_cache_entries();
+
+        uint64_t bytes = 0;
+        for (const auto& entry : entries)
+            bytes += entry.size;
+
+        const auto hits = gate_metrics.total(gate_counter::static_cache_hits);
+        const auto misses = gate_metrics.total(gate_counter::static_cache_misses);
+        char ratio[32];
+        std::snprintf(ratio, sizeof(ratio), "%.4f",
+                      hits + misses == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(hits + misses));
+
+        out += "{\"entries\":" + std::to_string(entries.size());
+        out += ",\"capacity\":" + std::to_string(static_cache_capacity());
+        out += ",\"bytes\":" + std::to_string(bytes);
+        out += ",\"negative_entries\":" + std::to_string(static_negative_entries());
+        out += ",\"hits\":" + std::to_string(hits);
+        out += ",\"misses\":" + std::to_string(misses);
+        out += ",\"hit_ratio\":";
+        out += ratio;
+        out += ",\"evictions\":" + std::to_string(gate_metrics.total(gate_counter::static_cache_evictions));
+
+        // 按最近使用的顺序
+        out += ",\"files\":[";
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (i > 0)
+                out += ',';
+            append_file(out, root, entries[i]);
+        }
+
+        const auto count = std::min(top, entries.size());
+        std::partial_sort(entries.begin(), entries.begin() + static_cast<std::ptrdiff_t>(count), entries.end(),
+                          [](const auto& a, const auto& b) { return a.hits > b.hits; });
+
+        out += "],\"hottest\":[";
+        for (size_t i = 0; i < count; i++)
+        {
+            if (i > 0)
+                out += ',';
+            append_file(out, root, entries[i]);
+        }
+        out += "]}";
+    }
+
+    void append_upstreams(std::string& out)
+    {
+        out += '[';
+        bool first = true;
+        for (const auto& proxy : gateway_proxies())
+        {
+            if (!first)
+                out += ',';
+            first = false;
+
+            const auto url = proxy.url().buffer();
+            const auto concurrency = proxy.limiter().snapshot();
+
+            out += "{\"prefix\":";
+            append_json_string(out, proxy.prefix());
+            out += ",\"url\":";
+            append_json_string(out, std::string_view(url.data(), url.size()));
+            out += ",\"circuit\":\"";
+            out += proxy.breaker().state();
+            out += "\",\"failures\":" + std::to_string(proxy.breaker().failures());
+            out += ",\"max_concurrency\":" + std::to_string(proxy.options().concurrency.max_concurrency);
+            out += ",\"limit\":" + std::to_string(concurrency.limit);
+            out += ",\"active\":" + std::to_string(concurrency.active);
+            out += ",\"queued\":" + std::to_string(concurrency.queued);
+            out += '}';
+        }
+        out += ']';
+    }
+
+    admin_response handle_admin_request(const admin_request& req, const std::filesystem::path& doc_root,
+                                        const size_t default_top)
+    {
+        const auto url = boost::urls::parse_origin_form(req.target());
+        if (!url)
+            return error_response(req, http::status::bad_request, "invalid target");
+
+        const auto path = url->path();
+        const auto params = url->params();
+        auto param = [&](const char* key) -> std::optional<std::string>
+        {
+            const auto it = params.find(key);
+            if (it == params.end() || !(*it).has_value)
+                return std::nullopt;
+            return (*it).value;
+        };
+
+        const auto root = (doc_root / ".").native();
+
+        if (req.method() == http::verb::get)
+        {
+            auto top = default_top;
+            if (const auto value = param("top"))
+                std::from_chars(value->data(), value->data() + value->size(), top);
+
+            std::string out;
+            if (path == "/connections")
+                append_connections(out);
+            else if (path == "/cache")
+                append_cache(out, root, top);
+            else if (path == "/upstreams")
+                append_upstreams(out);
+            else if (path == "/trace")
+                out = gate_trace.dump();
+            else if (path == "/")
+            {
+                out += "{\"connections\":";
+                append_connections(out);
+                out += ",\"cache\":";
+                append_cache(out, root, top);
+                out += ",\"upstreams\":";
+                append_upstreams(out);
+                out += '}';
+            }
+            else
+                return error_response(req, http::status::not_found, "not found");
+
+            return json_response(req, http::status::ok, std::move(out));
+        }
+
+        if (req.method() != http::verb::post)
+            return error_response(req, http::status::method_not_allowed, "method not allowed");
+
+        if (path == "/cache/purge")
+        {
+            const auto exact = param("path");
+            const auto prefix = param("prefix");
+            const auto& target = exact ? exact : prefix;
+            if (exact.has_value() == prefix.has_value() || target->empty() || target->front() != '/')
+                return error_response(req, http::status::bad_request, "expected path=/... or prefix=/...");
+
+            // 和处理请求时拼出来的路径一样，以/结尾的请求读的是目录下的index.html
+            auto key = root + *target;
+            if (exact && key.back() == '/')
+                key += "index.html";
+
+            const auto purged = purge_static_cache(key, prefix.has_value());
+            return json_response(req, http::status::ok, "{\"purged\":" + std::to_string(purged) + "}");
+        }
+
+        if (path == "/reload")
+        {
+            if (conn_manager.draining())
+                return error_response(req, http::status::conflict, "shutting down");
+            if (upgrade_in_progress())
+                return error_response(req, http::status::conflict, "upgrade already in progress");
+
+            // 交给main里SIGUSR2的处理，和从外面发信号一样
+            ::raise(SIGUSR2);
+            return json_response(req, http::status::accepted,
+                                 "{\"reload\":\"upgrading\",\"pid\":" + std::to_string(getpid()) + "}");
+        }
+
+        return error_response(req, http::status::not_found, "not found");
+    }
+
+    net::awaitable<void> serve_admin(tcp::socket socket, const std::shared_ptr<const std::filesystem::path> doc_root,
+                                     const size_t top)
+    {
+        beast::tcp_stream stream(std::move(socket));
+        beast::flat_buffer buffer;
+        beast::error_code ec;
+
+        for (;;)
+        {
+            stream.expires_after(conn_manager.options().request_timeout);
+
+            admin_request req;
+            co_await http::async_read(stream, buffer, req, with_error(ec));
+            if (ec == http::error::end_of_stream)
+                break;
+            if (ec)
+            {
+                if (ec != beast::error::timeout)
+                    fail(ec, "admin read");
+                co_return;
+            }
+
+            auto res = handle_admin_request(req, *doc_root, top);
+            co_await http::async_write(stream, res, with_error(ec));
+            if (ec)
+            {
+                fail(ec, "admin write");
+                co_return;
+            }
+
+            if (!res.keep_alive())
+                break;
+        }
+
+        boost::ignore_unused(stream.socket().shutdown(tcp::socket::shutdown_send, ec));
+    }
+}
+
+admin_listener::admin_listener(net::io_context& ioc, std::shared_ptr<const std::filesystem::path> doc_root,
+                               const admin_options& options):
+    ioc_(ioc), acceptor_(make_strand(ioc)), doc_root_(std::move(doc_root)), options_(options)
+{
+    beast::error_code ec;
+    const tcp::endpoint endpoint{net::ip::make_address(options_.address), options_.port};
+
+    // 平滑升级时和客户端端口一样接过上一个进程的socket
+    if (const auto fd = take_inherited_listener(endpoint); fd >= 0)
+    {
+        boost::ignore_unused(acceptor_.assign(endpoint.protocol(), fd, ec));
+        if (ec)
+        {
+            fail(ec, "admin assign");
+            return;
+        }
+    }
+    else
+    {
+        boost::ignore_unused(acceptor_.open(endpoint.protocol(), ec));
+        if (ec)
+        {
+            fail(ec, "admin open");
+            return;
+        }
+
+        boost::ignore_unused(acceptor_.set_option(net::socket_base::reuse_address(true), ec));
+        if (ec)
+        {
+            fail(ec, "admin set_option");
+            return;
+        }
+
+        boost::ignore_unused(acceptor_.bind(endpoint, ec));
+        if (ec)
+        {
+            fail(ec, "admin bind");
+            return;
+        }
+    }
+
+    boost::ignore_unused(acceptor_.listen(net::socket_base::max_listen_connections, ec));
+    if (ec)
+    {
+        fail(ec, "admin listen");
+        return;
+    }
+}
+
+void admin_listener::run()
+{
+    if (acceptor_.is_open())
+        do_accept();
+}
+
+void admin_listener::stop()
+{
+    net::post(acceptor_.get_executor(), [self = shared_from_this()]
+    {
+        beast::error_code ec;
+        boost::ignore_unused(self->acceptor_.close(ec));
+    });
+}
+
+void admin_listener::do_accept()
+{
+    acceptor_.async_accept(
+        make_strand(ioc_),
+        beast::bind_front_handler(&admin_listener::on_accept, shared_from_this()));
+}
+
+void admin_listener::on_accept(const beast::error_code& ec, tcp::socket socket)
+{
+    // stop()关闭了接收器
+    if (ec == net::error::operation_aborted)
+        return;
+
+    if (ec)
+    {
+        fail(ec, "admin accept");
+        return;
+    }
+
+    auto executor = socket.get_executor();
+    net::co_spawn(executor, serve_admin(std::move(socket), doc_root_, options_.top), net::detached);
+
+    do_accept();
+}
@@ -0,0 +1,59 @@
+//
+// Created by cinea on 24-3-8.
+//
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include "Common.h"
+
+struct admin_options
+{
+    bool enabled{false};
+    std::string address{"127.0.0.1"}; // 只能是回环地址
+    unsigned short port{8081};
+    size_t top{20}; // 默认列出多少个最热的文件
+};
+
+/**
+ * \brief 只在本机监听的管理端口，返回JSON：
+ *
+ *   GET  /                       下面三项合在一起
+ *   GET  /connections            连接数、空闲连接数和限制，是否正在退出
+ *   GET  /cache?top=N            缓存的文件和大小、命中率、命中最多的N个文件
+ *   GET  /upstreams              每个上游的熔断状态和并发（当前上限、进行中、排队）
+ *   GET  /trace                  打开了[trace]时保存的慢请求和各阶段的时间，最新的在前；目标带着查询参数，所以只在这里给出
+ *   POST /cache/purge?path=/a.js 从缓存里去掉一个文件；?prefix=/assets/去掉一个目录下的所有文件
+ *   POST /reload                 和SIGUSR2一样平滑升级：新进程读新的配置，接过监听端口，预热完后本进程退出
+ *
+ * 管理连接不计入连接管理器，不占用客户端的连接数。
+ */
+class admin_listener : public std::enable_shared_from_this<admin_listener>
+{
+    net::io_context& ioc_;
+    tcp::acceptor acceptor_;
+    std::shared_ptr<const std::filesystem::path> doc_root_;
+    admin_options options_;
+
+public:
+    admin_listener(net::io_context& ioc, std::shared_ptr<const std::filesystem::path> doc_root,
+                   const admin_options& options);
+
+    void run();
+
+    // 停止接受新连接
+    void stop();
+
+    // 平滑升级时传给新进程
+    [[nodiscard]] int native_handle() { return acceptor_.native_handle(); }
+
+private:
+    void do_accept();
+    void on_accept(const beast::error_code& ec, tcp::socket socket);
+};
+
+#endif //ADMIN_H
@@ -0,0 +1,89 @@
+//
+// Created by cinea on 24-3-6.
+//
+
+#include "BlockingPool.h"
+
+#include <algorithm>
+
+#include "Metrics.h"
+
+blocking_pool gate_blocking;
+
+blocking_pool::~blocking_pool()
+{
+    stop();
+}
+
+void blocking_pool::start(const blocking_pool_options& options)
+{
+    if (running_.load())
+        return;
+
+    options_ = options;
+    running_.store(true);
+
+    for (unsigned i = 0; i < std::max(options_.threads, 1u); i++)
+        threads_.emplace_back([this] { run(); });
+}
+
+void blocking_pool::stop()
+{
+    {
+        // 在锁里清掉标志：工作线程检查完条件、还没开始等待时，不会错过下面的通知
+        std::lock_guard guard(mutex_);
+        if (!running_.exchange(false))
+            return;
+    }
+
+    wake_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+    threads_.clear();
+}
+
+void blocking_pool::post(blocking_task&& task)
+{
+    gate_metrics.add(gate_counter::blocking_tasks);
+
+    if (running_.load(std::memory_order_relaxed))
+    {
+        std::unique_lock lock(mutex_);
+        if (queue_.size() < options_.queue_size)
+        {
+            queue_.push_back(std::move(task));
+            depth_.store(queue_.size(), std::memory_order_relaxed);
+            lock.unlock();
+
+            wake_.notify_one();
+            return;
+        }
+    }
+
+    gate_metrics.add(gate_counter::blocking_overflows);
+    task();
+}
+
+void blocking_pool::run()
+{
+    while (true)
+    {
+        blocking_task task;
+        {
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [this] { return !queue_.empty() || !running_.load(); });
+
+            // 停止时把剩下的也运行完，不能丢下等着响应的请求
+            if (queue_.empty())
+                return;
+
+            task = std::move(queue_.front());
+            queue_.pop_front();
+            depth_.store(queue_.size(), std::memory_order_relaxed);
+        }
+
+        busy_.fetch_add(1, std::memory_order_relaxed);
+        task();
+        busy_.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,67 @@
+//
+// Created by cinea on 24-3-6.
+//
+
+#ifndef BLOCKINGPOOL_H
+#define BLOCKINGPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils/UniqueHandler.hpp"
+
+using blocking_task = unique_handler<void()>;
+
+struct blocking_pool_options
+{
+    unsigned threads{4}; // 做阻塞工作（访问文件系统）的线程数
+    size_t queue_size{1024}; // 最多排队多少个任务，满了就在调用者的线程上直接运行
+};
+
+/**
+ * \brief 专门运行阻塞工作的线程池，IO线程不用等磁盘。
+ *
+ * 队列有上限：满了说明磁盘已经跟不上，任务直接在调用者的线程上运行，
+ * 这样IO线程自己也慢下来，不会无限地接受新请求。没有启动时任务都在调用者的线程上运行。
+ */
+class blocking_pool
+{
+    blocking_pool_options options_;
+    std::atomic_bool running_{false};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<blocking_task> queue_;
+    std::vector<std::thread> threads_;
+
+    std::atomic<size_t> depth_{0};
+    std::atomic<size_t> busy_{0};
+
+public:
+    ~blocking_pool();
+
+    // 必须在IO线程启动前调用
+    void start(const blocking_pool_options& options);
+
+    // 队列里剩下的任务会先运行完
+    void stop();
+
+    /**
+     * \brief 在后台线程上运行task。task要自己把结果投递回请求所在的strand。
+     */
+    void post(blocking_task&& task);
+
+    [[nodiscard]] size_t queue_depth() const { return depth_.load(std::memory_order_relaxed); }
+    [[nodiscard]] size_t busy() const { return busy_.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+};
+
+extern blocking_pool gate_blocking;
+
+#endif //BLOCKINGPOOL_H
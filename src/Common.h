@@ -11,6 +11,8 @@
 #include <boost/beast.hpp>
 #include <boost/beast/http.hpp>
 
+#include "AccessLog.h"
+
 namespace beast = boost::beast; // from <boost/beast.hpp>
 namespace http = beast::http; // from <boost/beast/http.hpp>
 namespace net = boost::asio; // from <boost/asio.hpp>
@@ -20,7 +22,13 @@ using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 inline void
 fail(const beast::error_code& ec, char const* what)
 {
-    std::cerr << what << ": " << ec.message() << std::endl;
+    gate_log.error(what, ec.message());
+}
+
+// 协程里的异步操作失败时写入ec，不抛异常，和回调的写法保持一致
+inline auto with_error(beast::error_code& ec)
+{
+    return net::redirect_error(net::use_awaitable, ec);
 }
 
 inline time_t fs_time_to_time_t(const std::chrono::time_point<std::filesystem::__file_clock>& fs_time)
@@ -0,0 +1,97 @@
+//
+// Created by cinea on 24-3-3.
+//
+
+#include "ConcurrencyLimiter.h"
+
+#include <algorithm>
+
+concurrency_limiter::concurrency_limiter(const concurrency_options& options):
+    options_(options), limit_(options.max_concurrency)
+{
+    options_.min_concurrency = std::clamp(options_.min_concurrency, 1u, std::max(options_.max_concurrency, 1u));
+}
+
+concurrency_limiter::result concurrency_limiter::acquire(const std::shared_ptr<limiter_waiter>& waiter)
+{
+    if (unlimited())
+        return result::acquired;
+
+    std::lock_guard guard(mutex_);
+
+    if (active_ < static_cast<unsigned>(limit_))
+    {
+        active_++;
+        return result::acquired;
+    }
+
+    if (queue_.size() >= options_.queue_size)
+        return result::rejected;
+
+    queue_.push_back(waiter);
+    return result::queued;
+}
+
+bool concurrency_limiter::cancel(const std::shared_ptr<limiter_waiter>& waiter)
+{
+    std::lock_guard guard(mutex_);
+
+    const auto it = std::find(queue_.begin(), queue_.end(), waiter);
+    if (it == queue_.end())
+        return false;
+
+    queue_.erase(it);
+    return true;
+}
+
+void concurrency_limiter::release(const std::chrono::steady_clock::duration latency, const bool ok)
+{
+    if (unlimited())
+        return;
+
+    std::shared_ptr<limiter_waiter> next;
+    {
+        std::lock_guard guard(mutex_);
+
+        if (options_.adaptive)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            if (!ok || latency > options_.latency_target)
+            {
+                if (now - last_decrease_ >= options_.latency_target)
+                {
+                    limit_ = std::max<double>(options_.min_concurrency, limit_ * 0.8);
+                    last_decrease_ = now;
+                }
+            }
+            else
+            {
+                limit_ = std::min<double>(options_.max_concurrency, limit_ + 1.0 / limit_);
+            }
+        }
+
+        // 名额直接转给排在最前面的请求
+        if (!queue_.empty() && active_ <= static_cast<unsigned>(limit_))
+        {
+            next = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        else
+        {
+            active_--;
+        }
+    }
+
+    // 不在锁里调用，grant会投递到别的strand上
+    if (next)
+        next->grant();
+}
+
+concurrency_limiter::state concurrency_limiter::snapshot()
+{
+    if (unlimited())
+        return {};
+
+    std::lock_guard guard(mutex_);
+    return {static_cast<unsigned>(limit_), active_, queue_.size()};
+}
@@ -0,0 +1,82 @@
+//
+// Created by cinea on 24-3-3.
+//
+
+#ifndef CONCURRENCYLIMITER_H
+#define CONCURRENCYLIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+struct concurrency_options
+{
+    unsigned max_concurrency{0}; // 同时发往上游的请求数，0表示不限制
+    unsigned min_concurrency{1}; // 自适应调整时的下限
+    size_t queue_size{100}; // 超出并发时最多排队多少个请求，满了直接返回503
+    std::chrono::milliseconds queue_timeout{1000}; // 排队超过这个时间也返回503
+    bool adaptive{false}; // 按上游的延迟自动调整上限（AIMD）
+    std::chrono::milliseconds latency_target{500}; // 超过这个延迟就认为上游过载
+};
+
+/**
+ * \brief 排队中的请求。拿到名额时limiter会调用grant，grant里要自己切换回请求所在的strand。
+ */
+struct limiter_waiter
+{
+    std::function<void()> grant;
+};
+
+/**
+ * \brief 单个上游的并发限制，超出时按先来先到排队。
+ *
+ * 打开adaptive时用AIMD调整上限：请求成功且延迟低于目标时每次加1/limit（大约每一轮加1），
+ * 失败或者延迟超标时乘以0.8，每个latency_target时间内最多减一次，避免一次慢请求的波动把上限压到底。
+ */
+class concurrency_limiter
+{
+    concurrency_options options_;
+
+    std::mutex mutex_;
+    double limit_;
+    unsigned active_{0};
+    std::deque<std::shared_ptr<limiter_waiter>> queue_;
+    std::chrono::steady_clock::time_point last_decrease_;
+
+public:
+    enum class result { acquired, queued, rejected };
+
+    struct state
+    {
+        unsigned limit{0}; // 当前的上限，不限制时为0
+        unsigned active{0};
+        size_t queued{0};
+    };
+
+    explicit concurrency_limiter(const concurrency_options& options);
+
+    /**
+     * \brief 申请一个名额。返回queued时，拿到名额后会调用waiter->grant。
+     */
+    result acquire(const std::shared_ptr<limiter_waiter>& waiter);
+
+    /**
+     * \brief 排队超时时调用。返回false说明已经拿到名额了（grant已经或者即将被调用）。
+     */
+    bool cancel(const std::shared_ptr<limiter_waiter>& waiter);
+
+    /**
+     * \brief 请求结束，归还名额并记录这次的延迟。
+     */
+    void release(std::chrono::steady_clock::duration latency, bool ok);
+
+    [[nodiscard]] state snapshot();
+
+private:
+    [[nodiscard]] bool unlimited() const { return options_.max_concurrency == 0; }
+};
+
+#endif //CONCURRENCYLIMITER_H
@@ -0,0 +1,107 @@
+//
+// Created by cinea on 24-2-26.
+//
+
+#include "ConnectionManager.h"
+
+#include <algorithm>
+
+connection_manager conn_manager;
+
+connection_manager::connection_manager()
+{
+    configure(options_, 1);
+}
+
+void connection_manager::configure(const connection_options& options, const size_t threads)
+{
+    options_ = options;
+
+    const auto count = std::max<size_t>(threads, 1);
+    const auto capacity = std::max<size_t>(options_.max_keep_alive / count, 1);
+
+    shards_.clear();
+    for (size_t i = 0; i < count; i++)
+        shards_.push_back(std::make_unique<shard>(capacity));
+}
+
+size_t connection_manager::current_shard() const
+{
+    static std::atomic_size_t next_thread{0};
+    thread_local const size_t thread_index = next_thread.fetch_add(1);
+
+    return thread_index % shards_.size();
+}
+
+size_t connection_manager::open()
+{
+    const auto index = current_shard();
+    shards_[index]->active.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+void connection_manager::close(const size_t shard)
+{
+    shards_[shard]->active.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void connection_manager::add_idle(const size_t shard, const std::shared_ptr<keep_alive_connection>& conn)
+{
+    if (draining())
+        return conn->evict();
+
+    const auto key = reinterpret_cast<std::uintptr_t>(conn.get());
+    const auto popped = shards_[shard]->idle.insert(key, std::weak_ptr<keep_alive_connection>(conn));
+
+    // start_drain可能正好在上面的检查之后取走了列表
+    if (draining() && shards_[shard]->idle.remove(key))
+        conn->evict();
+
+    // 在锁外通知被淘汰的连接
+    if (popped.has_value())
+    {
+        if (const auto evicted = popped->second.lock())
+            evicted->evict();
+    }
+}
+
+void connection_manager::remove_idle(const size_t shard, const keep_alive_connection* conn)
+{
+    shards_[shard]->idle.remove(reinterpret_cast<std::uintptr_t>(conn));
+}
+
+bool connection_manager::allow_keep_alive() const
+{
+    return !draining() && active() <= options_.max_connections;
+}
+
+void connection_manager::start_drain()
+{
+    draining_ = true;
+
+    // 在start_drain之后加入的连接由add_idle淘汰，这里只处理已经在列表里的
+    for (const auto& shard : shards_)
+    {
+        for (auto& [key, conn] : shard->idle.take_all())
+        {
+            if (const auto evicted = conn.lock())
+                evicted->evict();
+        }
+    }
+}
+
+size_t connection_manager::active() const
+{
+    size_t total = 0;
+    for (const auto& shard : shards_)
+        total += shard->active.load(std::memory_order_relaxed);
+    return total;
+}
+
+size_t connection_manager::idle() const
+{
+    size_t total = 0;
+    for (const auto& shard : shards_)
+        total += shard->idle.size();
+    return total;
+}
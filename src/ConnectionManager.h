@@ -0,0 +1,136 @@
+//
+// Created by cinea on 24-2-26.
+//
+
+#ifndef CONNECTIONMANAGER_H
+#define CONNECTIONMANAGER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "utils/LruList.hpp"
+
+struct connection_options
+{
+    size_t max_connections{10000}; // 超过后响应完就关闭连接，不再保持
+    size_t max_keep_alive{4096}; // 最多保留多少个空闲Keep-Alive连接，超出时淘汰最久未用的
+    std::chrono::seconds idle_timeout{30}; // Keep-Alive连接等待下一个请求的时间
+    std::chrono::seconds request_timeout{30}; // 读请求、写响应的时间
+};
+
+/**
+ * \brief 可以被淘汰的空闲连接。
+ */
+class keep_alive_connection
+{
+public:
+    virtual ~keep_alive_connection() = default;
+
+    // 可能在任意线程上被调用
+    virtual void evict() = 0;
+};
+
+/**
+ * \brief 连接管理：按线程分片计数，空闲连接按LRU淘汰。
+ *
+ * 每个IO线程使用自己的分片，计数不会争用同一个原子变量；
+ * 连接记住自己登记的分片，在其他线程上结束时也能正确归还。
+ */
+class connection_manager
+{
+    struct alignas(64) shard
+    {
+        std::atomic_size_t active{0};
+        lru_list<std::uintptr_t, std::weak_ptr<keep_alive_connection>> idle;
+
+        explicit shard(const size_t capacity): idle(capacity)
+        {
+        }
+    };
+
+    connection_options options_;
+    std::vector<std::unique_ptr<shard>> shards_;
+    std::atomic_bool draining_{false};
+
+public:
+    connection_manager();
+
+    // 必须在IO线程启动前调用
+    void configure(const connection_options& options, size_t threads);
+
+    [[nodiscard]] const connection_options& options() const { return options_; }
+
+    /**
+     * \brief 登记一个新连接，返回所在分片。
+     */
+    size_t open();
+    void close(size_t shard);
+
+    /**
+     * \brief 连接开始等待下一个请求，空闲连接超出预算时淘汰本分片中最久未用的。
+     */
+    void add_idle(size_t shard, const std::shared_ptr<keep_alive_connection>& conn);
+    void remove_idle(size_t shard, const keep_alive_connection* conn);
+
+    // 连接总数是否还允许保持长连接
+    [[nodiscard]] bool allow_keep_alive() const;
+
+    /**
+     * \brief 进程准备退出：淘汰所有空闲连接，之后的响应不再保持长连接，
+     * 变成空闲的连接立即被淘汰。正在处理的请求照常完成。
+     */
+    void start_drain();
+    [[nodiscard]] bool draining() const { return draining_.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] size_t active() const;
+    [[nodiscard]] size_t idle() const;
+
+private:
+    [[nodiscard]] size_t current_shard() const;
+};
+
+/**
+ * \brief 连接在管理器中的登记，析构时归还。连接转交给其他session时一起移动。
+ */
+class connection_slot
+{
+    connection_manager* manager_{nullptr};
+    size_t shard_{0};
+
+public:
+    connection_slot() = default;
+
+    explicit connection_slot(connection_manager& manager): manager_(&manager), shard_(manager.open())
+    {
+    }
+
+    connection_slot(connection_slot&& other) noexcept: manager_(other.manager_), shard_(other.shard_)
+    {
+        other.manager_ = nullptr;
+    }
+
+    connection_slot& operator=(connection_slot&& other) noexcept
+    {
+        std::swap(manager_, other.manager_);
+        std::swap(shard_, other.shard_);
+        return *this;
+    }
+
+    connection_slot(const connection_slot&) = delete;
+    connection_slot& operator=(const connection_slot&) = delete;
+
+    ~connection_slot()
+    {
+        if (manager_)
+            manager_->close(shard_);
+    }
+
+    [[nodiscard]] size_t shard() const { return shard_; }
+};
+
+extern connection_manager conn_manager;
+
+#endif //CONNECTIONMANAGER_H
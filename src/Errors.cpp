@@ -54,3 +54,88 @@ server_error(http::request<http::dynamic_body> &&req,
   res.prepare_payload();
   return res;
 }
+
+http::message_generator
+bad_gateway(http::request<http::dynamic_body> &&req,
+            const beast::string_view& what) {
+  http::response<http::string_body> res{http::status::bad_gateway,
+                                        req.version()};
+
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(req.keep_alive());
+  res.body() = "Bad gateway: '"s + std::string(what) + "'"s;
+  res.prepare_payload();
+  return res;
+}
+
+http::message_generator
+service_unavailable(http::request<http::dynamic_body> &&req,
+                    const beast::string_view& what) {
+  http::response<http::string_body> res{http::status::service_unavailable,
+                                        req.version()};
+
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.set(http::field::retry_after, "1");
+  res.keep_alive(req.keep_alive());
+  res.body() = "Service unavailable: '"s + std::string(what) + "'"s;
+  res.prepare_payload();
+  return res;
+}
+
+http::message_generator
+gateway_timeout(http::request<http::dynamic_body> &&req,
+                const beast::string_view& what) {
+  http::response<http::string_body> res{http::status::gateway_timeout,
+                                        req.version()};
+
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(req.keep_alive());
+  res.body() = "Gateway timeout: '"s + std::string(what) + "'"s;
+  res.prepare_payload();
+  return res;
+}
+
+http::message_generator
+too_many_requests(http::request<http::dynamic_body> &&req) {
+  http::response<http::string_body> res{http::status::too_many_requests,
+                                        req.version()};
+
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.set(http::field::retry_after, "1");
+  res.keep_alive(req.keep_alive());
+  res.body() = "Too many requests";
+  res.prepare_payload();
+  return res;
+}
+
+http::message_generator
+unauthorized(http::request<http::dynamic_body> &&req,
+             const beast::string_view &challenge) {
+  http::response<http::string_body> res{http::status::unauthorized,
+                                        req.version()};
+
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.set(http::field::www_authenticate, challenge);
+  res.keep_alive(req.keep_alive());
+  res.body() = "Unauthorized";
+  res.prepare_payload();
+  return res;
+}
+
+http::message_generator
+payload_too_large(http::request<http::dynamic_body> &&req) {
+  http::response<http::string_body> res{http::status::payload_too_large,
+                                        req.version()};
+
+  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+  res.set(http::field::content_type, "text/html");
+  res.keep_alive(req.keep_alive());
+  res.body() = "Request body too large";
+  res.prepare_payload();
+  return res;
+}
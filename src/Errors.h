@@ -19,4 +19,26 @@ http::message_generator
 server_error(http::request<http::dynamic_body>&& req,
              const beast::string_view& what);
 
+http::message_generator
+bad_gateway(http::request<http::dynamic_body>&& req,
+            const beast::string_view& what);
+
+http::message_generator
+service_unavailable(http::request<http::dynamic_body>&& req,
+                    const beast::string_view& what);
+
+http::message_generator
+gateway_timeout(http::request<http::dynamic_body>&& req,
+                const beast::string_view& what);
+
+http::message_generator
+too_many_requests(http::request<http::dynamic_body>&& req);
+
+http::message_generator
+unauthorized(http::request<http::dynamic_body>&& req,
+             const beast::string_view& challenge);
+
+http::message_generator
+payload_too_large(http::request<http::dynamic_body>&& req);
+
 #endif //ERRORS_H
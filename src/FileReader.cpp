@@ -0,0 +1,242 @@
+//
+// Created by cinea on 24-3-6.
+//
+
+#include "FileReader.h"
+
+#include <algorithm>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+
+file_reader gate_files;
+
+#ifdef FORUM_GATE_IO_URING
+// 一次读文件的状态，地址作为io_uring请求的user_data
+struct file_reader::uring_read
+{
+    std::string path;
+    uint64_t size{0};
+    file_read_handler handler;
+
+    int fd{-1};
+    std::vector<u_char> data;
+    uint64_t offset{0};
+};
+
+#endif
+
+std::vector<u_char> read_whole_file(const std::string& path, beast::error_code& ec)
+{
+    // 打开文件
+    beast::file_posix file;
+    file.open(path.c_str(), beast::file_mode::scan, ec);
+
+    if (ec) { return std::vector<u_char>{}; }
+
+    // 读取文件内容到缓存
+    std::vector<u_char> file_contents(file.size(ec));
+    file.read(file_contents.data(), file_contents.size(), ec);
+
+    if (ec) { return std::vector<u_char>{}; }
+
+    return file_contents;
+}
+
+file_reader::~file_reader()
+{
+    stop();
+}
+
+void file_reader::start(const file_reader_options& options)
+{
+    if (running_.load())
+        return;
+
+    options_ = options;
+    running_.store(true);
+
+#ifdef FORUM_GATE_IO_URING
+    if (options_.io_uring)
+        start_uring();
+#endif
+}
+
+void file_reader::stop()
+{
+    if (!running_.exchange(false))
+        return;
+
+#ifdef FORUM_GATE_IO_URING
+    if (uring_)
+        stop_uring();
+#endif
+}
+
+void file_reader::async_read(std::string path, const uint64_t size, file_read_handler&& handler)
+{
+#ifdef FORUM_GATE_IO_URING
+    if (uring_ && running_.load(std::memory_order_relaxed))
+    {
+        pending_.fetch_add(1);
+        return submit_open(new uring_read{std::move(path), size, std::move(handler)});
+    }
+#endif
+
+    beast::error_code ec;
+    auto data = read_whole_file(path, ec);
+    handler(ec, std::move(data));
+}
+
+const char* file_reader::backend() const
+{
+#ifdef FORUM_GATE_IO_URING
+    if (uring_)
+        return "io_uring";
+#endif
+    return "sync";
+}
+
+#ifdef FORUM_GATE_IO_URING
+
+bool file_reader::start_uring()
+{
+    // 老内核或者被seccomp禁用时返回错误，改用线程池
+    if (const auto ret = io_uring_queue_init(std::max(options_.queue_depth, 8u), &ring_, 0); ret < 0)
+    {
+        fail(beast::error_code(-ret, boost::system::system_category()), "io_uring");
+        return false;
+    }
+
+    uring_ = true;
+    reaper_ = std::thread([this] { run_reaper(); });
+    return true;
+}
+
+void file_reader::stop_uring()
+{
+    // user_data为空的NOP通知收割线程退出，它会等还没完成的请求都完成
+    {
+        std::lock_guard guard(submit_mutex_);
+        auto* sqe = next_sqe();
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, nullptr);
+        io_uring_submit(&ring_);
+    }
+
+    reaper_.join();
+    io_uring_queue_exit(&ring_);
+    uring_ = false;
+}
+
+void file_reader::run_reaper()
+{
+    bool stopping = false;
+    while (!stopping || pending_.load() > 0)
+    {
+        io_uring_cqe* cqe;
+        if (const auto ret = io_uring_wait_cqe(&ring_, &cqe); ret < 0)
+        {
+            if (ret == -EINTR)
+                continue;
+            fail(beast::error_code(-ret, boost::system::system_category()), "io_uring");
+            return;
+        }
+
+        auto* op = static_cast<uring_read*>(io_uring_cqe_get_data(cqe));
+        const auto res = cqe->res;
+        io_uring_cqe_seen(&ring_, cqe);
+
+        if (!op)
+        {
+            stopping = true;
+            continue;
+        }
+
+        if (op->fd < 0)
+        {
+            // 打开完成
+            if (res < 0)
+            {
+                finish(op, -res);
+                continue;
+            }
+
+            op->fd = res;
+            op->data.resize(op->size);
+            if (op->size == 0)
+                finish(op, 0);
+            else
+                submit_read(op);
+            continue;
+        }
+
+        if (res < 0)
+        {
+            finish(op, -res);
+            continue;
+        }
+
+        // 文件在stat之后被截断了，有多少算多少
+        op->offset += res;
+        if (res == 0 || op->offset >= op->size)
+        {
+            op->data.resize(op->offset);
+            finish(op, 0);
+            continue;
+        }
+
+        // 一次没读完
+        submit_read(op);
+    }
+}
+
+io_uring_sqe* file_reader::next_sqe()
+{
+    // 队列满了先提交一次，内核取走以后就有空位了
+    auto* sqe = io_uring_get_sqe(&ring_);
+    while (!sqe)
+    {
+        io_uring_submit(&ring_);
+        sqe = io_uring_get_sqe(&ring_);
+    }
+    return sqe;
+}
+
+void file_reader::submit_open(uring_read* op)
+{
+    std::lock_guard guard(submit_mutex_);
+    auto* sqe = next_sqe();
+
+    io_uring_prep_openat(sqe, AT_FDCWD, op->path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    io_uring_sqe_set_data(sqe, op);
+    io_uring_submit(&ring_);
+}
+
+void file_reader::submit_read(uring_read* op)
+{
+    std::lock_guard guard(submit_mutex_);
+    auto* sqe = next_sqe();
+
+    io_uring_prep_read(sqe, op->fd, op->data.data() + op->offset,
+                       static_cast<unsigned>(std::min<uint64_t>(op->size - op->offset, 1u << 30)), op->offset);
+    io_uring_sqe_set_data(sqe, op);
+    io_uring_submit(&ring_);
+}
+
+void file_reader::finish(uring_read* op, const int error)
+{
+    const std::unique_ptr<uring_read> owner(op);
+
+    // close很快，不用再绕一圈
+    if (op->fd >= 0)
+        ::close(op->fd);
+
+    const beast::error_code ec(error, boost::system::generic_category());
+    if (ec)
+        op->data.clear();
+    op->handler(ec, std::move(op->data));
+    pending_.fetch_sub(1);
+}
+
+#endif
@@ -0,0 +1,89 @@
+//
+// Created by cinea on 24-3-6.
+//
+
+#ifndef FILEREADER_H
+#define FILEREADER_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Common.h"
+#include "utils/UniqueHandler.hpp"
+
+#ifdef FORUM_GATE_IO_URING
+#include <liburing.h>
+#endif
+
+struct file_reader_options
+{
+    bool io_uring{true}; // 编译时找到了liburing并且内核支持时使用io_uring
+    unsigned queue_depth{256}; // io_uring提交队列的长度
+};
+
+/**
+ * \brief 读完整个文件后调用，失败时内容为空。
+ */
+using file_read_handler = unique_handler<void(const beast::error_code&, std::vector<u_char>&&)>;
+
+/**
+ * \brief 异步读取整个文件。
+ *
+ * 有io_uring时打开和读取都提交给内核，由一个收割线程处理完成事件并发起下一步，调用者马上返回；
+ * 否则在调用者的线程上同步读，所以应该在gate_blocking的线程上调用。
+ * handler在收割线程或者调用者的线程上调用，需要自己切换回请求所在的strand。
+ */
+class file_reader
+{
+    file_reader_options options_;
+    std::atomic_bool running_{false};
+
+#ifdef FORUM_GATE_IO_URING
+    struct uring_read;
+
+    bool uring_{false};
+    io_uring ring_{};
+    std::atomic<size_t> pending_{0}; // 已经提交还没有完成的读
+    std::mutex submit_mutex_;
+    std::thread reaper_;
+#endif
+
+public:
+    ~file_reader();
+
+    // 必须在IO线程启动前调用
+    void start(const file_reader_options& options);
+    void stop();
+
+    /**
+     * \brief 读取整个文件。
+     * \param size 文件的大小（stat得到的），只读这么多
+     */
+    void async_read(std::string path, uint64_t size, file_read_handler&& handler);
+
+    [[nodiscard]] const char* backend() const;
+
+private:
+#ifdef FORUM_GATE_IO_URING
+    bool start_uring();
+    void stop_uring();
+    void run_reaper();
+
+    io_uring_sqe* next_sqe(); // 要先拿到submit_mutex_
+    void submit_open(uring_read* op);
+    void submit_read(uring_read* op);
+    void finish(uring_read* op, int error);
+#endif
+};
+
+/**
+ * \brief 同步读取整个文件。
+ */
+std::vector<u_char> read_whole_file(const std::string& path, beast::error_code& ec);
+
+extern file_reader gate_files;
+
+#endif //FILEREADER_H
@@ -0,0 +1,93 @@
+//
+// Created by cinea on 24-3-7.
+//
+
+#include "FilterChain.h"
+
+#include "Errors.h"
+#include "Metrics.h"
+#include "RateLimiter.h"
+
+filter_chain gate_filters;
+
+namespace
+{
+    // 比较时间和内容无关，不能从响应时间猜出凭据
+    bool equal_secret(const std::string_view a, const std::string_view b)
+    {
+        if (a.size() != b.size())
+            return false;
+
+        unsigned char diff = 0;
+        for (size_t i = 0; i < a.size(); i++)
+            diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+        return diff == 0;
+    }
+}
+
+bool rate_limit_filter::apply(http::request<http::dynamic_body>&, const net::ip::address& remote) const
+{
+    return gate_limiter.allow(remote, route);
+}
+
+http::message_generator rate_limit_filter::reject(http::request<http::dynamic_body>&& req) const
+{
+    gate_metrics.add(gate_counter::rate_limited);
+    return too_many_requests(std::move(req));
+}
+
+bool auth_filter::apply(http::request<http::dynamic_body>& req, const net::ip::address&) const
+{
+    const auto value = req[http::field::authorization];
+    if (value.empty())
+        return false;
+
+    bool ok = false;
+    for (const auto& credential : credentials)
+        ok |= equal_secret(value, credential);
+    return ok;
+}
+
+http::message_generator auth_filter::reject(http::request<http::dynamic_body>&& req) const
+{
+    gate_metrics.add(gate_counter::auth_rejected);
+
+    // 按配置的第一个凭据的方案提示客户端
+    const auto scheme = credentials.empty()
+                            ? std::string("Basic")
+                            : credentials.front().substr(0, credentials.front().find(' '));
+    return unauthorized(std::move(req), scheme + " realm=\"" + realm + "\"");
+}
+
+bool header_filter::apply(http::request<http::dynamic_body>& req, const net::ip::address&) const
+{
+    for (const auto& name : remove)
+        req.erase(name);
+    for (const auto& [name, value] : set)
+        req.set(name, value);
+    return true;
+}
+
+http::message_generator header_filter::reject(http::request<http::dynamic_body>&& req) const
+{
+    return bad_request(std::move(req), "rejected by header filter");
+}
+
+void filter_chain::compile(std::vector<std::vector<gate_filter>>&& routes)
+{
+    filters_.clear();
+    routes_.clear();
+
+    for (auto& route : routes)
+    {
+        const auto begin = static_cast<uint32_t>(filters_.size());
+        for (auto& filter : route)
+            filters_.push_back(std::move(filter));
+        routes_.emplace_back(begin, static_cast<uint32_t>(filters_.size()));
+    }
+}
+
+http::message_generator reject_request(const gate_filter& filter, http::request<http::dynamic_body>&& req)
+{
+    return std::visit([&](const auto& f) { return f.reject(std::move(req)); }, filter);
+}
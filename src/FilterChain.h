@@ -0,0 +1,102 @@
+//
+// Created by cinea on 24-3-7.
+//
+
+#ifndef FILTERCHAIN_H
+#define FILTERCHAIN_H
+
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "Common.h"
+
+/**
+ * \brief 按IP和路由限流，令牌不够时返回429。
+ */
+struct rate_limit_filter
+{
+    size_t route;
+
+    [[nodiscard]] bool apply(http::request<http::dynamic_body>& req, const net::ip::address& remote) const;
+    [[nodiscard]] http::message_generator reject(http::request<http::dynamic_body>&& req) const;
+};
+
+/**
+ * \brief 检查Authorization头，和配置里的任何一个凭据都不同时返回401。
+ */
+struct auth_filter
+{
+    std::vector<std::string> credentials; // 完整的头，例如"Basic dXNlcjpwYXNz"或者"Bearer xxx"
+    std::string realm;
+
+    [[nodiscard]] bool apply(http::request<http::dynamic_body>& req, const net::ip::address& remote) const;
+    [[nodiscard]] http::message_generator reject(http::request<http::dynamic_body>&& req) const;
+};
+
+/**
+ * \brief 改写请求头后再交给路由处理，不会拒绝请求。
+ */
+struct header_filter
+{
+    std::vector<std::pair<std::string, std::string>> set; // 覆盖已有的值
+    std::vector<std::string> remove;
+
+    [[nodiscard]] bool apply(http::request<http::dynamic_body>& req, const net::ip::address& remote) const;
+    [[nodiscard]] http::message_generator reject(http::request<http::dynamic_body>&& req) const;
+};
+
+/**
+ * \brief 所有过滤器类型。新的过滤器加在这里，实现apply和reject就可以。
+ *
+ * apply只看请求头（请求体还没有读），返回false表示拒绝，之后调用reject生成响应。
+ */
+using gate_filter = std::variant<rate_limit_filter, auth_filter, header_filter>;
+
+/**
+ * \brief 各个路由的过滤器链。
+ *
+ * 启动时把所有路由的过滤器按顺序编译进一张连续的表，每个路由对应表里的一段；
+ * 运行时按下标逐个调用，通过std::visit静态分派，没有虚函数和std::function。
+ * 没有配置过滤器的路由只比较一次下标。
+ */
+class filter_chain
+{
+    std::vector<gate_filter> filters_;
+    std::vector<std::pair<uint32_t, uint32_t>> routes_; // 每个路由在filters_里的[begin, end)
+
+public:
+    // 必须在IO线程启动前调用，按路由编号索引
+    void compile(std::vector<std::vector<gate_filter>>&& routes);
+
+    /**
+     * \brief 依次运行路由的过滤器。
+     * \return 拒绝请求的过滤器，全部通过时为空
+     */
+    [[nodiscard]] const gate_filter* run(const size_t route, http::request<http::dynamic_body>& req,
+                                         const net::ip::address& remote) const
+    {
+        if (route >= routes_.size())
+            return nullptr;
+
+        for (auto [i, end] = routes_[route]; i < end; i++)
+        {
+            const auto& filter = filters_[i];
+            if (!std::visit([&](const auto& f) { return f.apply(req, remote); }, filter))
+                return &filter;
+        }
+        return nullptr;
+    }
+
+    [[nodiscard]] size_t size() const { return filters_.size(); }
+};
+
+/**
+ * \brief 被过滤器拒绝的请求的响应。
+ */
+http::message_generator reject_request(const gate_filter& filter, http::request<http::dynamic_body>&& req);
+
+extern filter_chain gate_filters;
+
+#endif //FILTERCHAIN_H
@@ -8,8 +8,22 @@
 #include <boost/beast/http.hpp>
 #include <utility>
 
+#include "Admin.h"
+#include "BlockingPool.h"
+#include "ConnectionManager.h"
+#include "Errors.h"
+#include "FilterChain.h"
+#include "FileReader.h"
+#include "Gateway.h"
+#include "Http2Session.h"
+#include "Metrics.h"
+#include "ProxyProtocol.h"
+#include "RateLimiter.h"
+#include "SocketOptions.h"
 #include "StaticFileHandler.h"
-#include "ProxyPass.h"
+#include "TlsContext.h"
+#include "Trace.h"
+#include "Upgrade.h"
 
 using namespace std::string_literals;
 
@@ -18,143 +32,709 @@ namespace http = beast::http; // from <boost/beast/http.hpp>
 namespace net = boost::asio; // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 
-constexpr size_t MAX_ALIVE_CONN = 1024; // 最多保留多少个Keep-Alive连接
+constexpr std::string_view continue_response = "HTTP/1.1 100 Continue\r\n\r\n";
+constexpr size_t upload_chunk_size = 16 * 1024; // 流式上传时每次从客户端读多少
+constexpr size_t max_batched_bytes = 64 * 1024; // 流水线上的响应最多攒多少一起写
+constexpr size_t max_batched_responses = 16;
 
-std::atomic_size_t alive_conns;
-
-// 代理列表，后期可以考虑做成配置文件的形式，也很简单
-const proxy_pass proxy_passes[]
+inline bool expects_continue(const http::request_header<>& req)
 {
-    proxy_pass("/s3"s, boost::urls::parse_uri("http://10.80.43.196:9000").value()),
-    proxy_pass("/api"s, boost::urls::parse_uri("http://10.80.43.196:9002").value()),
-    // proxy_passes("/avatar"sv, boost::urls::parse_uri("http://10.80.43.196:9000/forum/user-avatar")),
-    proxy_pass("/card"s, boost::urls::parse_uri("http://10.80.43.196:9000/forum/user-avatar").value(), "12h"s),
-    proxy_pass("/meili"s, boost::urls::parse_uri("http://10.80.42.189:7700").value()),
-};
+    return req.version() >= 11 && beast::iequals(req[http::field::expect], "100-continue");
+}
 
-class session : public std::enable_shared_from_this<session>
+// Stream为beast::tcp_stream或beast::ssl_stream<beast::tcp_stream>
+template <class Stream>
+class session : public std::enable_shared_from_this<session<Stream>>, public keep_alive_connection,
+                public request_body_source
 {
     net::io_context& ioc_;
-    beast::tcp_stream stream_;
+    Stream stream_;
     beast::flat_buffer buffer_;
     std::shared_ptr<std::filesystem::path const> doc_root_;
-    http::request<http::dynamic_body> req_;
+    std::optional<http::request_parser<http::dynamic_body>> parser_;
+
+    connection_slot slot_{conn_manager};
+    bool idle_{false}; // 正在等待下一个请求
+
+    size_t route_{0};
+    std::chrono::steady_clock::time_point start_;
+
+    // 流式上传：请求体由代理按需读取，不在内存里攒完整
+    std::optional<http::request_parser<http::buffer_body>> upload_parser_;
+    std::vector<char> upload_buffer_;
+    read_handler body_handler_;
+    bool send_continue_{false}; // 还没有回复100 Continue
+
+    client_info client_; // 转发给上游时用
+
+    // 访问日志用
+    net::ip::address remote_;
+    http::verb method_{http::verb::unknown};
+    std::string target_;
+    unsigned version_{11};
+    unsigned status_{0};
+    bool http2_{false};
+
+    // 慢请求追踪用，连接上的第一个请求从accept开始计时
+    request_trace trace_;
+    bool first_request_{true};
+
+    // 流水线上已经生成但还没有写出的响应，和后面的响应合并成一次写入
+    struct batched_response
+    {
+        http::verb method;
+        std::string target;
+        unsigned version;
+        unsigned status;
+        size_t bytes;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    beast::flat_buffer out_;
+    std::vector<batched_response> batched_;
+    size_t batched_bytes_{0}; // 当前响应已经复制进out_的字节数
 
-    bool keepd_alive{false};
+    std::shared_ptr<net::ssl::context> ssl_ctx_; // 握手期间保持上下文有效
+    std::shared_ptr<const trusted_networks> proxy_trusted_; // 为空时不解析PROXY协议头
 
 public:
     session(
         net::io_context& ioc,
-        tcp::socket&& socket,
-        std::shared_ptr<std::filesystem::path const> const& doc_root):
+        Stream&& stream,
+        std::shared_ptr<std::filesystem::path const> const& doc_root,
+        const bool http2,
+        std::shared_ptr<const trusted_networks> proxy_trusted,
+        std::shared_ptr<net::ssl::context> ssl_ctx = nullptr):
         ioc_(ioc),
-        stream_(std::move(socket)),
-        doc_root_(doc_root)
+        stream_(std::move(stream)),
+        doc_root_(doc_root),
+        http2_(http2),
+        ssl_ctx_(std::move(ssl_ctx)),
+        proxy_trusted_(std::move(proxy_trusted))
     {
+        beast::error_code ec;
+        client_.remote = beast::get_lowest_layer(stream_).socket().remote_endpoint(ec);
+        client_.local = beast::get_lowest_layer(stream_).socket().local_endpoint(ec);
+        client_.secure = is_ssl_stream<Stream>::value;
+        client_.executor = stream_.get_executor();
+        remote_ = client_.remote.address();
+
+        if (gate_trace.enabled())
+        {
+            trace_.reset(std::chrono::steady_clock::now());
+            trace_.mark(trace_phase::accept);
+        }
+    }
+
+    request_trace* trace()
+    {
+        return gate_trace.enabled() ? &trace_ : nullptr;
     }
 
     // 开始异步操作
     void run()
     {
-        dispatch(stream_.get_executor(), beast::bind_front_handler(
-                     &session::do_read,
-                     shared_from_this()
-                 ));
+        net::co_spawn(stream_.get_executor(), serve(this->shared_from_this()), net::detached);
+    }
+
+private:
+    // 整个连接的流程，协程在连接的strand上运行，self保证等待期间会话不被释放
+    net::awaitable<void> serve(std::shared_ptr<session> self)
+    {
+        // 可信的负载均衡器在连接开头先发PROXY协议头，其他来源按普通连接处理
+        if (proxy_trusted_ && proxy_trusted_->contains(remote_) && !co_await read_proxy_header())
+            co_return;
+
+        if constexpr (is_ssl_stream<Stream>::value)
+        {
+            if (!co_await handshake())
+                co_return;
+        }
+#ifdef FORUM_GATE_HTTP2
+        else if (http2_ && !co_await detect_http2())
+            co_return;
+#endif
+
+        while (true)
+        {
+            auto msg = co_await read_request();
+            if (!msg)
+                co_return;
+
+            // 下一个请求已经在缓冲区里了，响应先攒着
+            if (batch_response(*msg))
+                continue;
+
+            if (!co_await write_response(std::move(*msg)))
+                co_return;
+
+            // 读其他的请求
+            if (!co_await wait_idle())
+                co_return;
+        }
     }
 
-    void do_read()
+    // PROXY协议头直接从TCP层读，TLS握手在它之后
+    net::awaitable<bool> read_proxy_header()
     {
-        req_ = {}; // 清空请求体
+        auto& tcp_layer = beast::get_lowest_layer(stream_);
+        beast::error_code ec;
 
-        stream_.expires_after(std::chrono::seconds(30));
+        while (true)
+        {
+            tcp_layer.expires_after(conn_manager.options().request_timeout);
 
-        http::async_read(stream_, buffer_, req_,
-                         beast::bind_front_handler(
-                             &session::on_read,
-                             shared_from_this()));
+            const auto bytes_transferred = co_await tcp_layer.async_read_some(buffer_.prepare(512), with_error(ec));
+            if (ec)
+            {
+                fail(ec, "proxy_protocol");
+                co_return false;
+            }
+
+            buffer_.commit(bytes_transferred);
+
+            const auto data = buffer_.data();
+            size_t size = 0;
+            const auto result = parse_proxy_protocol_header({static_cast<const char*>(data.data()), data.size()},
+                                                            size, client_.remote, client_.local);
+
+            if (result == proxy_parse_result::complete)
+            {
+                // 头后面已经读到的数据留在buffer_里，交给握手或者HTTP解析器
+                buffer_.consume(size);
+                remote_ = client_.remote.address();
+                co_return true;
+            }
+
+            if (result == proxy_parse_result::invalid || buffer_.size() >= proxy_protocol_max_header)
+                break;
+        }
+
+        fail(beast::errc::make_error_code(beast::errc::protocol_error), "proxy_protocol");
+        co_await close();
+        co_return false;
     }
 
-    void on_read(const beast::error_code& ec, std::size_t bytes_transferred)
+    // 连接交给HTTP/2以后返回false
+    net::awaitable<bool> handshake()
     {
-        boost::ignore_unused(bytes_transferred);
+        beast::get_lowest_layer(stream_).expires_after(conn_manager.options().request_timeout);
 
-        if (ec == http::error::end_of_stream)
-            return do_close();
+        // PROXY协议头后面可能已经读到了ClientHello
+        beast::error_code ec;
+        const auto bytes_used = co_await stream_.async_handshake(net::ssl::stream_base::server,
+                                                                 buffer_.data(), with_error(ec));
+        if (ec)
+        {
+            fail(ec, "handshake");
+            co_return false;
+        }
+
+        buffer_.consume(bytes_used);
+        ssl_ctx_.reset();
+
+#ifdef FORUM_GATE_HTTP2
+        // 通过ALPN协商到h2
+        if (http2_ && negotiated_alpn(stream_) == "h2")
+        {
+            std::make_shared<http2_session<Stream>>(
+                ioc_, std::move(stream_), std::move(buffer_), doc_root_, std::move(slot_), client_
+            )->run();
+            co_return false;
+        }
+#endif
+
+        co_return true;
+    }
+
+#ifdef FORUM_GATE_HTTP2
+    // 先看看是不是HTTP/2的连接序言，读到的数据留在buffer_里给后面的解析器用
+    net::awaitable<bool> detect_http2()
+    {
+        beast::error_code ec;
+
+        while (true)
+        {
+            if (buffer_.size() > 0)
+            {
+                const auto data = buffer_.data();
+                bool partial;
+                if (match_http2_preface({static_cast<const char*>(data.data()), data.size()}, partial))
+                {
+                    std::make_shared<http2_session<Stream>>(
+                        ioc_, std::move(stream_), std::move(buffer_), doc_root_, std::move(slot_), client_
+                    )->run();
+                    co_return false;
+                }
+
+                if (!partial)
+                    co_return true;
+            }
+
+            beast::get_lowest_layer(stream_).expires_after(conn_manager.options().request_timeout);
+
+            const auto bytes_transferred = co_await stream_.async_read_some(
+                buffer_.prepare(NGHTTP2_CLIENT_MAGIC_LEN - buffer_.size()), with_error(ec));
+
+            if (ec == net::error::eof && buffer_.size() == 0)
+            {
+                co_await close();
+                co_return false;
+            }
+
+            if (ec)
+            {
+                fail(ec, "detect");
+                co_return false;
+            }
+
+            buffer_.commit(bytes_transferred);
+        }
+    }
+
+    // 回复101之后把连接交给HTTP/2
+    net::awaitable<void> upgrade_http2(http::request<http::dynamic_body>&& req)
+    {
+        const auto settings = decode_http2_settings(req["HTTP2-Settings"]);
+
+        http::response<http::empty_body> res{http::status::switching_protocols, req.version()};
+        res.set(http::field::connection, "Upgrade");
+        res.set(http::field::upgrade, "h2c");
 
+        beast::error_code ec;
+        co_await http::async_write(stream_, res, with_error(ec));
         if (ec)
-            return fail(ec, "read");
+        {
+            fail(ec, "upgrade");
+            co_return;
+        }
 
-        handle_request(*doc_root_, std::move(req_));
+        std::make_shared<http2_session<Stream>>(
+            ioc_, std::move(stream_), std::move(buffer_), doc_root_, std::move(slot_), client_
+        )->run_upgrade(std::move(req), settings);
     }
+#endif
 
-    // 网关规则主要在这里写
-    void handle_request(const std::filesystem::path& doc_root,
-                        http::request<http::dynamic_body>&& req)
+    /**
+     * \brief 读一个请求并交给网关，得到要写回的响应。
+     * \return 为空时连接已经关闭或者交给了HTTP/2
+     */
+    net::awaitable<std::optional<http::message_generator>> read_request()
     {
-        if (req.keep_alive() && !keepd_alive && alive_conns.load() > MAX_ALIVE_CONN)
+        // 先只读请求头，限流之类的检查不需要等请求体
+        parser_.emplace();
+        upload_parser_.reset();
+
+        if (!first_request_ && gate_trace.enabled())
+            trace_.reset(std::chrono::steady_clock::now());
+        first_request_ = false;
+
+        beast::get_lowest_layer(stream_).expires_after(conn_manager.options().request_timeout);
+
+        beast::error_code ec;
+        const auto header_bytes = co_await http::async_read_header(stream_, buffer_, *parser_, with_error(ec));
+
+        if (ec == http::error::end_of_stream)
+        {
+            co_await close();
+            co_return std::nullopt;
+        }
+
+        if (ec)
+        {
+            // 前面的请求是完整的，它们的响应照样发出去
+            co_await flush();
+            fail(ec, "read");
+            co_return std::nullopt;
+        }
+
+        gate_metrics.add(gate_counter::bytes_in, header_bytes);
+        start_ = std::chrono::steady_clock::now();
+        trace_mark(trace(), trace_phase::header_parsed);
+
+        auto& header = parser_->get();
+        route_ = gateway_route(header.target());
+        trace_mark(trace(), trace_phase::route_matched);
+
+        method_ = header.method();
+        version_ = header.version();
+        if (gate_log.access_enabled() || gate_trace.enabled())
+            target_ = header.target();
+
+        // 限流、认证之类的过滤器只看请求头，可能会改写它
+        if (const auto filter = gate_filters.run(route_, header, remote_))
+            co_return reject_filtered(*filter);
+
+        // 声明的长度已经超出限制时不用等请求体；分块传输的在读的过程中检查
+        const auto body_limit = gateway_body_limit(route_);
+        const auto content_length = parser_->content_length();
+        if (content_length && *content_length > body_limit)
+            co_return reject_too_large();
+        parser_->body_limit(body_limit);
+
+        // 攒着的响应不能等客户端的请求体或者上游
+        if ((!parser_->is_done() || gateway_proxy_route(route_)) && !co_await flush())
+            co_return std::nullopt;
+
+        if (!parser_->is_done())
+        {
+            if (gateway_stream_body(route_, content_length ? std::optional(*content_length) : std::nullopt))
+                co_return co_await start_upload();
+
+            if (expects_continue(parser_->get()))
+            {
+                co_await net::async_write(stream_, net::buffer(continue_response), with_error(ec));
+                if (ec)
+                {
+                    fail(ec, "write");
+                    co_return std::nullopt;
+                }
+            }
+
+            const auto body_bytes = co_await http::async_read(stream_, buffer_, *parser_, with_error(ec));
+
+            if (ec == http::error::body_limit)
+                co_return reject_too_large();
+
+            if (ec)
+            {
+                fail(ec, "read");
+                co_return std::nullopt;
+            }
+
+            gate_metrics.add(gate_counter::bytes_in, body_bytes);
+        }
+
+        auto req = parser_->release();
+        if (req.keep_alive() && !conn_manager.allow_keep_alive())
             // 系统资源不足，不能继续维持长链接
-                req.keep_alive(false);
+            req.keep_alive(false);
 
-        for (const auto& proxy_pass : proxy_passes)
+#ifdef FORUM_GATE_HTTP2
+        // TLS上只能通过ALPN使用HTTP/2
+        if constexpr (!is_ssl_stream<Stream>::value)
         {
-            if (proxy_pass.match(req.target()))
+            if (http2_ && is_http2_upgrade(req))
             {
-                req.keep_alive(false); // 代理暂时不维持长链接
-                auto callback_func = std::bind(&session::send_response, shared_from_this(), std::placeholders::_1);
-                return proxy_pass.handle(ioc_, std::move(req), callback_func);
+                if (co_await flush())
+                    co_await upgrade_http2(std::move(req));
+                co_return std::nullopt;
             }
         }
+#endif
 
-        // 默认情况
-        send_response(handle_static_file(doc_root, std::move(req)));
+        co_return co_await async_handle_gateway_request(ioc_, *doc_root_, route_, std::move(req), client_, trace(),
+                                                        nullptr, net::use_awaitable);
     }
 
-    void send_response(http::message_generator&& msg)
+    // 被过滤器拒绝的请求不读请求体，有请求体的话回复后直接关闭连接
+    http::message_generator reject_filtered(const gate_filter& filter)
     {
-        bool keep_alive = msg.keep_alive();
+        const bool drain = parser_->is_done();
+        auto req = parser_->release();
+        req.keep_alive(req.keep_alive() && drain);
 
-        // 写入响应
-        beast::async_write(
-            stream_, std::move(msg), beast::bind_front_handler(
-                &session::on_write, shared_from_this(), keep_alive));
+        return reject_request(filter, std::move(req));
+    }
+
+    // 请求体超出路由的限制，剩下的部分不再读，回复后直接关闭连接
+    http::message_generator reject_too_large()
+    {
+        auto req = parser_->release();
+        req.keep_alive(false);
+
+        return payload_too_large(std::move(req));
+    }
+
+    // 请求头先交给代理，代理连上上游以后再通过read_body一段一段地读请求体
+    net::awaitable<http::message_generator> start_upload()
+    {
+        send_continue_ = expects_continue(parser_->get());
+        upload_parser_.emplace(std::move(*parser_));
+        parser_.reset();
+        upload_buffer_.resize(upload_chunk_size);
+
+        http::request<http::dynamic_body> req(upload_parser_->get().base());
+        if (req.keep_alive() && !conn_manager.allow_keep_alive())
+            req.keep_alive(false);
+
+        co_return co_await async_handle_gateway_request(ioc_, *doc_root_, route_, std::move(req), client_, trace(),
+                                                        this->shared_from_this(), net::use_awaitable);
+    }
+
+public:
+    // 由代理调用，可能在别的strand上。这时协程正等着网关的响应，连接上没有别的读写
+    void read_body(read_handler&& handler) override
+    {
+        net::dispatch(stream_.get_executor(), [self = this->shared_from_this(), handler = std::move(handler)]() mutable
+        {
+            self->body_handler_ = std::move(handler);
+
+            if (std::exchange(self->send_continue_, false))
+                return net::async_write(self->stream_, net::buffer(continue_response),
+                                        beast::bind_front_handler(&session::on_continue, self));
+
+            self->do_upload_read();
+        });
+    }
+
+private:
+    void on_continue(const beast::error_code& ec, std::size_t)
+    {
+        if (ec)
+            return std::exchange(body_handler_, nullptr)(ec, net::const_buffer(), false);
+
+        do_upload_read();
+    }
+
+    void do_upload_read()
+    {
+        if (upload_parser_->is_done())
+            return std::exchange(body_handler_, nullptr)(beast::error_code(), net::const_buffer(), true);
+
+        auto& body = upload_parser_->get().body();
+        body.data = upload_buffer_.data();
+        body.size = upload_buffer_.size();
+
+        beast::get_lowest_layer(stream_).expires_after(conn_manager.options().request_timeout);
+
+        http::async_read_some(stream_, buffer_, *upload_parser_,
+                              beast::bind_front_handler(
+                                  &session::on_upload_read,
+                                  this->shared_from_this()));
+    }
+
+    void on_upload_read(beast::error_code ec, std::size_t bytes_transferred)
+    {
+        // 缓冲区满了
+        if (ec == http::error::need_buffer)
+            ec = {};
+
+        if (ec)
+            return std::exchange(body_handler_, nullptr)(ec, net::const_buffer(), false);
+
+        gate_metrics.add(gate_counter::bytes_in, bytes_transferred);
+
+        const auto size = upload_buffer_.size() - upload_parser_->get().body().size;
+        if (size == 0 && !upload_parser_->is_done())
+            // 只读到了分块的长度行之类的
+            return do_upload_read();
+
+        std::exchange(body_handler_, nullptr)(ec, net::const_buffer(upload_buffer_.data(), size),
+                                              upload_parser_->is_done());
+    }
+
+    // 流水线上的下一个请求头已经完整地读到了
+    bool next_request_buffered() const
+    {
+        const auto data = buffer_.data();
+        return std::string_view(static_cast<const char*>(data.data()), data.size()).find("\r\n\r\n") !=
+            std::string_view::npos;
+    }
+
+    // 把响应序列化进out_，直到out_放不下下一段为止，返回复制的字节数
+    size_t serialize_into(http::message_generator& msg)
+    {
+        size_t total = 0;
+        beast::error_code ec;
+
+        while (!msg.is_done())
+        {
+            const auto buffers = msg.prepare(ec);
+            if (ec)
+                // 留给async_write报告
+                break;
+
+            size_t copied = 0;
+            for (const auto& buffer : buffers)
+            {
+                if (out_.size() + buffer.size() > max_batched_bytes)
+                    break;
+                out_.commit(net::buffer_copy(out_.prepare(buffer.size()), buffer));
+                copied += buffer.size();
+            }
+
+            msg.consume(copied);
+            total += copied;
+            if (copied == 0 || out_.size() >= max_batched_bytes)
+                break;
+        }
+
+        return total;
+    }
+
+    /**
+     * \brief 客户端流水线发来的请求，前一个响应不单独写出，和后面的一起写，一次系统调用回复多个请求。
+     * \return false表示这个响应要马上写出（连同前面攒着的）
+     */
+    bool batch_response(http::message_generator& msg)
+    {
+        if (!msg.keep_alive() || upload_parser_ || trace() || batched_.size() >= max_batched_responses ||
+            !next_request_buffered())
+            return false;
+
+        const auto status = response_status(msg);
+        const auto bytes = serialize_into(msg);
+        if (!msg.is_done())
+        {
+            // 放不下的响应连同复制进去的开头交给write_response
+            status_ = status;
+            batched_bytes_ = bytes;
+            return false;
+        }
+
+        gate_metrics.record_request(route_, status, std::chrono::steady_clock::now() - start_);
+        batched_.push_back({method_, std::move(target_), version_, status, bytes, start_});
+        return true;
     }
 
-    void on_write(
-        const bool keep_alive,
-        const beast::error_code& ec,
-        std::size_t bytes_transferred)
+    // 写出攒着的响应，返回false时连接已经结束
+    net::awaitable<bool> flush()
     {
-        boost::ignore_unused(bytes_transferred);
+        if (out_.size() == 0)
+            co_return true;
 
+        beast::error_code ec;
+        const auto bytes_transferred = co_await net::async_write(stream_, out_.data(), with_error(ec));
+        out_.consume(out_.size());
         if (ec)
-            return fail(ec, "write");
+        {
+            batched_.clear();
+            fail(ec, "write");
+            co_return false;
+        }
+
+        gate_metrics.add(gate_counter::bytes_out, bytes_transferred);
+        const auto now = std::chrono::steady_clock::now();
+        for (const auto& r : batched_)
+            gate_log.access(remote_, http::to_string(r.method), r.target, r.version, r.status, r.bytes, now - r.start);
+        batched_.clear();
+
+        co_return true;
+    }
+
+    // 返回false时连接已经结束
+    net::awaitable<bool> write_response(http::message_generator&& msg)
+    {
+        // 上游提前回复时请求体可能还没读完，连接不能再用
+        const bool keep_alive = msg.keep_alive() && (!upload_parser_ || upload_parser_->is_done());
+
+        // batch_response已经复制了开头时状态行不在msg里了
+        size_t bytes_transferred = std::exchange(batched_bytes_, 0);
+        if (bytes_transferred == 0)
+        {
+            status_ = response_status(msg);
+            // 攒着的响应后面接上这个响应的开头，一起写出
+            if (out_.size() > 0)
+                bytes_transferred = serialize_into(msg);
+        }
+        gate_metrics.record_request(route_, status_, std::chrono::steady_clock::now() - start_);
+
+        if (!co_await flush())
+            co_return false;
+
+        // 写入响应
+        if (!msg.is_done())
+        {
+            beast::error_code ec;
+            const auto bytes_written = co_await beast::async_write(stream_, std::move(msg), with_error(ec));
+            if (ec)
+            {
+                fail(ec, "write");
+                co_return false;
+            }
+
+            gate_metrics.add(gate_counter::bytes_out, bytes_written);
+            bytes_transferred += bytes_written;
+        }
+
+        gate_log.access(remote_, http::to_string(method_), target_, version_, status_, bytes_transferred,
+                        std::chrono::steady_clock::now() - start_);
+
+        if (const auto t = trace())
+        {
+            t->mark(trace_phase::response_written);
+            gate_trace.finish(*t, http::to_string(method_), target_, status_);
+        }
 
         if (!keep_alive)
+        {
             // 可以关闭连接了
-            return do_close();
+            co_await close();
+            co_return false;
+        }
+
+        co_return true;
+    }
+
+    // 等待下一个请求的第一批数据。这段时间连接是空闲的，可以被连接管理器淘汰
+    net::awaitable<bool> wait_idle()
+    {
+        if (buffer_.size() > 0)
+            // 流水线请求已经在缓冲区里了
+            co_return true;
+
+        idle_ = true;
+        conn_manager.add_idle(slot_.shard(), this->shared_from_this());
+
+        beast::get_lowest_layer(stream_).expires_after(conn_manager.options().idle_timeout);
+
+        beast::error_code ec;
+        const auto bytes_transferred = co_await stream_.async_read_some(buffer_.prepare(4096), with_error(ec));
+
+        idle_ = false;
+        conn_manager.remove_idle(slot_.shard(), this);
+
+        // 客户端关闭、空闲超时或者被淘汰，都直接关闭连接
+        if (ec == net::error::eof || ec == beast::error::timeout || ec == net::error::operation_aborted ||
+            ec == net::ssl::error::stream_truncated)
+        {
+            co_await close();
+            co_return false;
+        }
 
-        if(!keepd_alive)
+        if (ec)
         {
-            keepd_alive = true;
-            alive_conns.fetch_add(1);
+            fail(ec, "idle");
+            co_return false;
         }
 
-        // 读其他的请求
-        do_read();
+        buffer_.commit(bytes_transferred);
+        co_return true;
+    }
+
+public:
+    void evict() override
+    {
+        net::post(stream_.get_executor(), [self = this->shared_from_this()]
+        {
+            // 到这里时连接可能已经开始处理新请求了
+            if (self->idle_)
+                beast::get_lowest_layer(self->stream_).cancel();
+        });
     }
 
-    void do_close()
+private:
+    net::awaitable<void> close()
     {
         beast::error_code ec;
 
-        if (keepd_alive)
-            alive_conns.fetch_sub(1);
+        if constexpr (is_ssl_stream<Stream>::value)
+        {
+            beast::get_lowest_layer(stream_).expires_after(conn_manager.options().request_timeout);
 
-        if (const auto errc = stream_.socket().shutdown(tcp::socket::shutdown_send, ec))
-            return fail(errc, "close");
+            co_await stream_.async_shutdown(with_error(ec));
 
-        if (ec)
-            return fail(ec, "close");
+            // 对方不回close_notify直接断开很常见
+            if (ec && ec != net::ssl::error::stream_truncated)
+                fail(ec, "shutdown");
+        }
+        else
+        {
+            stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+            if (ec)
+                fail(ec, "close");
+        }
 
         // 已经可以安全退出了
     }
@@ -168,11 +748,70 @@ class listener : public std::enable_shared_from_this<listener>
     net::io_context& ioc_;
     tcp::acceptor acceptor_;
     std::shared_ptr<std::filesystem::path> doc_root_;
+    bool http2_;
+    std::shared_ptr<const trusted_networks> proxy_trusted_;
+    std::shared_ptr<tls_context> tls_; // 为空时不加密
+    socket_options socket_options_;
 
 public:
     listener(net::io_context& ioc, const tcp::endpoint& endpoint,
-             std::shared_ptr<std::filesystem::path> const& doc_root):
-        ioc_(ioc), acceptor_(make_strand(ioc)), doc_root_(doc_root)
+             std::shared_ptr<std::filesystem::path> const& doc_root, const bool http2,
+             std::shared_ptr<const trusted_networks> proxy_trusted, const listener_options& options,
+             std::shared_ptr<tls_context> tls = nullptr):
+        ioc_(ioc), acceptor_(make_strand(ioc)), doc_root_(doc_root), http2_(http2),
+        proxy_trusted_(std::move(proxy_trusted)), tls_(std::move(tls)), socket_options_(options.socket)
+    {
+        beast::error_code ec;
+
+        // 平滑升级时接过上一个进程的监听socket，两边共用同一个接受队列，不会丢连接
+        if (const auto fd = take_inherited_listener(endpoint); fd >= 0)
+        {
+            boost::ignore_unused(acceptor_.assign(endpoint.protocol(), fd, ec));
+            if (ec)
+            {
+                fail(ec, "assign");
+                return;
+            }
+
+            apply_listener_options(acceptor_, options);
+        }
+        else if (!open(endpoint, options))
+            return;
+
+        // 开始监听连接；继承来的socket上再调用一次只会更新队列长度
+        boost::ignore_unused(
+            acceptor_.listen(options.backlog, ec)
+        );
+        if (ec)
+        {
+            fail(ec, "listen");
+            return;
+        }
+    }
+
+    void run()
+    {
+        do_accept();
+    }
+
+    // 停止接受新连接，已经接受的连接不受影响
+    void stop()
+    {
+        net::post(acceptor_.get_executor(), [self = shared_from_this()]
+        {
+            beast::error_code ec;
+            boost::ignore_unused(self->acceptor_.close(ec));
+        });
+    }
+
+    // 平滑升级时传给新进程
+    [[nodiscard]] int native_handle()
+    {
+        return acceptor_.native_handle();
+    }
+
+private:
+    bool open(const tcp::endpoint& endpoint, const listener_options& options)
     {
         beast::error_code ec;
 
@@ -181,7 +820,7 @@ public:
         if (ec)
         {
             fail(ec, "open");
-            return;
+            return false;
         }
 
         // 允许复用地址
@@ -189,34 +828,23 @@ public:
         if (ec)
         {
             fail(ec, "set_option");
-            return;
+            return false;
         }
 
+        // 缓冲区、TCP_DEFER_ACCEPT、TCP_FASTOPEN要在listen之前设置
+        apply_listener_options(acceptor_, options);
+
         // 绑定服务器地址
         boost::ignore_unused(acceptor_.bind(endpoint, ec));
         if (ec)
         {
             fail(ec, "bind");
-            return;
+            return false;
         }
 
-        // 开始监听连接
-        boost::ignore_unused(
-            acceptor_.listen(net::socket_base::max_listen_connections, ec)
-        );
-        if (ec)
-        {
-            fail(ec, "listen");
-            return;
-        }
+        return true;
     }
 
-    void run()
-    {
-        do_accept();
-    }
-
-private:
     void do_accept()
     {
         acceptor_.async_accept(
@@ -228,6 +856,10 @@ private:
 
     void on_accept(const beast::error_code& ec, tcp::socket socket)
     {
+        // stop()关闭了接收器
+        if (ec == net::error::operation_aborted)
+            return;
+
         if (ec)
         {
             fail(ec, "accept");
@@ -235,9 +867,22 @@ private:
             return;
         }
 
-        std::make_shared<session>(
-            ioc_, std::move(socket), doc_root_
-        )->run();
+        gate_metrics.add(gate_counter::connections_accepted);
+        apply_accepted_options(socket, socket_options_);
+
+        if (tls_)
+        {
+            auto ctx = tls_->get();
+            std::make_shared<session<beast::ssl_stream<beast::tcp_stream>>>(
+                ioc_, beast::ssl_stream<beast::tcp_stream>(std::move(socket), *ctx), doc_root_, http2_, proxy_trusted_, ctx
+            )->run();
+        }
+        else
+        {
+            std::make_shared<session<beast::tcp_stream>>(
+                ioc_, beast::tcp_stream(std::move(socket)), doc_root_, http2_, proxy_trusted_
+            )->run();
+        }
 
         do_accept();
     }
@@ -261,13 +906,293 @@ int main()
     auto const port = toml::find<unsigned short>(config_data, "port");
     auto const doc_root_str = toml::find<std::string>(config_data, "doc_root");
     auto const threads = toml::find<int>(config_data, "threads");
+    auto const http2 = toml::find_or(config_data, "http2", true);
+
+    connection_options conn_options;
+    if (config_data.contains("connection"))
+    {
+        const auto& conn_data = toml::find(config_data, "connection");
+        conn_options.max_connections = toml::find_or(conn_data, "max_connections", conn_options.max_connections);
+        conn_options.max_keep_alive = toml::find_or(conn_data, "max_keep_alive", conn_options.max_keep_alive);
+        conn_options.idle_timeout = std::chrono::seconds(
+            toml::find_or(conn_data, "idle_timeout", conn_options.idle_timeout.count()));
+        conn_options.request_timeout = std::chrono::seconds(
+            toml::find_or(conn_data, "request_timeout", conn_options.request_timeout.count()));
+    }
+    conn_manager.configure(conn_options, threads);
+
+    // 访问文件系统之类的阻塞工作放到单独的线程上
+    blocking_pool_options blocking_opts;
+    if (config_data.contains("blocking"))
+    {
+        const auto& blocking_data = toml::find(config_data, "blocking");
+        blocking_opts.threads = toml::find_or(blocking_data, "threads", blocking_opts.threads);
+        blocking_opts.queue_size = toml::find_or(blocking_data, "queue_size", blocking_opts.queue_size);
+    }
+    gate_blocking.start(blocking_opts);
+
+    // 限流，要在init_gateway之前，网关会设置各个路由的限制
+    rate_limit_options rate_opts;
+    if (config_data.contains("rate_limit"))
+    {
+        const auto& rate_data = toml::find(config_data, "rate_limit");
+        rate_opts.enabled = toml::find_or(rate_data, "enabled", rate_opts.enabled);
+        rate_opts.per_ip.rate = find_number_or(rate_data, "rate", rate_opts.per_ip.rate);
+        rate_opts.per_ip.burst = toml::find_or(rate_data, "burst", rate_opts.per_ip.burst);
+        rate_opts.buckets = toml::find_or(rate_data, "buckets", rate_opts.buckets);
+    }
+    gate_limiter.configure(rate_opts);
+
+    // 慢请求追踪，要在init_gateway之前，网关要用到导出的路径
+    trace_options trace_opts;
+    if (config_data.contains("trace"))
+    {
+        const auto& trace_data = toml::find(config_data, "trace");
+        trace_opts.enabled = toml::find_or(trace_data, "enabled", trace_opts.enabled);
+        trace_opts.slow_threshold = std::chrono::milliseconds(
+            toml::find_or(trace_data, "slow_threshold", trace_opts.slow_threshold.count()));
+        trace_opts.samples = toml::find_or(trace_data, "samples", trace_opts.samples);
+    }
+    gate_trace.configure(trace_opts);
+
+    init_gateway(config_data);
+
+    log_options log_opts;
+    if (config_data.contains("log"))
+    {
+        const auto& log_data = toml::find(config_data, "log");
+        log_opts.access_log = toml::find_or(log_data, "access_log", std::string());
+        log_opts.error_log = toml::find_or(log_data, "error_log", std::string());
+        log_opts.buffer_records = toml::find_or(log_data, "buffer_records", log_opts.buffer_records);
+        log_opts.flush_interval = std::chrono::milliseconds(
+            toml::find_or(log_data, "flush_interval", log_opts.flush_interval.count()));
+    }
+    gate_log.start(log_opts);
 
     auto const address = net::ip::make_address(address_str);
     auto const doc_root = std::make_shared<std::filesystem::path>(doc_root_str);
 
+    // 前面有负载均衡器时，只信任它发来的PROXY协议头
+    std::shared_ptr<trusted_networks> proxy_trusted;
+    if (config_data.contains("proxy_protocol"))
+    {
+        const auto& proxy_data = toml::find(config_data, "proxy_protocol");
+        if (toml::find_or(proxy_data, "enabled", false))
+        {
+            proxy_trusted = std::make_shared<trusted_networks>();
+            for (const auto& cidr : toml::find_or(proxy_data, "trusted", std::vector<std::string>()))
+            {
+                if (!proxy_trusted->add(cidr))
+                {
+                    std::cerr << "proxy_protocol: invalid network '" << cidr << "'" << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+
+    // 监听端口和接受的连接的TCP选项，两个端口共用
+    listener_options listener_opts;
+    if (config_data.contains("socket"))
+    {
+        const auto& socket_data = toml::find(config_data, "socket");
+        listener_opts.backlog = toml::find_or(socket_data, "backlog", listener_opts.backlog);
+        listener_opts.defer_accept = toml::find_or(socket_data, "defer_accept", listener_opts.defer_accept);
+        listener_opts.fast_open = toml::find_or(socket_data, "fast_open", listener_opts.fast_open);
+        read_socket_options(socket_data, listener_opts.socket);
+    }
+
+    // 退出时等已有的请求处理完的最长时间
+    std::chrono::seconds drain_timeout{30};
+    if (config_data.contains("shutdown"))
+    {
+        const auto& shutdown_data = toml::find(config_data, "shutdown");
+        drain_timeout = std::chrono::seconds(toml::find_or(shutdown_data, "drain_timeout", drain_timeout.count()));
+    }
+
+    // 本机的管理端口
+    admin_options admin_opts;
+    if (config_data.contains("admin"))
+    {
+        const auto& admin_data = toml::find(config_data, "admin");
+        admin_opts.enabled = toml::find_or(admin_data, "enabled", admin_opts.enabled);
+        admin_opts.address = toml::find_or(admin_data, "address", admin_opts.address);
+        admin_opts.port = toml::find_or(admin_data, "port", admin_opts.port);
+        admin_opts.top = toml::find_or(admin_data, "top", admin_opts.top);
+
+        beast::error_code address_ec;
+        const auto admin_address = net::ip::make_address(admin_opts.address, address_ec);
+        if (admin_opts.enabled && (address_ec || !admin_address.is_loopback()))
+        {
+            std::cerr << "admin: address '" << admin_opts.address << "' is not a loopback address" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
     net::io_context ioc{threads};
 
-    std::make_shared<listener>(ioc, tcp::endpoint{address, port}, doc_root)->run();
+    std::vector<std::shared_ptr<listener>> listeners;
+    listeners.push_back(
+        std::make_shared<listener>(ioc, tcp::endpoint{address, port}, doc_root, http2, proxy_trusted, listener_opts));
+    listeners.back()->run();
+
+    // 可选的TLS端口
+    if (config_data.contains("tls"))
+    {
+        const auto& tls_data = toml::find(config_data, "tls");
+
+        tls_options options;
+        options.cert_file = toml::find<std::string>(tls_data, "cert");
+        options.key_file = toml::find<std::string>(tls_data, "key");
+        options.ciphers = toml::find_or(tls_data, "ciphers", std::string());
+        options.ciphersuites = toml::find_or(tls_data, "ciphersuites", std::string());
+        options.session_cache_size = toml::find_or(tls_data, "session_cache_size", options.session_cache_size);
+        options.session_tickets = toml::find_or(tls_data, "session_tickets", options.session_tickets);
+        options.reload_interval = toml::find_or(tls_data, "reload_interval", options.reload_interval);
+#ifdef FORUM_GATE_HTTP2
+        options.http2 = http2;
+#endif
+
+        auto const tls = std::make_shared<tls_context>(ioc, std::move(options));
+        beast::error_code ec;
+        tls->load(ec);
+        if (ec)
+        {
+            fail(ec, "tls");
+            return EXIT_FAILURE;
+        }
+        tls->run();
+
+        auto const tls_port = toml::find<unsigned short>(tls_data, "port");
+        listeners.push_back(std::make_shared<listener>(ioc, tcp::endpoint{address, tls_port}, doc_root, http2,
+                                                       proxy_trusted, listener_opts, tls));
+        listeners.back()->run();
+    }
+
+    std::shared_ptr<admin_listener> admin;
+    if (admin_opts.enabled)
+    {
+        admin = std::make_shared<admin_listener>(ioc, doc_root, admin_opts);
+        admin->run();
+    }
+
+    // 上一个进程传下来、新配置里已经没有的端口
+    close_inherited_listeners();
+
+    // 收到SIGUSR1时重新打开日志文件
+    net::signal_set reopen_signals(ioc, SIGUSR1);
+    std::function<void(const beast::error_code&, int)> on_reopen = [&](const beast::error_code& ec, int)
+    {
+        if (ec)
+            return;
+
+        gate_log.reopen();
+        reopen_signals.async_wait(on_reopen);
+    };
+    reopen_signals.async_wait(on_reopen);
+
+    // 记录静态文件缓存的内容，下次启动时按它预热
+    net::steady_timer manifest_timer(ioc);
+    std::function<void(const beast::error_code&)> on_manifest = [&](const beast::error_code& ec)
+    {
+        if (ec)
+            return;
+
+        save_static_manifest();
+        manifest_timer.expires_after(std::chrono::minutes(1));
+        manifest_timer.async_wait(on_manifest);
+    };
+    manifest_timer.expires_after(std::chrono::minutes(1));
+    manifest_timer.async_wait(on_manifest);
+
+    // 收到SIGTERM或者SIGINT时停止接受连接，关闭空闲连接，等已有的请求处理完（最多drain_timeout）再退出；
+    // 再收到一次时立即退出
+    net::signal_set stop_signals(ioc, SIGTERM, SIGINT);
+    net::steady_timer drain_timer(ioc);
+    std::chrono::steady_clock::time_point drain_deadline;
+    std::function<void(const beast::error_code&)> on_drain = [&](const beast::error_code& ec)
+    {
+        if (ec)
+            return;
+
+        if (conn_manager.active() == 0 || std::chrono::steady_clock::now() >= drain_deadline)
+            return ioc.stop();
+
+        drain_timer.expires_after(std::chrono::milliseconds(100));
+        drain_timer.async_wait(on_drain);
+    };
+    stop_signals.async_wait([&](const beast::error_code& ec, int)
+    {
+        if (ec)
+            return;
+
+        for (const auto& l : listeners)
+            l->stop();
+        if (admin)
+            admin->stop();
+
+        // 下一个进程按它预热
+        save_static_manifest();
+        stop_static_warm_up();
+
+        conn_manager.start_drain();
+        drain_deadline = std::chrono::steady_clock::now() + drain_timeout;
+        on_drain({});
+
+        stop_signals.async_wait([&](const beast::error_code& again, int)
+        {
+            if (!again)
+                ioc.stop();
+        });
+    });
+
+    // 收到SIGUSR2时平滑升级：启动新的可执行文件并把监听socket传给它，新进程预热完缓存后让本进程退出
+    net::signal_set upgrade_signals(ioc, SIGUSR2);
+    std::function<void(const beast::error_code&, int)> on_upgrade = [&](const beast::error_code& ec, int)
+    {
+        if (ec)
+            return;
+
+        if (upgrade_in_progress())
+            gate_log.error("upgrade", "already in progress");
+        else if (!conn_manager.draining())
+        {
+            save_static_manifest();
+
+            std::vector<int> fds;
+            for (const auto& l : listeners)
+                fds.push_back(l->native_handle());
+            if (admin)
+                fds.push_back(admin->native_handle());
+
+            beast::error_code spawn_ec;
+            spawn_successor(fds, spawn_ec);
+            if (spawn_ec)
+                fail(spawn_ec, "upgrade");
+        }
+
+        upgrade_signals.async_wait(on_upgrade);
+    };
+    upgrade_signals.async_wait(on_upgrade);
+
+    // 新进程没能接手就退出时回收它
+    net::signal_set child_signals(ioc, SIGCHLD);
+    std::function<void(const beast::error_code&, int)> on_child = [&](const beast::error_code& ec, int)
+    {
+        if (ec)
+            return;
+
+        reap_successor();
+        child_signals.async_wait(on_child);
+    };
+    child_signals.async_wait(on_child);
+
+    // 缓存预热在单独的线程上进行，IO线程照常接受连接；预热完以后才让上一个进程退出，被打断时上一个进程继续服务
+    std::thread warm_up([doc_root]
+    {
+        if (warm_static_cache(*doc_root))
+            notify_predecessor();
+    });
 
     // 在线程上运行IO服务
     std::vector<std::thread> v;
@@ -277,6 +1202,16 @@ int main()
 
     ioc.run();
 
+    for (auto& t : v)
+        t.join();
+
+    // 第二次SIGTERM直接停掉了IO服务，预热可能还没被打断
+    stop_static_warm_up();
+    warm_up.join();
+    gate_blocking.stop();
+    gate_files.stop();
+    gate_log.stop();
+
     return EXIT_SUCCESS;
 }
 
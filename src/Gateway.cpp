@@ -0,0 +1,314 @@
+//
+// Created by cinea on 24-2-24.
+//
+
+#include "Gateway.h"
+
+#include <charconv>
+
+#include "FilterChain.h"
+#include "Metrics.h"
+#include "MimeTable.h"
+#include "RateLimiter.h"
+#include "StaticFileHandler.h"
+
+using namespace std::string_literals;
+
+// 代理列表，按配置文件中[[proxy]]的顺序匹配
+std::vector<proxy_pass> proxy_passes;
+
+// 路由编号：先是各个代理，然后是静态文件和指标
+size_t route_static = 0;
+size_t route_metrics = 1;
+
+std::string metrics_path_;
+uint64_t max_body_size_ = 1024 * 1024; // 代理以外的路由
+
+double find_number_or(const toml::value& table, const std::string& key, const double default_value)
+{
+    if (!table.contains(key))
+        return default_value;
+
+    const auto& value = toml::find(table, key);
+    if (value.is_integer())
+        return static_cast<double>(value.as_integer());
+    if (value.is_floating())
+        return value.as_floating();
+    return default_value;
+}
+
+/**
+ * \brief 读一个路由的过滤器，顺序是限流、认证、改写请求头，便宜的检查先做。
+ * \param table 路由的配置，不是表时只有限流
+ */
+std::vector<gate_filter> route_filters(const toml::value& table, const size_t route, const std::string& name)
+{
+    std::vector<gate_filter> filters;
+    if (gate_limiter.enabled())
+        filters.emplace_back(rate_limit_filter{route});
+
+    if (!table.is_table())
+        return filters;
+
+    if (table.contains("auth"))
+    {
+        auth_filter auth{toml::find<std::vector<std::string>>(table, "auth"),
+                         toml::find_or(table, "auth_realm", "forum-gate"s)};
+        if (auth.credentials.empty())
+            throw std::invalid_argument("route '" + name + "': auth must not be empty");
+        filters.emplace_back(std::move(auth));
+    }
+
+    header_filter headers;
+    if (table.contains("set_headers"))
+    {
+        for (const auto& [header, value] : toml::find(table, "set_headers").as_table())
+            headers.set.emplace_back(header, toml::get<std::string>(value));
+    }
+    headers.remove = toml::find_or(table, "remove_headers", std::vector<std::string>());
+
+    // 这两个头决定请求体怎么读，改了以后解析器和请求就对不上了
+    for (const auto& header : headers.remove)
+    {
+        if (beast::iequals(header, "Content-Length") || beast::iequals(header, "Transfer-Encoding"))
+            throw std::invalid_argument("route '" + name + "': cannot rewrite " + header);
+    }
+    for (const auto& header : headers.set)
+    {
+        if (beast::iequals(header.first, "Content-Length") || beast::iequals(header.first, "Transfer-Encoding"))
+            throw std::invalid_argument("route '" + name + "': cannot rewrite " + header.first);
+    }
+
+    if (!headers.set.empty() || !headers.remove.empty())
+        filters.emplace_back(std::move(headers));
+
+    return filters;
+}
+
+void init_gateway(const toml::value& config)
+{
+    metrics_path_ = toml::find_or(config, "metrics_path", "/metrics"s);
+    max_body_size_ = toml::find_or(config, "max_body_size", max_body_size_);
+
+    static_file_options static_opts;
+    if (config.contains("static"))
+    {
+        const auto& static_data = toml::find(config, "static");
+        static_opts.spa_fallback = toml::find_or(static_data, "spa_fallback", static_opts.spa_fallback);
+        static_opts.negative_ttl = std::chrono::seconds(
+            toml::find_or(static_data, "negative_ttl", static_opts.negative_ttl.count()));
+        static_opts.negative_entries = toml::find_or(static_data, "negative_entries", static_opts.negative_entries);
+        static_opts.cache_entries = toml::find_or(static_data, "cache_entries", static_opts.cache_entries);
+        static_opts.cache_bytes = toml::find_or(static_data, "cache_bytes", static_opts.cache_bytes);
+        static_opts.warm_up = toml::find_or(static_data, "warm_up", static_opts.warm_up);
+        static_opts.warm_threads = toml::find_or(static_data, "warm_threads", static_opts.warm_threads);
+        static_opts.manifest = toml::find_or(static_data, "manifest", static_opts.manifest);
+        static_opts.revalidate = std::chrono::seconds(
+            toml::find_or(static_data, "revalidate", static_opts.revalidate.count()));
+        static_opts.io_uring = toml::find_or(static_data, "io_uring", static_opts.io_uring);
+    }
+    configure_static_files(static_opts);
+
+    // 扩展名对应的类型，覆盖内置的表
+    if (config.contains("mime_types"))
+    {
+        for (const auto& [extension, type] : toml::find(config, "mime_types").as_table())
+            set_mime_type(extension, toml::get<std::string>(type));
+    }
+
+    proxy_passes.clear();
+    std::vector<token_rate> route_rates;
+    std::vector<std::vector<gate_filter>> filters;
+    if (config.contains("proxy"))
+    {
+        for (const auto& proxy_data : toml::find(config, "proxy").as_array())
+        {
+            auto prefix = toml::find<std::string>(proxy_data, "prefix");
+            const auto url_str = toml::find<std::string>(proxy_data, "url");
+            const auto url = boost::urls::parse_uri(url_str);
+            if (!url)
+                throw std::invalid_argument("proxy '" + prefix + "': invalid url '" + url_str + "'");
+
+            const auto real_ip = toml::find_or(proxy_data, "real_ip", false);
+            if (proxy_data.contains("expires"))
+                proxy_passes.emplace_back(std::move(prefix), url.value(),
+                                          toml::find<std::string>(proxy_data, "expires"), real_ip);
+            else
+                proxy_passes.emplace_back(std::move(prefix), url.value(), real_ip);
+
+            upstream_options options;
+            options.connect_timeout = std::chrono::seconds(
+                toml::find_or(proxy_data, "connect_timeout", options.connect_timeout.count()));
+            options.header_timeout = std::chrono::seconds(
+                toml::find_or(proxy_data, "header_timeout", options.header_timeout.count()));
+            options.idle_timeout = std::chrono::seconds(
+                toml::find_or(proxy_data, "idle_timeout", options.idle_timeout.count()));
+            options.retries = toml::find_or(proxy_data, "retries", options.retries);
+            options.failure_threshold = toml::find_or(proxy_data, "failure_threshold", options.failure_threshold);
+            options.open_timeout = std::chrono::seconds(
+                toml::find_or(proxy_data, "open_timeout", options.open_timeout.count()));
+
+            const auto proxy_protocol = toml::find_or(proxy_data, "proxy_protocol", ""s);
+            if (proxy_protocol == "v1")
+                options.proxy_protocol = proxy_protocol_version::v1;
+            else if (proxy_protocol == "v2")
+                options.proxy_protocol = proxy_protocol_version::v2;
+            else if (!proxy_protocol.empty())
+                throw std::invalid_argument("proxy '" + proxy_passes.back().prefix() +
+                    "': proxy_protocol must be \"v1\" or \"v2\"");
+
+            options.max_body_size = toml::find_or(proxy_data, "max_body_size", max_body_size_);
+            options.stream_threshold = toml::find_or(proxy_data, "stream_threshold", options.stream_threshold);
+            if (proxy_data.contains("socket"))
+            {
+                const auto& socket_data = toml::find(proxy_data, "socket");
+                read_socket_options(socket_data, options.socket);
+                options.socket.fast_open = toml::find_or(socket_data, "fast_open", options.socket.fast_open);
+            }
+
+            auto& concurrency = options.concurrency;
+            concurrency.max_concurrency = toml::find_or(proxy_data, "max_concurrency", concurrency.max_concurrency);
+            concurrency.min_concurrency = toml::find_or(proxy_data, "min_concurrency", concurrency.min_concurrency);
+            concurrency.queue_size = toml::find_or(proxy_data, "queue_size", concurrency.queue_size);
+            concurrency.queue_timeout = std::chrono::milliseconds(
+                toml::find_or(proxy_data, "queue_timeout", concurrency.queue_timeout.count()));
+            concurrency.adaptive = toml::find_or(proxy_data, "adaptive", concurrency.adaptive);
+            concurrency.latency_target = std::chrono::milliseconds(
+                toml::find_or(proxy_data, "latency_target", concurrency.latency_target.count()));
+
+            proxy_passes.back().configure(options);
+
+            // 这个路由对每个IP单独的限流
+            token_rate rate;
+            rate.rate = find_number_or(proxy_data, "rate", rate.rate);
+            rate.burst = toml::find_or(proxy_data, "burst", static_cast<unsigned>(rate.rate * 2));
+            route_rates.push_back(rate);
+
+            filters.push_back(route_filters(proxy_data, proxy_passes.size() - 1, proxy_passes.back().prefix()));
+        }
+    }
+
+    route_static = proxy_passes.size();
+    route_metrics = route_static + 1;
+    gate_limiter.limit_routes(std::move(route_rates));
+
+    // 静态文件的过滤器写在[static]里，指标只有限流
+    filters.push_back(route_filters(config.contains("static") ? toml::find(config, "static") : toml::value(),
+                                    route_static, "static"));
+    filters.push_back(route_filters(toml::value(), route_metrics, "metrics"));
+    gate_filters.compile(std::move(filters));
+
+    std::vector<std::string> routes;
+    std::vector<std::string> upstreams;
+    for (const auto& proxy_pass : proxy_passes)
+    {
+        routes.emplace_back(proxy_pass.prefix());
+        upstreams.emplace_back(proxy_pass.prefix());
+    }
+    routes.emplace_back("static");
+    routes.emplace_back("metrics");
+
+    gate_metrics.configure(std::move(routes), std::move(upstreams));
+}
+
+const std::vector<proxy_pass>& gateway_proxies()
+{
+    return proxy_passes;
+}
+
+size_t gateway_route(const beast::string_view& target)
+{
+    if (!metrics_path_.empty() && target.substr(0, target.find('?')) == metrics_path_)
+        return route_metrics;
+
+    for (size_t i = 0; i < proxy_passes.size(); i++)
+    {
+        if (proxy_passes[i].match(target))
+            return i;
+    }
+
+    // 默认情况
+    return route_static;
+}
+
+uint64_t gateway_body_limit(const size_t route)
+{
+    if (route < proxy_passes.size())
+        return proxy_passes[route].options().max_body_size;
+    return max_body_size_;
+}
+
+bool gateway_proxy_route(const size_t route)
+{
+    return route < proxy_passes.size();
+}
+
+bool gateway_stream_body(const size_t route, const std::optional<uint64_t>& content_length)
+{
+    if (route >= proxy_passes.size())
+        return false;
+    return !content_length || *content_length > proxy_passes[route].options().stream_threshold;
+}
+
+http::message_generator
+metrics_response(http::request<http::dynamic_body>&& req)
+{
+    http::response<http::string_body> res{http::status::ok, req.version()};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/plain; version=0.0.4");
+    res.set(http::field::cache_control, "no-store");
+    res.keep_alive(req.keep_alive());
+    res.body() = gate_metrics.render();
+    res.prepare_payload();
+    return res;
+}
+
+void handle_gateway_request(net::io_context& ioc,
+                            const std::filesystem::path& doc_root,
+                            const size_t route,
+                            http::request<http::dynamic_body>&& req,
+                            ProxyCallbackFunc&& handler,
+                            const client_info& client,
+                            request_trace* trace,
+                            std::shared_ptr<request_body_source> body)
+{
+    if (route < proxy_passes.size())
+    {
+        req.keep_alive(false); // 代理暂时不维持长链接
+        return proxy_passes[route].handle(ioc, route, std::move(req), std::move(handler), client, trace,
+                                          std::move(body));
+    }
+
+    if (route == route_metrics)
+        return handler(metrics_response(std::move(req)));
+
+    // 访问文件系统后回到连接的strand上
+    const auto executor = client.executor ? client.executor : net::any_io_executor(ioc.get_executor());
+    if (!trace)
+        return handle_static_file(executor, doc_root, std::move(req), std::move(handler));
+
+    handle_static_file(executor, doc_root, std::move(req),
+                       [trace, handler = std::move(handler)](http::message_generator&& res) mutable
+                       {
+                           trace_mark(trace, trace_phase::cache_lookup);
+                           handler(std::move(res));
+                       });
+}
+
+unsigned response_status(http::message_generator& msg)
+{
+    // 只准备不消费，写出时会拿到同样的缓冲区
+    beast::error_code ec;
+    const auto buffers = msg.prepare(ec);
+    if (ec || buffers.empty())
+        return 0;
+
+    // 状态行形如 "HTTP/1.1 200 OK"
+    const std::string_view line(static_cast<const char*>(buffers.begin()->data()), buffers.begin()->size());
+    if (line.size() < 12)
+        return 0;
+
+    unsigned status = 0;
+    std::from_chars(line.data() + 9, line.data() + 12, status);
+    return status;
+}
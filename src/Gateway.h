@@ -0,0 +1,106 @@
+//
+// Created by cinea on 24-2-24.
+//
+
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include <filesystem>
+#include <string>
+#include <toml.hpp>
+
+#include "Common.h"
+#include "ProxyPass.h"
+
+/**
+ * \brief 读一个数字配置项，写成整数或者小数都可以。
+ */
+double find_number_or(const toml::value& table, const std::string& key, double default_value);
+
+/**
+ * \brief 从配置读出代理列表和指标路径，并向指标登记路由和上游。必须在IO线程启动前调用。
+ */
+void init_gateway(const toml::value& config);
+
+/**
+ * \brief 配置里的代理，按匹配顺序。
+ */
+const std::vector<proxy_pass>& gateway_proxies();
+
+/**
+ * \brief 匹配请求应该交给哪条路由，结果用于handle_gateway_request和指标统计。
+ */
+size_t gateway_route(const beast::string_view& target);
+
+/**
+ * \brief 路由允许的最大请求体。
+ */
+uint64_t gateway_body_limit(size_t route);
+
+/**
+ * \brief 路由是否转发给上游，其他路由在本地生成响应，不用等网络。
+ */
+bool gateway_proxy_route(size_t route);
+
+/**
+ * \brief 请求体是否应该边读边转发给上游，只有代理路由会这样做。
+ * \param content_length 为空表示分块传输，长度未知
+ */
+bool gateway_stream_body(size_t route, const std::optional<uint64_t>& content_length);
+
+/**
+ * \brief 网关规则：按匹配到的路由转发给代理、输出指标或者按静态文件处理。
+ *
+ * 响应总是通过handler交回；代理的情况下handler会在代理连接的strand上被调用。
+ * body只用于gateway_stream_body返回true的请求。
+ */
+void handle_gateway_request(net::io_context& ioc,
+                            const std::filesystem::path& doc_root,
+                            size_t route,
+                            http::request<http::dynamic_body>&& req,
+                            ProxyCallbackFunc&& handler,
+                            const client_info& client,
+                            request_trace* trace = nullptr,
+                            std::shared_ptr<request_body_source> body = nullptr);
+
+/**
+ * \brief handle_gateway_request的完成令牌版本，协程里可以直接co_await net::use_awaitable。
+ *
+ * 不管响应来自哪个线程，都会投递到token关联的executor（没有时是client.executor）上交回。
+ */
+template <class CompletionToken>
+auto async_handle_gateway_request(net::io_context& ioc,
+                                  const std::filesystem::path& doc_root,
+                                  size_t route,
+                                  http::request<http::dynamic_body>&& req,
+                                  const client_info& client,
+                                  request_trace* trace,
+                                  std::shared_ptr<request_body_source> body,
+                                  CompletionToken&& token)
+{
+    return net::async_initiate<CompletionToken, void(http::message_generator)>(
+        [&ioc, &doc_root, route, &client, trace](auto handler, http::request<http::dynamic_body>&& req,
+                                                 std::shared_ptr<request_body_source> body)
+        {
+            auto executor = net::get_associated_executor(handler, client.executor);
+
+            // 完成处理器直接放进ProxyCallbackFunc，协程的处理器加上executor也放得下，不分配内存
+            handle_gateway_request(ioc, doc_root, route, std::move(req),
+                                   [executor, handler = std::move(handler)](http::message_generator&& msg) mutable
+                                   {
+                                       net::post(executor, [handler = std::move(handler), msg = std::move(msg)]() mutable
+                                       {
+                                           handler(std::move(msg));
+                                       });
+                                   },
+                                   client, trace, std::move(body));
+        },
+        token, std::move(req), std::move(body));
+}
+
+/**
+ * \brief 从还没有写出的响应中读出状态码，失败时返回0。
+ */
+unsigned response_status(http::message_generator& msg);
+
+#endif //GATEWAY_H
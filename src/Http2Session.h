@@ -0,0 +1,748 @@
+//
+// Created by cinea on 24-2-24.
+//
+
+#ifndef HTTP2SESSION_H
+#define HTTP2SESSION_H
+
+#ifdef FORUM_GATE_HTTP2
+
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/beast/core/detail/base64.hpp>
+#include <nghttp2/nghttp2.h>
+
+#include "Common.h"
+#include "ConnectionManager.h"
+#include "Errors.h"
+#include "FilterChain.h"
+#include "Gateway.h"
+#include "Metrics.h"
+#include "TlsContext.h"
+
+constexpr uint32_t HTTP2_MAX_CONCURRENT_STREAMS = 128; // 每个连接最多同时处理多少个流
+
+/**
+ * \brief 检查收到的数据是否为HTTP/2连接序言（h2c prior knowledge）。
+ * \param partial 数据还不够长、但到目前为止都和序言一致时置为true
+ */
+inline bool match_http2_preface(const std::string_view& data, bool& partial)
+{
+    constexpr std::string_view magic(NGHTTP2_CLIENT_MAGIC, NGHTTP2_CLIENT_MAGIC_LEN);
+
+    const auto n = std::min(data.size(), magic.size());
+    const bool same = data.substr(0, n) == magic.substr(0, n);
+
+    partial = same && n < magic.size();
+    return same && n == magic.size();
+}
+
+/**
+ * \brief 是否为可以接受的h2c升级请求（RFC 7540 3.2）。带请求体的升级请求按HTTP/1.1处理。
+ */
+inline bool is_http2_upgrade(const http::request<http::dynamic_body>& req)
+{
+    return http::token_list(req[http::field::upgrade]).exists("h2c") &&
+        req.find("HTTP2-Settings") != req.end() &&
+        req.body().size() == 0;
+}
+
+/**
+ * \brief 解码HTTP2-Settings头（base64url，不带填充）。
+ */
+inline std::string decode_http2_settings(const beast::string_view& value)
+{
+    std::string encoded(value);
+    std::replace(encoded.begin(), encoded.end(), '-', '+');
+    std::replace(encoded.begin(), encoded.end(), '_', '/');
+    encoded.append((4 - encoded.size() % 4) % 4, '=');
+
+    std::string decoded(beast::detail::base64::decoded_size(encoded.size()), '\0');
+    const auto result = beast::detail::base64::decode(decoded.data(), encoded.data(), encoded.size());
+    decoded.resize(result.first);
+    return decoded;
+}
+
+/**
+ * \brief 网关生成的响应，转成HTTP/2的头和数据帧。
+ *
+ * message_generator是类型擦除的，只能拿到HTTP/1.1的序列化结果，所以重新解析：响应头先解析出来，
+ * 响应体等nghttp2要数据时才从generator取，去掉分块编码后直接写进帧里。
+ * 大文件和代理的下载不会整个放进内存，最多多留一小段被切开的响应头或者分块头。
+ */
+class http2_response_source
+{
+    static constexpr size_t max_append = 4096; // 解析器需要更多数据时每次多取多少
+
+    http::message_generator msg_;
+    http::response_parser<http::buffer_body> parser_;
+    beast::flat_buffer pending_; // 从generator取出、还没被解析器用掉的数据
+
+public:
+    http2_response_source(http::message_generator&& msg, const bool head): msg_(std::move(msg))
+    {
+        parser_.skip(head);
+        parser_.body_limit((std::numeric_limits<std::uint64_t>::max)());
+    }
+
+    void read_header(beast::error_code& ec)
+    {
+        while (!parser_.is_header_done())
+        {
+            if (!append(ec))
+            {
+                if (!ec)
+                    ec = http::error::partial_message;
+                return;
+            }
+
+            bool need_more = false;
+            pending_.consume(put(pending_.data(), need_more, ec));
+            if (ec)
+                return;
+        }
+
+        parser_.eager(true);
+    }
+
+    [[nodiscard]] const http::response<http::buffer_body>& header() const { return parser_.get(); }
+
+    // 访问日志用，分块传输时不知道长度
+    [[nodiscard]] uint64_t content_length() const { return parser_.content_length().value_or(0); }
+
+    [[nodiscard]] bool done() const { return parser_.is_done(); }
+
+    /**
+     * \brief 把响应体写进buf，最多length字节。
+     * \return 写了多少字节，done()为true时响应体已经读完
+     */
+    size_t read(uint8_t* buf, const size_t length, beast::error_code& ec)
+    {
+        auto& body = parser_.get().body();
+        body.data = buf;
+        body.size = length;
+
+        while (body.size > 0 && !parser_.is_done())
+        {
+            bool need_more = false;
+
+            if (pending_.size() > 0)
+            {
+                pending_.consume(put(pending_.data(), need_more, ec));
+            }
+            else if (msg_.is_done())
+            {
+                // 没有长度、以关闭连接结束的响应体
+                parser_.put_eof(ec);
+            }
+            else
+            {
+                // 通常直接从generator的缓冲区解析，不用复制
+                const auto buffers = msg_.prepare(ec);
+                if (ec)
+                    return 0;
+
+                size_t used = 0;
+                for (const auto& buffer : buffers)
+                {
+                    const auto n = put(buffer, need_more, ec);
+                    used += n;
+                    if (ec || need_more || n < buffer.size())
+                        break;
+                }
+                msg_.consume(used);
+            }
+
+            if (ec)
+                return 0;
+
+            // 分块头被缓冲区切开了，多取一段拼起来再解析
+            if (need_more && !append(ec))
+            {
+                if (ec)
+                    return 0;
+                parser_.put_eof(ec);
+                if (ec)
+                    return 0;
+            }
+        }
+
+        return length - body.size;
+    }
+
+private:
+    // 帧写满了（need_buffer）和数据不够（need_more）都不算错误
+    size_t put(const net::const_buffer& data, bool& need_more, beast::error_code& ec)
+    {
+        if (data.size() == 0)
+            return 0;
+
+        const auto used = parser_.put(data, ec);
+        need_more = ec == http::error::need_more || (!ec && used == 0 && !parser_.is_done());
+        if (ec == http::error::need_more || ec == http::error::need_buffer)
+            ec = {};
+        return used;
+    }
+
+    // 从generator多取最多max_append字节接在pending_后面，generator已经没有数据时返回false
+    bool append(beast::error_code& ec)
+    {
+        if (msg_.is_done())
+            return false;
+
+        const auto buffers = msg_.prepare(ec);
+        if (ec)
+            return false;
+
+        size_t n = 0;
+        for (const auto& buffer : buffers)
+        {
+            const auto take = std::min(buffer.size(), max_append - n);
+            pending_.commit(net::buffer_copy(pending_.prepare(take), net::buffer(buffer.data(), take)));
+            n += take;
+            if (n == max_append)
+                break;
+        }
+        msg_.consume(n);
+        return true;
+    }
+};
+
+/**
+ * \brief HTTP/2连接。帧、HPACK和流量控制交给nghttp2，每个流完整收到后走和HTTP/1相同的网关规则。
+ */
+template <class Stream>
+class http2_session : public std::enable_shared_from_this<http2_session<Stream>>, public keep_alive_connection
+{
+    // 单个流的状态
+    struct stream_state
+    {
+        http::request<http::dynamic_body> req;
+        bool head{false};
+        bool dispatched{false};
+        std::optional<uint64_t> body_limit; // 收到第一段数据时按路由确定
+        bool too_large{false}; // 请求体超出限制，后面的数据直接丢掉
+
+        size_t route{0};
+        std::chrono::steady_clock::time_point start;
+        std::string method; // 访问日志用
+        std::string target;
+
+        std::unique_ptr<http2_response_source> response; // 响应体在nghttp2要数据时才取
+    };
+
+    net::io_context& ioc_;
+    Stream stream_;
+    beast::flat_buffer buffer_;
+    std::shared_ptr<std::filesystem::path const> doc_root_;
+    connection_slot slot_;
+    client_info client_;
+    net::ip::address remote_;
+
+    nghttp2_session* session_{nullptr};
+    std::unordered_map<int32_t, std::unique_ptr<stream_state>> streams_;
+
+    std::vector<uint8_t> write_buffer_;
+    bool writing_{false};
+
+    bool idle_{false}; // 没有流，登记在连接管理器的空闲列表里
+    bool goaway_{false}; // 已经发了GOAWAY，处理完已有的流就关闭
+
+public:
+    http2_session(
+        net::io_context& ioc,
+        Stream&& stream,
+        beast::flat_buffer&& buffer,
+        std::shared_ptr<std::filesystem::path const> const& doc_root,
+        connection_slot&& slot,
+        const client_info& client): // 由HTTP/1的session传过来，可能来自PROXY协议头
+        ioc_(ioc),
+        stream_(std::move(stream)),
+        buffer_(std::move(buffer)),
+        doc_root_(doc_root),
+        slot_(std::move(slot)),
+        client_(client),
+        remote_(client.remote.address())
+    {
+    }
+
+    ~http2_session()
+    {
+        if (idle_)
+            conn_manager.remove_idle(slot_.shard(), this);
+
+        if (session_)
+            nghttp2_session_del(session_);
+    }
+
+    // 客户端直接发送了连接序言
+    void run()
+    {
+        if (!init())
+            return;
+
+        on_data();
+    }
+
+    // 客户端通过Upgrade: h2c升级，101已经写出，原请求作为1号流处理
+    void run_upgrade(http::request<http::dynamic_body>&& req, const std::string& settings)
+    {
+        if (!init())
+            return;
+
+        const auto rv = nghttp2_session_upgrade2(
+            session_, reinterpret_cast<const uint8_t*>(settings.data()), settings.size(),
+            req.method() == http::verb::head, nullptr);
+        if (rv != 0)
+            return fail_h2(rv, "upgrade");
+
+        open_stream(1).req = std::move(req);
+        dispatch_stream(1);
+
+        on_data();
+    }
+
+private:
+    bool init()
+    {
+        nghttp2_session_callbacks* callbacks;
+        nghttp2_session_callbacks_new(&callbacks);
+        nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, &http2_session::on_begin_headers);
+        nghttp2_session_callbacks_set_on_header_callback(callbacks, &http2_session::on_header);
+        nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, &http2_session::on_data_chunk_recv);
+        nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, &http2_session::on_frame_recv);
+        nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, &http2_session::on_stream_close);
+
+        const auto rv = nghttp2_session_server_new(&session_, callbacks, this);
+        nghttp2_session_callbacks_del(callbacks);
+        if (rv != 0)
+        {
+            session_ = nullptr;
+            fail_h2(rv, "session");
+            return false;
+        }
+
+        const nghttp2_settings_entry settings[]
+        {
+            {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_MAX_CONCURRENT_STREAMS},
+        };
+        nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, settings, std::size(settings));
+
+        return true;
+    }
+
+    // 有流在处理时不能因为读超时断开连接；没有流时和HTTP/1的空闲连接一样可以被淘汰
+    void update_deadline()
+    {
+        if (conn_manager.draining())
+            shutdown_gracefully();
+
+        if (streams_.empty())
+        {
+            beast::get_lowest_layer(stream_).expires_after(conn_manager.options().idle_timeout);
+            if (!std::exchange(idle_, true))
+                conn_manager.add_idle(slot_.shard(), this->shared_from_this());
+        }
+        else
+        {
+            beast::get_lowest_layer(stream_).expires_never();
+            if (std::exchange(idle_, false))
+                conn_manager.remove_idle(slot_.shard(), this);
+        }
+    }
+
+public:
+    void evict() override
+    {
+        net::post(stream_.get_executor(), [self = this->shared_from_this()]
+        {
+            // 到这里时可能已经有新的流了，这时等进程退出时再处理
+            if (self->idle_ || conn_manager.draining())
+                self->shutdown_gracefully();
+        });
+    }
+
+private:
+    // 发GOAWAY，客户端不会再开新的流；已有的流处理完后由do_write关闭连接
+    void shutdown_gracefully()
+    {
+        if (std::exchange(goaway_, true))
+            return;
+
+        nghttp2_submit_goaway(session_, NGHTTP2_FLAG_NONE, nghttp2_session_get_last_proc_stream_id(session_),
+                              NGHTTP2_NO_ERROR, nullptr, 0);
+        do_write();
+    }
+
+    void do_read()
+    {
+        update_deadline();
+
+        stream_.async_read_some(
+            buffer_.prepare(16 * 1024),
+            beast::bind_front_handler(&http2_session::on_read, this->shared_from_this()));
+    }
+
+    void on_read(const beast::error_code& ec, std::size_t bytes_transferred)
+    {
+        if (ec == net::error::eof || ec == net::ssl::error::stream_truncated)
+            return do_close();
+
+        if (ec)
+            return fail(ec, "h2 read");
+
+        gate_metrics.add(gate_counter::bytes_in, bytes_transferred);
+
+        buffer_.commit(bytes_transferred);
+        on_data();
+    }
+
+    // 把缓冲区里的数据交给nghttp2，再把产生的帧写出去
+    void on_data()
+    {
+        if (buffer_.size() > 0)
+        {
+            const auto data = buffer_.data();
+            const auto rv = nghttp2_session_mem_recv(
+                session_, static_cast<const uint8_t*>(data.data()), data.size());
+            if (rv < 0)
+                return fail_h2(static_cast<int>(rv), "recv");
+
+            buffer_.consume(buffer_.size());
+        }
+
+        do_write();
+
+        if (nghttp2_session_want_read(session_))
+            do_read();
+    }
+
+    void do_write()
+    {
+        if (writing_)
+            return;
+
+        write_buffer_.clear();
+        for (;;)
+        {
+            const uint8_t* data;
+            const auto n = nghttp2_session_mem_send(session_, &data);
+            if (n < 0)
+                return fail_h2(static_cast<int>(n), "send");
+            if (n == 0)
+                break;
+
+            write_buffer_.insert(write_buffer_.end(), data, data + n);
+            if (write_buffer_.size() >= 64 * 1024)
+                break;
+        }
+
+        if (write_buffer_.empty())
+        {
+            if ((goaway_ && streams_.empty()) ||
+                (!nghttp2_session_want_read(session_) && !nghttp2_session_want_write(session_)))
+                do_close();
+            return;
+        }
+
+        writing_ = true;
+        beast::get_lowest_layer(stream_).expires_after(conn_manager.options().request_timeout);
+
+        net::async_write(
+            stream_, net::buffer(write_buffer_),
+            beast::bind_front_handler(&http2_session::on_write, this->shared_from_this()));
+    }
+
+    void on_write(const beast::error_code& ec, std::size_t bytes_transferred)
+    {
+        writing_ = false;
+
+        if (ec)
+            return fail(ec, "h2 write");
+
+        gate_metrics.add(gate_counter::bytes_out, bytes_transferred);
+
+        update_deadline();
+        do_write();
+    }
+
+    void do_close()
+    {
+        if constexpr (is_ssl_stream<Stream>::value)
+        {
+            beast::get_lowest_layer(stream_).expires_after(conn_manager.options().request_timeout);
+
+            stream_.async_shutdown([self = this->shared_from_this()](const beast::error_code& ec)
+            {
+                if (ec && ec != net::ssl::error::stream_truncated)
+                    fail(ec, "h2 shutdown");
+            });
+        }
+        else
+        {
+            beast::error_code ec;
+
+            boost::ignore_unused(
+                stream_.socket().shutdown(tcp::socket::shutdown_send, ec)
+            );
+
+            if (ec && ec != beast::errc::not_connected)
+                return fail(ec, "h2 close");
+        }
+    }
+
+    stream_state& open_stream(const int32_t id)
+    {
+        auto& st = streams_[id];
+        st = std::make_unique<stream_state>();
+        st->req.version(11);
+        return *st;
+    }
+
+    stream_state* find_stream(const int32_t id)
+    {
+        const auto it = streams_.find(id);
+        return it == streams_.end() ? nullptr : it->second.get();
+    }
+
+    // 请求已经完整收到，交给网关
+    void dispatch_stream(const int32_t id)
+    {
+        auto* st = find_stream(id);
+        if (!st || st->dispatched)
+            return;
+
+        st->dispatched = true;
+        st->head = st->req.method() == http::verb::head;
+        st->req.prepare_payload();
+        st->route = gateway_route(st->req.target());
+        st->start = std::chrono::steady_clock::now();
+        if (gate_log.access_enabled())
+        {
+            st->method = st->req.method_string();
+            st->target = st->req.target();
+        }
+
+        auto self = this->shared_from_this();
+        if (st->too_large)
+        {
+            return net::post(stream_.get_executor(), [self, id, msg = payload_too_large(std::move(st->req))]() mutable
+            {
+                self->send_response(id, std::move(msg));
+            });
+        }
+
+        if (const auto filter = gate_filters.run(st->route, st->req, client_.remote.address()))
+        {
+            return net::post(stream_.get_executor(),
+                             [self, id, msg = reject_request(*filter, std::move(st->req))]() mutable
+                             {
+                                 self->send_response(id, std::move(msg));
+                             });
+        }
+
+        handle_gateway_request(
+            ioc_, *doc_root_, st->route, std::move(st->req),
+            [self, id](http::message_generator&& msg)
+            {
+                // 回调可能来自代理连接的strand，要回到本连接上处理
+                net::post(self->stream_.get_executor(), [self, id, msg = std::move(msg)]() mutable
+                {
+                    self->send_response(id, std::move(msg));
+                });
+            },
+            client_);
+    }
+
+    void send_response(const int32_t id, http::message_generator&& msg)
+    {
+        auto* st = find_stream(id);
+        if (!st)
+            return; // 流已经被客户端关闭
+
+        beast::error_code ec;
+        auto response = std::make_unique<http2_response_source>(std::move(msg), st->head);
+        response->read_header(ec);
+        if (ec)
+        {
+            fail(ec, "h2 response");
+            nghttp2_submit_rst_stream(session_, NGHTTP2_FLAG_NONE, id, NGHTTP2_INTERNAL_ERROR);
+            return do_write();
+        }
+
+        const auto& res = response->header();
+
+        const auto elapsed = std::chrono::steady_clock::now() - st->start;
+        gate_metrics.record_request(st->route, res.result_int(), elapsed);
+        gate_log.access(remote_, st->method, st->target, 20, res.result_int(), response->content_length(), elapsed);
+
+        const auto status = std::to_string(res.result_int());
+
+        // HTTP/2要求头部名称小写，先把名称都准备好，保证指针在提交前有效
+        std::vector<std::string> names;
+        names.reserve(std::distance(res.begin(), res.end()));
+        std::vector<nghttp2_nv> nva;
+        nva.reserve(names.capacity() + 1);
+
+        nva.push_back(make_nv(":status", status));
+        for (const auto& field : res)
+        {
+            if (is_connection_specific(field.name()))
+                continue;
+
+            auto& name = names.emplace_back(field.name_string());
+            std::transform(name.begin(), name.end(), name.begin(), [](const unsigned char c)
+            {
+                return static_cast<char>(std::tolower(c));
+            });
+            nva.push_back(make_nv(name, field.value()));
+        }
+
+        const bool has_body = !response->done();
+        st->response = std::move(response);
+
+        nghttp2_data_provider provider{};
+        provider.source.ptr = st;
+        provider.read_callback = &http2_session::on_read_body;
+
+        const auto rv = nghttp2_submit_response(
+            session_, id, nva.data(), nva.size(), has_body ? &provider : nullptr);
+        if (rv != 0)
+            fail_h2(rv, "submit");
+
+        do_write();
+    }
+
+    static bool is_connection_specific(const http::field name)
+    {
+        return name == http::field::connection ||
+            name == http::field::keep_alive ||
+            name == http::field::proxy_connection ||
+            name == http::field::transfer_encoding ||
+            name == http::field::upgrade;
+    }
+
+    static nghttp2_nv make_nv(const beast::string_view& name, const beast::string_view& value)
+    {
+        return nghttp2_nv{
+            reinterpret_cast<uint8_t*>(const_cast<char*>(name.data())),
+            reinterpret_cast<uint8_t*>(const_cast<char*>(value.data())),
+            name.size(), value.size(), NGHTTP2_NV_FLAG_NONE
+        };
+    }
+
+    static void fail_h2(const int rv, char const* what)
+    {
+        gate_log.error(std::string("h2 ") + what, nghttp2_strerror(rv));
+    }
+
+    //--------------------------------------------------------------------------
+    // nghttp2回调
+
+    static int on_begin_headers(nghttp2_session*, const nghttp2_frame* frame, void* user_data)
+    {
+        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+            return 0;
+
+        static_cast<http2_session*>(user_data)->open_stream(frame->hd.stream_id);
+        return 0;
+    }
+
+    static int on_header(nghttp2_session*, const nghttp2_frame* frame,
+                         const uint8_t* name, const size_t namelen,
+                         const uint8_t* value, const size_t valuelen,
+                         uint8_t, void* user_data)
+    {
+        if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+            return 0;
+
+        auto* st = static_cast<http2_session*>(user_data)->find_stream(frame->hd.stream_id);
+        if (!st)
+            return 0;
+
+        const beast::string_view n(reinterpret_cast<const char*>(name), namelen);
+        const beast::string_view v(reinterpret_cast<const char*>(value), valuelen);
+        auto& req = st->req;
+
+        if (n == ":method")
+            req.method_string(v);
+        else if (n == ":path")
+            req.target(v);
+        else if (n == ":authority")
+            req.set(http::field::host, v);
+        else if (n.empty() || n[0] == ':')
+            return 0;
+        else if (n == "cookie" && req.find(http::field::cookie) != req.end())
+            // HTTP/2允许把Cookie拆成多个头，转成HTTP/1.1时要拼回去
+            req.set(http::field::cookie, std::string(req[http::field::cookie]) + "; " + std::string(v));
+        else
+            req.insert(n, v);
+
+        return 0;
+    }
+
+    static int on_data_chunk_recv(nghttp2_session*, uint8_t, const int32_t stream_id,
+                                  const uint8_t* data, const size_t len, void* user_data)
+    {
+        auto* st = static_cast<http2_session*>(user_data)->find_stream(stream_id);
+        if (!st || st->dispatched || st->too_large)
+            return 0;
+
+        if (!st->body_limit)
+            st->body_limit = gateway_body_limit(gateway_route(st->req.target()));
+
+        auto& body = st->req.body();
+        if (body.size() + len > *st->body_limit)
+        {
+            st->too_large = true;
+            body.consume(body.size());
+            return 0;
+        }
+        body.commit(net::buffer_copy(body.prepare(len), net::buffer(data, len)));
+        return 0;
+    }
+
+    static int on_frame_recv(nghttp2_session*, const nghttp2_frame* frame, void* user_data)
+    {
+        if ((frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) &&
+            (frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+            static_cast<http2_session*>(user_data)->dispatch_stream(frame->hd.stream_id);
+
+        return 0;
+    }
+
+    static int on_stream_close(nghttp2_session*, const int32_t stream_id, uint32_t, void* user_data)
+    {
+        static_cast<http2_session*>(user_data)->streams_.erase(stream_id);
+        return 0;
+    }
+
+    static ssize_t on_read_body(nghttp2_session*, int32_t, uint8_t* buf, const size_t length,
+                                uint32_t* data_flags, nghttp2_data_source* source, void*)
+    {
+        auto* st = static_cast<stream_state*>(source->ptr);
+
+        beast::error_code ec;
+        const auto n = st->response->read(buf, length, ec);
+        if (ec)
+        {
+            // 响应头已经发出去了，只能重置这个流
+            fail(ec, "h2 response body");
+            return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+        }
+
+        if (st->response->done())
+            *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+
+        return static_cast<ssize_t>(n);
+    }
+};
+
+#endif //FORUM_GATE_HTTP2
+
+#endif //HTTP2SESSION_H
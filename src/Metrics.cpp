@@ -0,0 +1,272 @@
+//
+// Created by cinea on 24-2-27.
+//
+
+#include "Metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "AccessLog.h"
+#include "BlockingPool.h"
+#include "ConnectionManager.h"
+
+metrics_registry gate_metrics;
+
+namespace
+{
+    constexpr size_t status_classes = 5; // 1xx ~ 5xx
+    constexpr size_t histogram_size = latency_buckets::count + 2; // 各个桶 + 总和 + 次数
+
+    constexpr const char* counter_names[] = {
+        "forum_gate_connections_accepted_total",
+        "forum_gate_bytes_in_total",
+        "forum_gate_bytes_out_total",
+        "forum_gate_static_cache_hits_total",
+        "forum_gate_static_cache_misses_total",
+        "forum_gate_static_cache_evictions_total",
+        "forum_gate_static_cache_hit_bytes_total",
+        "forum_gate_static_cache_load_bytes_total",
+        "forum_gate_static_negative_hits_total",
+        "forum_gate_static_spa_fallbacks_total",
+        "forum_gate_upstream_retries_total",
+        "forum_gate_upstream_errors_total",
+        "forum_gate_upstream_rejected_total",
+        "forum_gate_upstream_queued_total",
+        "forum_gate_upstream_shed_total",
+        "forum_gate_rate_limited_total",
+        "forum_gate_auth_rejected_total",
+        "forum_gate_blocking_tasks_total",
+        "forum_gate_blocking_overflows_total",
+    };
+    static_assert(std::size(counter_names) == static_cast<size_t>(gate_counter::count_));
+
+    constexpr const char* upstream_phase_names[] = {"connect", "first_byte", "total"};
+    static_assert(std::size(upstream_phase_names) == static_cast<size_t>(upstream_phase::count_));
+
+    std::string escape_label(const std::string& value)
+    {
+        std::string out;
+        out.reserve(value.size());
+        for (const auto c : value)
+        {
+            if (c == '\\' || c == '"')
+                out += '\\';
+            if (c == '\n')
+                out += "\\n";
+            else
+                out += c;
+        }
+        return out;
+    }
+
+    void append_seconds(std::string& out, const uint64_t us)
+    {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6f", static_cast<double>(us) / 1e6);
+        out += buf;
+    }
+}
+
+size_t latency_buckets::index(const uint64_t us)
+{
+    if (us < sub_count)
+        return us;
+
+    const auto msb = static_cast<size_t>(63 - __builtin_clzll(us));
+    const auto sub = static_cast<size_t>(us >> (msb - sub_bits)) & (sub_count - 1);
+    return std::min((msb - sub_bits + 1) * sub_count + sub, count - 1);
+}
+
+uint64_t latency_buckets::upper_bound(const size_t index)
+{
+    if (index < sub_count)
+        return index + 1;
+
+    const auto shift = index / sub_count - 1;
+    const auto sub = index % sub_count;
+    return (sub_count + sub + 1) << shift;
+}
+
+metrics_registry::metrics_registry()
+{
+    configure({}, {});
+}
+
+void metrics_registry::configure(std::vector<std::string> routes, std::vector<std::string> upstreams)
+{
+    routes_ = std::move(routes);
+    upstreams_ = std::move(upstreams);
+
+    requests_offset_ = static_cast<size_t>(gate_counter::count_);
+    request_hist_offset_ = requests_offset_ + routes_.size() * status_classes;
+    upstream_hist_offset_ = request_hist_offset_ + routes_.size() * histogram_size;
+    size_ = upstream_hist_offset_ +
+        upstreams_.size() * static_cast<size_t>(upstream_phase::count_) * histogram_size;
+
+    std::lock_guard guard(mutex_);
+    slabs_.clear();
+    generation_++;
+}
+
+metrics_registry::slab& metrics_registry::local()
+{
+    thread_local slab* s = nullptr;
+    thread_local size_t generation = 0;
+    if (!s || generation != generation_)
+    {
+        std::lock_guard guard(mutex_);
+        slabs_.push_back(std::make_unique<slab>((size_ + 7) / 8));
+        s = slabs_.back().get();
+        generation = generation_;
+    }
+    return *s;
+}
+
+void metrics_registry::add(gate_counter counter, const uint64_t n)
+{
+    bump(local(), static_cast<size_t>(counter), n);
+}
+
+void metrics_registry::record_request(const size_t route, const unsigned status,
+                                      const std::chrono::steady_clock::duration latency)
+{
+    if (route >= routes_.size())
+        return;
+
+    auto& s = local();
+    const auto status_class = std::clamp<unsigned>(status / 100, 1, status_classes) - 1;
+    bump(s, requests_offset_ + route * status_classes + status_class, 1);
+    record_latency(s, request_hist_offset_ + route * histogram_size, latency);
+}
+
+void metrics_registry::record_upstream(const size_t upstream, upstream_phase phase,
+                                       const std::chrono::steady_clock::duration latency)
+{
+    if (upstream >= upstreams_.size())
+        return;
+
+    const auto index = upstream * static_cast<size_t>(upstream_phase::count_) + static_cast<size_t>(phase);
+    record_latency(local(), upstream_hist_offset_ + index * histogram_size, latency);
+}
+
+void metrics_registry::record_latency(slab& s, const size_t offset, const std::chrono::steady_clock::duration latency)
+{
+    const auto us = static_cast<uint64_t>(
+        std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count(), 0));
+
+    bump(s, offset + latency_buckets::index(us), 1);
+    bump(s, offset + latency_buckets::count, us);
+    bump(s, offset + latency_buckets::count + 1, 1);
+}
+
+uint64_t metrics_registry::sum(const size_t index) const
+{
+    uint64_t total = 0;
+    for (const auto& s : slabs_)
+        total += (*s)[index / 8].v[index % 8].load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t metrics_registry::total(const gate_counter counter) const
+{
+    std::lock_guard guard(mutex_);
+    return sum(static_cast<size_t>(counter));
+}
+
+void metrics_registry::render_histogram(std::string& out, const char* name, const std::string& labels,
+                                        const size_t offset) const
+{
+    const auto count = sum(offset + latency_buckets::count + 1);
+
+    // 只输出到最后一个非空的桶
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < latency_buckets::count && cumulative < count; i++)
+    {
+        const auto n = sum(offset + i);
+        cumulative += n;
+        if (n == 0)
+            continue;
+
+        out += name;
+        out += "_bucket{" + labels + ",le=\"";
+        append_seconds(out, latency_buckets::upper_bound(i));
+        out += "\"} " + std::to_string(cumulative) + "\n";
+    }
+
+    out += name;
+    out += "_bucket{" + labels + ",le=\"+Inf\"} " + std::to_string(count) + "\n";
+    out += name;
+    out += "_sum{" + labels + "} ";
+    append_seconds(out, sum(offset + latency_buckets::count));
+    out += "\n";
+    out += name;
+    out += "_count{" + labels + "} " + std::to_string(count) + "\n";
+}
+
+std::string metrics_registry::render() const
+{
+    std::string out;
+    out.reserve(16 * 1024);
+
+    std::lock_guard guard(mutex_);
+
+    for (size_t i = 0; i < std::size(counter_names); i++)
+    {
+        out += "# TYPE ";
+        out += counter_names[i];
+        out += " counter\n";
+        out += counter_names[i];
+        out += " " + std::to_string(sum(i)) + "\n";
+    }
+
+    out += "# TYPE forum_gate_log_dropped_total counter\n";
+    out += "forum_gate_log_dropped_total " + std::to_string(gate_log.dropped()) + "\n";
+
+    out += "# TYPE forum_gate_connections_active gauge\n";
+    out += "forum_gate_connections_active " + std::to_string(conn_manager.active()) + "\n";
+    out += "# TYPE forum_gate_connections_idle gauge\n";
+    out += "forum_gate_connections_idle " + std::to_string(conn_manager.idle()) + "\n";
+
+    out += "# TYPE forum_gate_blocking_queue_depth gauge\n";
+    out += "forum_gate_blocking_queue_depth " + std::to_string(gate_blocking.queue_depth()) + "\n";
+    out += "# TYPE forum_gate_blocking_busy_threads gauge\n";
+    out += "forum_gate_blocking_busy_threads " + std::to_string(gate_blocking.busy()) + "\n";
+
+    out += "# TYPE forum_gate_requests_total counter\n";
+    for (size_t route = 0; route < routes_.size(); route++)
+    {
+        for (size_t c = 0; c < status_classes; c++)
+        {
+            const auto n = sum(requests_offset_ + route * status_classes + c);
+            if (n == 0)
+                continue;
+
+            out += "forum_gate_requests_total{route=\"" + escape_label(routes_[route]) + "\",code=\"" +
+                std::to_string(c + 1) + "xx\"} " + std::to_string(n) + "\n";
+        }
+    }
+
+    out += "# TYPE forum_gate_request_duration_seconds histogram\n";
+    for (size_t route = 0; route < routes_.size(); route++)
+    {
+        render_histogram(out, "forum_gate_request_duration_seconds",
+                         "route=\"" + escape_label(routes_[route]) + "\"",
+                         request_hist_offset_ + route * histogram_size);
+    }
+
+    out += "# TYPE forum_gate_upstream_duration_seconds histogram\n";
+    for (size_t upstream = 0; upstream < upstreams_.size(); upstream++)
+    {
+        for (size_t phase = 0; phase < static_cast<size_t>(upstream_phase::count_); phase++)
+        {
+            const auto index = upstream * static_cast<size_t>(upstream_phase::count_) + phase;
+            render_histogram(out, "forum_gate_upstream_duration_seconds",
+                             "upstream=\"" + escape_label(upstreams_[upstream]) + "\",phase=\"" +
+                             upstream_phase_names[phase] + "\"",
+                             upstream_hist_offset_ + index * histogram_size);
+        }
+    }
+
+    return out;
+}
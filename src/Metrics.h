@@ -0,0 +1,128 @@
+//
+// Created by cinea on 24-2-27.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class gate_counter : size_t
+{
+    connections_accepted,
+    bytes_in,
+    bytes_out,
+    static_cache_hits,
+    static_cache_misses,
+    static_cache_evictions,
+    static_cache_hit_bytes, // 从缓存直接返回的字节数
+    static_cache_load_bytes, // 从磁盘读入的字节数
+    static_negative_hits, // 命中不存在路径的缓存，没有访问文件系统
+    static_spa_fallbacks, // 找不到文件时返回了SPA入口文档
+    upstream_retries,
+    upstream_errors, // 最终返回了502、503或504
+    upstream_rejected, // 熔断时直接拒绝
+    upstream_queued, // 超出并发限制需要排队
+    upstream_shed, // 排队已满或排队超时
+    rate_limited,
+    auth_rejected, // 过滤器检查Authorization头失败
+    blocking_tasks, // 交给阻塞工作线程池的任务
+    blocking_overflows, // 线程池队列满了，在IO线程上直接运行
+    count_
+};
+
+enum class upstream_phase : size_t
+{
+    connect,
+    first_byte,
+    total,
+    count_
+};
+
+/**
+ * \brief 简单的HDR风格直方图：每个2的幂区间再分成4个子区间，单位为微秒。
+ */
+struct latency_buckets
+{
+    static constexpr size_t sub_bits = 2;
+    static constexpr size_t sub_count = 1 << sub_bits;
+    static constexpr size_t count = 27 * sub_count; // 覆盖到2^27微秒（约134秒）
+
+    static size_t index(uint64_t us);
+    static uint64_t upper_bound(size_t index); // 不含
+};
+
+/**
+ * \brief 指标注册表。
+ *
+ * 每个线程写自己的一块计数器（按缓存行对齐，只有本线程写），不需要原子加；
+ * 输出时把所有线程的数据加起来。路由和上游必须在IO线程启动前通过configure登记。
+ */
+class metrics_registry
+{
+    struct alignas(64) line
+    {
+        std::atomic<uint64_t> v[8];
+    };
+
+    using slab = std::vector<line>;
+
+    std::vector<std::string> routes_;
+    std::vector<std::string> upstreams_;
+
+    size_t requests_offset_{0};
+    size_t request_hist_offset_{0};
+    size_t upstream_hist_offset_{0};
+    size_t size_{0};
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<slab>> slabs_;
+    size_t generation_{0}; // configure之后各线程重新分配自己的计数器
+
+public:
+    metrics_registry();
+
+    void configure(std::vector<std::string> routes, std::vector<std::string> upstreams);
+
+    void add(gate_counter counter, uint64_t n = 1);
+
+    void record_request(size_t route, unsigned status, std::chrono::steady_clock::duration latency);
+
+    void record_upstream(size_t upstream, upstream_phase phase, std::chrono::steady_clock::duration latency);
+
+    /**
+     * \brief 以Prometheus文本格式输出。
+     */
+    [[nodiscard]] std::string render() const;
+
+    /**
+     * \brief 所有线程加起来的计数。
+     */
+    [[nodiscard]] uint64_t total(gate_counter counter) const;
+
+private:
+    slab& local();
+
+    static void bump(slab& s, size_t index, uint64_t n)
+    {
+        // 只有本线程写，读-改-写不需要原子指令
+        auto& cell = s[index / 8].v[index % 8];
+        cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void record_latency(slab& s, size_t offset, std::chrono::steady_clock::duration latency);
+
+    [[nodiscard]] uint64_t sum(size_t index) const;
+
+    void render_histogram(std::string& out, const char* name, const std::string& labels, size_t offset) const;
+};
+
+extern metrics_registry gate_metrics;
+
+#endif //METRICS_H
@@ -0,0 +1,532 @@
+//
+// Created by cinea on 24-3-5.
+//
+
+#include "MimeTable.h"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    struct mime_entry
+    {
+        std::string_view extension;
+        std::string_view type;
+    };
+
+    // 和libs/MimeTypes相同的数据，来源：https://raw.githubusercontent.com/broofa/node-mime/master/types/standard.json
+    constexpr mime_entry mime_entries[] = {
+        {"*3gpp", "audio/3gpp"},
+        {"*jpm", "video/jpm"},
+        {"*mp3", "audio/mp3"},
+        {"*rtf", "text/rtf"},
+        {"*wav", "audio/wave"},
+        {"*xml", "text/xml"},
+        {"3g2", "video/3gpp2"},
+        {"3gp", "video/3gpp"},
+        {"3gpp", "video/3gpp"},
+        {"ac", "application/pkix-attr-cert"},
+        {"adp", "audio/adpcm"},
+        {"ai", "application/postscript"},
+        {"apng", "image/apng"},
+        {"appcache", "text/cache-manifest"},
+        {"asc", "application/pgp-signature"},
+        {"atom", "application/atom+xml"},
+        {"atomcat", "application/atomcat+xml"},
+        {"atomsvc", "application/atomsvc+xml"},
+        {"au", "audio/basic"},
+        {"aw", "application/applixware"},
+        {"bdoc", "application/bdoc"},
+        {"bin", "application/octet-stream"},
+        {"bmp", "image/bmp"},
+        {"bpk", "application/octet-stream"},
+        {"buffer", "application/octet-stream"},
+        {"ccxml", "application/ccxml+xml"},
+        {"cdmia", "application/cdmi-capability"},
+        {"cdmic", "application/cdmi-container"},
+        {"cdmid", "application/cdmi-domain"},
+        {"cdmio", "application/cdmi-object"},
+        {"cdmiq", "application/cdmi-queue"},
+        {"cer", "application/pkix-cert"},
+        {"cgm", "image/cgm"},
+        {"class", "application/java-vm"},
+        {"coffee", "text/coffeescript"},
+        {"conf", "text/plain"},
+        {"cpt", "application/mac-compactpro"},
+        {"crl", "application/pkix-crl"},
+        {"css", "text/css"},
+        {"csv", "text/csv"},
+        {"cu", "application/cu-seeme"},
+        {"davmount", "application/davmount+xml"},
+        {"dbk", "application/docbook+xml"},
+        {"deb", "application/octet-stream"},
+        {"def", "text/plain"},
+        {"deploy", "application/octet-stream"},
+        {"disposition-notification", "message/disposition-notification"},
+        {"dist", "application/octet-stream"},
+        {"distz", "application/octet-stream"},
+        {"dll", "application/octet-stream"},
+        {"dmg", "application/octet-stream"},
+        {"dms", "application/octet-stream"},
+        {"doc", "application/msword"},
+        {"dot", "application/msword"},
+        {"drle", "image/dicom-rle"},
+        {"dssc", "application/dssc+der"},
+        {"dtd", "application/xml-dtd"},
+        {"dump", "application/octet-stream"},
+        {"ear", "application/java-archive"},
+        {"ecma", "application/ecmascript"},
+        {"elc", "application/octet-stream"},
+        {"emf", "image/emf"},
+        {"eml", "message/rfc822"},
+        {"emma", "application/emma+xml"},
+        {"eps", "application/postscript"},
+        {"epub", "application/epub+zip"},
+        {"es", "application/ecmascript"},
+        {"exe", "application/octet-stream"},
+        {"exi", "application/exi"},
+        {"exr", "image/aces"},
+        {"ez", "application/andrew-inset"},
+        {"fits", "image/fits"},
+        {"g3", "image/g3fax"},
+        {"gbr", "application/rpki-ghostbusters"},
+        {"geojson", "application/geo+json"},
+        {"gif", "image/gif"},
+        {"glb", "model/gltf-binary"},
+        {"gltf", "model/gltf+json"},
+        {"gml", "application/gml+xml"},
+        {"gpx", "application/gpx+xml"},
+        {"gram", "application/srgs"},
+        {"grxml", "application/srgs+xml"},
+        {"gxf", "application/gxf"},
+        {"gz", "application/gzip"},
+        {"h261", "video/h261"},
+        {"h263", "video/h263"},
+        {"h264", "video/h264"},
+        {"heic", "image/heic"},
+        {"heics", "image/heic-sequence"},
+        {"heif", "image/heif"},
+        {"heifs", "image/heif-sequence"},
+        {"hjson", "application/hjson"},
+        {"hlp", "application/winhlp"},
+        {"hqx", "application/mac-binhex40"},
+        {"htm", "text/html"},
+        {"html", "text/html"},
+        {"ics", "text/calendar"},
+        {"ief", "image/ief"},
+        {"ifb", "text/calendar"},
+        {"iges", "model/iges"},
+        {"igs", "model/iges"},
+        {"img", "application/octet-stream"},
+        {"in", "text/plain"},
+        {"ini", "text/plain"},
+        {"ink", "application/inkml+xml"},
+        {"inkml", "application/inkml+xml"},
+        {"ipfix", "application/ipfix"},
+        {"iso", "application/octet-stream"},
+        {"jade", "text/jade"},
+        {"jar", "application/java-archive"},
+        {"jls", "image/jls"},
+        {"jp2", "image/jp2"},
+        {"jpe", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"jpf", "image/jpx"},
+        {"jpg", "image/jpeg"},
+        {"jpg2", "image/jp2"},
+        {"jpgm", "video/jpm"},
+        {"jpgv", "video/jpeg"},
+        {"jpm", "image/jpm"},
+        {"jpx", "image/jpx"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"json5", "application/json5"},
+        {"jsonld", "application/ld+json"},
+        {"jsonml", "application/jsonml+json"},
+        {"jsx", "text/jsx"},
+        {"kar", "audio/midi"},
+        {"ktx", "image/ktx"},
+        {"less", "text/less"},
+        {"list", "text/plain"},
+        {"litcoffee", "text/coffeescript"},
+        {"log", "text/plain"},
+        {"lostxml", "application/lost+xml"},
+        {"lrf", "application/octet-stream"},
+        {"m1v", "video/mpeg"},
+        {"m21", "application/mp21"},
+        {"m2a", "audio/mpeg"},
+        {"m2v", "video/mpeg"},
+        {"m3a", "audio/mpeg"},
+        {"m4a", "audio/mp4"},
+        {"m4p", "application/mp4"},
+        {"ma", "application/mathematica"},
+        {"mads", "application/mads+xml"},
+        {"man", "text/troff"},
+        {"manifest", "text/cache-manifest"},
+        {"map", "application/json"},
+        {"mar", "application/octet-stream"},
+        {"markdown", "text/markdown"},
+        {"mathml", "application/mathml+xml"},
+        {"mb", "application/mathematica"},
+        {"mbox", "application/mbox"},
+        {"md", "text/markdown"},
+        {"me", "text/troff"},
+        {"mesh", "model/mesh"},
+        {"meta4", "application/metalink4+xml"},
+        {"metalink", "application/metalink+xml"},
+        {"mets", "application/mets+xml"},
+        {"mft", "application/rpki-manifest"},
+        {"mid", "audio/midi"},
+        {"midi", "audio/midi"},
+        {"mime", "message/rfc822"},
+        {"mj2", "video/mj2"},
+        {"mjp2", "video/mj2"},
+        {"mjs", "application/javascript"},
+        {"mml", "text/mathml"},
+        {"mods", "application/mods+xml"},
+        {"mov", "video/quicktime"},
+        {"mp2", "audio/mpeg"},
+        {"mp21", "application/mp21"},
+        {"mp2a", "audio/mpeg"},
+        {"mp3", "audio/mpeg"},
+        {"mp4", "video/mp4"},
+        {"mp4a", "audio/mp4"},
+        {"mp4s", "application/mp4"},
+        {"mp4v", "video/mp4"},
+        {"mpd", "application/dash+xml"},
+        {"mpe", "video/mpeg"},
+        {"mpeg", "video/mpeg"},
+        {"mpg", "video/mpeg"},
+        {"mpg4", "video/mp4"},
+        {"mpga", "audio/mpeg"},
+        {"mrc", "application/marc"},
+        {"mrcx", "application/marcxml+xml"},
+        {"ms", "text/troff"},
+        {"mscml", "application/mediaservercontrol+xml"},
+        {"msh", "model/mesh"},
+        {"msi", "application/octet-stream"},
+        {"msm", "application/octet-stream"},
+        {"msp", "application/octet-stream"},
+        {"mxf", "application/mxf"},
+        {"mxml", "application/xv+xml"},
+        {"n3", "text/n3"},
+        {"nb", "application/mathematica"},
+        {"oda", "application/oda"},
+        {"oga", "audio/ogg"},
+        {"ogg", "audio/ogg"},
+        {"ogv", "video/ogg"},
+        {"ogx", "application/ogg"},
+        {"omdoc", "application/omdoc+xml"},
+        {"onepkg", "application/onenote"},
+        {"onetmp", "application/onenote"},
+        {"onetoc", "application/onenote"},
+        {"onetoc2", "application/onenote"},
+        {"opf", "application/oebps-package+xml"},
+        {"otf", "font/otf"},
+        {"owl", "application/rdf+xml"},
+        {"oxps", "application/oxps"},
+        {"p10", "application/pkcs10"},
+        {"p7c", "application/pkcs7-mime"},
+        {"p7m", "application/pkcs7-mime"},
+        {"p7s", "application/pkcs7-signature"},
+        {"p8", "application/pkcs8"},
+        {"pdf", "application/pdf"},
+        {"pfr", "application/font-tdpfr"},
+        {"pgp", "application/pgp-encrypted"},
+        {"pkg", "application/octet-stream"},
+        {"pki", "application/pkixcmp"},
+        {"pkipath", "application/pkix-pkipath"},
+        {"pls", "application/pls+xml"},
+        {"png", "image/png"},
+        {"prf", "application/pics-rules"},
+        {"ps", "application/postscript"},
+        {"pskcxml", "application/pskc+xml"},
+        {"qt", "video/quicktime"},
+        {"raml", "application/raml+yaml"},
+        {"rdf", "application/rdf+xml"},
+        {"rif", "application/reginfo+xml"},
+        {"rl", "application/resource-lists+xml"},
+        {"rld", "application/resource-lists-diff+xml"},
+        {"rmi", "audio/midi"},
+        {"rnc", "application/relax-ng-compact-syntax"},
+        {"rng", "application/xml"},
+        {"roa", "application/rpki-roa"},
+        {"roff", "text/troff"},
+        {"rq", "application/sparql-query"},
+        {"rs", "application/rls-services+xml"},
+        {"rsd", "application/rsd+xml"},
+        {"rss", "application/rss+xml"},
+        {"rtf", "application/rtf"},
+        {"rtx", "text/richtext"},
+        {"s3m", "audio/s3m"},
+        {"sbml", "application/sbml+xml"},
+        {"scq", "application/scvp-cv-request"},
+        {"scs", "application/scvp-cv-response"},
+        {"sdp", "application/sdp"},
+        {"ser", "application/java-serialized-object"},
+        {"setpay", "application/set-payment-initiation"},
+        {"setreg", "application/set-registration-initiation"},
+        {"sgi", "image/sgi"},
+        {"sgm", "text/sgml"},
+        {"sgml", "text/sgml"},
+        {"shex", "text/shex"},
+        {"shf", "application/shf+xml"},
+        {"shtml", "text/html"},
+        {"sig", "application/pgp-signature"},
+        {"sil", "audio/silk"},
+        {"silo", "model/mesh"},
+        {"slim", "text/slim"},
+        {"slm", "text/slim"},
+        {"smi", "application/smil+xml"},
+        {"smil", "application/smil+xml"},
+        {"snd", "audio/basic"},
+        {"so", "application/octet-stream"},
+        {"spp", "application/scvp-vp-response"},
+        {"spq", "application/scvp-vp-request"},
+        {"spx", "audio/ogg"},
+        {"sru", "application/sru+xml"},
+        {"srx", "application/sparql-results+xml"},
+        {"ssdl", "application/ssdl+xml"},
+        {"ssml", "application/ssml+xml"},
+        {"stk", "application/hyperstudio"},
+        {"styl", "text/stylus"},
+        {"stylus", "text/stylus"},
+        {"svg", "image/svg+xml"},
+        {"svgz", "image/svg+xml"},
+        {"t", "text/troff"},
+        {"t38", "image/t38"},
+        {"tei", "application/tei+xml"},
+        {"teicorpus", "application/tei+xml"},
+        {"text", "text/plain"},
+        {"tfi", "application/thraud+xml"},
+        {"tfx", "image/tiff-fx"},
+        {"tif", "image/tiff"},
+        {"tiff", "image/tiff"},
+        {"tr", "text/troff"},
+        {"ts", "video/mp2t"},
+        {"tsd", "application/timestamped-data"},
+        {"tsv", "text/tab-separated-values"},
+        {"ttc", "font/collection"},
+        {"ttf", "font/ttf"},
+        {"ttl", "text/turtle"},
+        {"txt", "text/plain"},
+        {"u8dsn", "message/global-delivery-status"},
+        {"u8hdr", "message/global-headers"},
+        {"u8mdn", "message/global-disposition-notification"},
+        {"u8msg", "message/global"},
+        {"uri", "text/uri-list"},
+        {"uris", "text/uri-list"},
+        {"urls", "text/uri-list"},
+        {"vcard", "text/vcard"},
+        {"vrml", "model/vrml"},
+        {"vtt", "text/vtt"},
+        {"vxml", "application/voicexml+xml"},
+        {"war", "application/java-archive"},
+        {"wasm", "application/wasm"},
+        {"wav", "audio/wav"},
+        {"weba", "audio/webm"},
+        {"webm", "video/webm"},
+        {"webmanifest", "application/manifest+json"},
+        {"webp", "image/webp"},
+        {"wgt", "application/widget"},
+        {"wmf", "image/wmf"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"wrl", "model/vrml"},
+        {"wsdl", "application/wsdl+xml"},
+        {"wspolicy", "application/wspolicy+xml"},
+        {"x3d", "model/x3d+xml"},
+        {"x3db", "model/x3d+binary"},
+        {"x3dbz", "model/x3d+binary"},
+        {"x3dv", "model/x3d+vrml"},
+        {"x3dvz", "model/x3d+vrml"},
+        {"x3dz", "model/x3d+xml"},
+        {"xaml", "application/xaml+xml"},
+        {"xdf", "application/xcap-diff+xml"},
+        {"xdssc", "application/dssc+xml"},
+        {"xenc", "application/xenc+xml"},
+        {"xer", "application/patch-ops-error+xml"},
+        {"xht", "application/xhtml+xml"},
+        {"xhtml", "application/xhtml+xml"},
+        {"xhvml", "application/xv+xml"},
+        {"xm", "audio/xm"},
+        {"xml", "application/xml"},
+        {"xop", "application/xop+xml"},
+        {"xpl", "application/xproc+xml"},
+        {"xsd", "application/xml"},
+        {"xsl", "application/xml"},
+        {"xslt", "application/xslt+xml"},
+        {"xspf", "application/xspf+xml"},
+        {"xvm", "application/xv+xml"},
+        {"xvml", "application/xv+xml"},
+        {"yaml", "text/yaml"},
+        {"yang", "application/yang"},
+        {"yin", "application/yin+xml"},
+        {"yml", "text/yaml"},
+        {"zip", "application/zip"},
+    };
+
+    constexpr size_t entry_count = std::size(mime_entries);
+    constexpr size_t bucket_count = 128;
+    constexpr size_t slot_count = 512; // 2的幂，大于条目数
+    constexpr size_t max_extension = 24; // 表里最长的扩展名
+
+    static_assert(entry_count < slot_count);
+
+    // FNV-1a加上murmur3的收尾，换一个seed就是一个独立的哈希函数
+    constexpr uint32_t extension_hash(const std::string_view extension, const uint32_t seed)
+    {
+        uint32_t h = 2166136261u ^ seed;
+        for (const char c : extension)
+        {
+            h ^= static_cast<unsigned char>(c);
+            h *= 16777619u;
+        }
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    struct perfect_table
+    {
+        std::array<uint16_t, bucket_count> seeds{}; // 每个桶找到的seed
+        std::array<int16_t, slot_count> slots{}; // 条目的下标，-1表示空
+    };
+
+    /**
+     * \brief 编译期构造完美哈希（hash and displace）：先按seed 0把扩展名分到桶里，
+     * 从大桶开始，为每个桶找一个seed，使桶里的扩展名都落到空着的槽位上。
+     */
+    constexpr perfect_table build_table()
+    {
+        perfect_table table;
+        for (auto& slot : table.slots)
+            slot = -1;
+
+        // 按桶排好条目
+        std::array<size_t, bucket_count + 1> start{};
+        for (const auto& entry : mime_entries)
+            start[extension_hash(entry.extension, 0) % bucket_count + 1]++;
+        for (size_t b = 0; b < bucket_count; b++)
+            start[b + 1] += start[b];
+
+        std::array<size_t, entry_count> members{};
+        std::array<size_t, bucket_count> filled{};
+        for (size_t i = 0; i < entry_count; i++)
+        {
+            const auto b = extension_hash(mime_entries[i].extension, 0) % bucket_count;
+            members[start[b] + filled[b]++] = i;
+        }
+
+        size_t largest = 0;
+        for (size_t b = 0; b < bucket_count; b++)
+            largest = filled[b] > largest ? filled[b] : largest;
+
+        for (size_t size = largest; size > 0; size--)
+        {
+            for (size_t b = 0; b < bucket_count; b++)
+            {
+                if (filled[b] != size)
+                    continue;
+
+                for (uint32_t seed = 1;; seed++)
+                {
+                    if (seed > UINT16_MAX)
+                        throw std::logic_error("no perfect hash seed found");
+
+                    std::array<size_t, 16> chosen{};
+                    bool ok = size <= chosen.size();
+                    for (size_t k = 0; ok && k < size; k++)
+                    {
+                        chosen[k] = extension_hash(mime_entries[members[start[b] + k]].extension, seed) % slot_count;
+                        ok = table.slots[chosen[k]] < 0;
+                        for (size_t j = 0; ok && j < k; j++)
+                            ok = chosen[j] != chosen[k];
+                    }
+                    if (!ok)
+                        continue;
+
+                    table.seeds[b] = static_cast<uint16_t>(seed);
+                    for (size_t k = 0; k < size; k++)
+                        table.slots[chosen[k]] = static_cast<int16_t>(members[start[b] + k]);
+                    break;
+                }
+            }
+        }
+
+        return table;
+    }
+
+    constexpr perfect_table mime_table = build_table();
+
+    constexpr const mime_entry* find_entry(const std::string_view extension)
+    {
+        const auto b = extension_hash(extension, 0) % bucket_count;
+        const auto index = mime_table.slots[extension_hash(extension, mime_table.seeds[b]) % slot_count];
+        if (index < 0 || mime_entries[index].extension != extension)
+            return nullptr;
+        return &mime_entries[index];
+    }
+
+    static_assert(find_entry("html") && find_entry("html")->type == "text/html");
+    static_assert(find_entry("woff2") && find_entry("woff2")->type == "font/woff2");
+    static_assert(!find_entry("htmlx"));
+
+    // 配置文件里的覆盖，按扩展名排好序，启动时设置，之后只读
+    std::vector<std::pair<std::string, std::string>> mime_overrides;
+}
+
+void set_mime_type(std::string extension, std::string type)
+{
+    if (!extension.empty() && extension.front() == '.')
+        extension.erase(0, 1);
+    if (extension.empty() || extension.size() > max_extension)
+        throw std::invalid_argument("mime_types: invalid extension '" + extension + "'");
+
+    for (auto& c : extension)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+    const auto it = std::lower_bound(mime_overrides.begin(), mime_overrides.end(), extension,
+                                     [](const auto& entry, const std::string& key) { return entry.first < key; });
+    if (it != mime_overrides.end() && it->first == extension)
+        it->second = std::move(type);
+    else
+        mime_overrides.emplace(it, std::move(extension), std::move(type));
+}
+
+std::string_view mime_type(const std::string_view path)
+{
+    constexpr std::string_view fallback = "application/text";
+
+    // 最后一个点在目录名里时文件没有扩展名
+    const auto dot = path.rfind('.');
+    if (dot == std::string_view::npos || path.size() - dot - 1 > max_extension ||
+        path.find('/', dot) != std::string_view::npos)
+        return fallback;
+
+    // 在栈上转成小写
+    const auto extension = path.substr(dot + 1);
+    char lower[max_extension];
+    for (size_t i = 0; i < extension.size(); i++)
+        lower[i] = extension[i] >= 'A' && extension[i] <= 'Z' ? static_cast<char>(extension[i] | 0x20) : extension[i];
+    const std::string_view key(lower, extension.size());
+
+    if (!mime_overrides.empty())
+    {
+        const auto it = std::lower_bound(mime_overrides.begin(), mime_overrides.end(), key,
+                                         [](const auto& entry, const std::string_view k) { return entry.first < k; });
+        if (it != mime_overrides.end() && it->first == key)
+            return it->second;
+    }
+
+    if (const auto entry = find_entry(key))
+        return entry->type;
+    return fallback;
+}
@@ -0,0 +1,24 @@
+//
+// Created by cinea on 24-3-5.
+//
+
+#ifndef MIMETABLE_H
+#define MIMETABLE_H
+
+#include <string>
+#include <string_view>
+
+/**
+ * \brief 按扩展名（不区分大小写）查文件的MIME类型，找不到时返回"application/text"。
+ *
+ * 内置的表在编译期生成完美哈希，查一次只要两次哈希和一次比较；配置文件里的覆盖优先。
+ * 返回的字符串一直有效。
+ */
+std::string_view mime_type(std::string_view path);
+
+/**
+ * \brief 覆盖或者添加一个扩展名的类型，扩展名可以带点。必须在IO线程启动前调用。
+ */
+void set_mime_type(std::string extension, std::string type);
+
+#endif //MIMETABLE_H
@@ -4,84 +4,488 @@
 
 #include "ProxyPass.h"
 
+#include <arpa/inet.h>
 #include <boost/asio/strand.hpp>
 #include <utility>
 
 #include "Common.h"
+#include "Errors.h"
+#include "Metrics.h"
+
+namespace
+{
+    // 可以安全地重复发送的请求
+    bool is_idempotent(const http::verb method)
+    {
+        switch (method)
+        {
+        case http::verb::get:
+        case http::verb::head:
+        case http::verb::options:
+        case http::verb::trace:
+        case http::verb::put:
+        case http::verb::delete_:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /**
+     * \brief 加上X-Real-IP和X-Forwarded-*头。地址直接格式化到栈上，
+     * 拼接X-Forwarded-For时先算好长度，只分配一次。
+     */
+    void add_forwarded_headers(http::request<http::dynamic_body>& req, const client_info& client)
+    {
+        char ip[INET6_ADDRSTRLEN] = {};
+        const auto address = client.remote.address();
+        if (address.is_v4())
+        {
+            const auto bytes = address.to_v4().to_bytes();
+            inet_ntop(AF_INET, bytes.data(), ip, sizeof(ip));
+        }
+        else
+        {
+            const auto bytes = address.to_v6().to_bytes();
+            inet_ntop(AF_INET6, bytes.data(), ip, sizeof(ip));
+        }
+        const std::string_view ip_view(ip);
+
+        const auto existing = req["X-Forwarded-For"];
+        std::string forwarded_for;
+        forwarded_for.reserve(existing.size() + 2 + ip_view.size());
+        if (!existing.empty())
+        {
+            forwarded_for.append(existing.data(), existing.size());
+            forwarded_for.append(", ");
+        }
+        forwarded_for.append(ip_view);
+
+        req.set("X-Forwarded-For", forwarded_for);
+        req.set("X-Real-IP", ip_view);
+        req.set("X-Forwarded-Proto", client.secure ? "https" : "http");
+        if (const auto host = req[http::field::host]; !host.empty())
+            req.set("X-Forwarded-Host", host);
+    }
+}
 
 class proxy_session : public std::enable_shared_from_this<proxy_session>
 {
+    const proxy_pass& pass_;
     tcp::resolver resolver_;
     beast::tcp_stream stream_;
+    net::steady_timer queue_timer_;
     beast::flat_buffer buffer_;
     http::request<http::dynamic_body> req_;
-    http::response<http::dynamic_body> res_;
+    std::optional<http::response_parser<http::dynamic_body>> parser_;
     ProxyCallbackFunc callback_func_;
+    client_info client_;
+    std::string proxy_header_; // PROXY协议头
+
+    // 流式上传
+    std::shared_ptr<request_body_source> body_;
+    std::optional<http::request<http::buffer_body>> upload_req_;
+    std::optional<http::request_serializer<http::buffer_body>> upload_sr_;
+    bool body_started_{false}; // 已经从客户端读过请求体，不能再重试
+
+    size_t upstream_;
+    std::chrono::steady_clock::time_point start_;
+    request_trace* trace_;
+
+    std::vector<tcp::endpoint> endpoints_;
+    size_t endpoint_{0};
+    unsigned attempt_{0};
+
+    // 并发限制
+    std::string host_;
+    std::string port_;
+    std::shared_ptr<limiter_waiter> waiter_;
+    bool granted_{false}; // 排队时由grant在本连接的strand上设置
+    bool acquired_{false};
+    bool ok_{false};
+    std::chrono::steady_clock::time_point acquired_at_;
+    bool probe_{false}; // 这是熔断器半开时放过去的试探请求
+
+    // 一次连接上游的尝试失败在哪里
+    struct attempt_error
+    {
+        beast::error_code ec;
+        const char* what{""};
+        bool sent{false}; // 请求可能已经到达上游
+        bool client{false}; // 读客户端的请求体失败，不算上游的问题
+    };
 
 public:
-    proxy_session(net::io_context& ioc, http::request<http::dynamic_body>&& req, ProxyCallbackFunc&& callback_func):
+    proxy_session(net::io_context& ioc, const proxy_pass& pass, const size_t upstream,
+                  http::request<http::dynamic_body>&& req, ProxyCallbackFunc&& callback_func,
+                  const client_info& client, request_trace* trace, std::shared_ptr<request_body_source> body):
+        pass_(pass),
         resolver_(make_strand(ioc)),
         stream_(make_strand(ioc)),
+        queue_timer_(stream_.get_executor()),
         req_(std::move(req)),
-        callback_func_(std::move(callback_func))
+        callback_func_(std::move(callback_func)),
+        client_(client),
+        body_(std::move(body)),
+        upstream_(upstream),
+        start_(std::chrono::steady_clock::now()),
+        trace_(trace)
     {
     }
 
+    ~proxy_session()
+    {
+        if (acquired_)
+            pass_.limiter().release(std::chrono::steady_clock::now() - acquired_at_, ok_);
+    }
+
     void run(const std::string_view& host, const std::string_view& port, const std::string_view& target,
              const int version)
     {
         req_.version(version);
         req_.target(target);
+        if (pass_.need_real_ip())
+            add_forwarded_headers(req_, client_);
         req_.set(http::field::host, host);
         req_.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+        if (body_)
+            // 100 Continue由网关在开始读请求体时回复
+            req_.erase(http::field::expect);
 
-        resolver_.async_resolve(
-            host,
-            port,
-            beast::bind_front_handler(
-                &proxy_session::on_resolve, shared_from_this()));
+        host_ = host;
+        port_ = port;
+
+        net::co_spawn(stream_.get_executor(), exchange(shared_from_this()), net::detached);
     }
 
-    void on_resolve(const beast::error_code& ec, const tcp::resolver::results_type& results)
+private:
+    // 一次完整的转发，协程在本连接的strand上运行
+    net::awaitable<void> exchange(std::shared_ptr<proxy_session> self)
     {
-        if (ec)
-            return fail(ec, "resolve");
+        // 上游熔断中，直接拒绝
+        if (!pass_.breaker().allow(&probe_))
+        {
+            gate_metrics.add(gate_counter::upstream_rejected);
+            finish_error(http::status::service_unavailable, "upstream is unavailable");
+            co_return;
+        }
 
-        stream_.expires_after(std::chrono::seconds(30));
+        if (!co_await acquire())
+            co_return;
 
-        stream_.async_connect(results, beast::bind_front_handler(&proxy_session::on_connect, shared_from_this()));
+        beast::error_code ec;
+        const auto results = co_await resolver_.async_resolve(host_, port_, with_error(ec));
+        if (ec || results.empty())
+        {
+            fail(ec, "resolve");
+            pass_.breaker().failure();
+            finish_error(http::status::bad_gateway, ec ? ec.message() : "no address for upstream");
+            co_return;
+        }
+
+        trace_mark(trace_, trace_phase::upstream_resolved);
+
+        for (const auto& entry : results)
+            endpoints_.push_back(entry.endpoint());
+        endpoint_ = pass_.next_endpoint() % endpoints_.size();
+
+        while (true)
+        {
+            const auto error = co_await attempt();
+            if (!error.ec)
+                break;
+
+            if (error.client)
+            {
+                // 客户端的问题，不算上游失败；试探请求没有结论，也要让出试探名额
+                fail(error.ec, error.what);
+                release_probe();
+                finish_error(error.ec == http::error::body_limit
+                                 ? http::status::payload_too_large
+                                 : http::status::bad_request,
+                             error.ec.message());
+                co_return;
+            }
+
+            fail(error.ec, error.what);
+            pass_.breaker().failure();
+            probe_ = false; // 试探失败已经重新打开熔断器，名额不再属于这个请求
+
+            stream_.close();
+
+            // 重试时熔断器可能刚好进入半开，这次拿到的试探名额也要在提前结束时让出去
+            if (attempt_ < pass_.options().retries && (!error.sent || is_idempotent(req_.method())) &&
+                !body_started_ && pass_.breaker().allow(&probe_))
+            {
+                // 换下一个地址重试
+                attempt_++;
+                endpoint_ = (endpoint_ + 1) % endpoints_.size();
+                gate_metrics.add(gate_counter::upstream_retries);
+                continue;
+            }
+
+            finish_error(error.ec == beast::error::timeout
+                             ? http::status::gateway_timeout
+                             : http::status::bad_gateway,
+                         error.ec.message());
+            co_return;
+        }
+
+        trace_mark(trace_, trace_phase::upstream_first_byte);
+        gate_metrics.record_upstream(upstream_, upstream_phase::first_byte,
+                                     std::chrono::steady_clock::now() - start_);
+
+        // 一段一段地读响应体，每次都重新计算空闲超时
+        while (!parser_->is_done())
+        {
+            stream_.expires_after(pass_.options().idle_timeout);
+
+            co_await http::async_read_some(stream_, buffer_, *parser_, with_error(ec));
+            if (ec)
+            {
+                // 响应已经开始了，不再重试
+                fail(ec, "read");
+                pass_.breaker().failure();
+                finish_error(ec == beast::error::timeout
+                                 ? http::status::gateway_timeout
+                                 : http::status::bad_gateway,
+                             ec.message());
+                co_return;
+            }
+        }
+
+        finish();
     }
 
-    void on_connect(const beast::error_code& ec, tcp::resolver::results_type::endpoint_type)
+    /**
+     * \brief 申请并发名额，满了就排队等到有空位或者超时。
+     * \return false时已经回复了错误
+     */
+    net::awaitable<bool> acquire()
     {
-        if (ec)
-            return fail(ec, "connect");
+        waiter_ = std::make_shared<limiter_waiter>();
+        waiter_->grant = [self = shared_from_this()]
+        {
+            net::post(self->stream_.get_executor(), [self]
+            {
+                self->granted_ = true;
+                self->queue_timer_.cancel();
+            });
+        };
+
+        switch (pass_.limiter().acquire(waiter_))
+        {
+        case concurrency_limiter::result::acquired:
+            break;
+
+        case concurrency_limiter::result::queued:
+            gate_metrics.add(gate_counter::upstream_queued);
+            queue_timer_.expires_after(pass_.options().concurrency.queue_timeout);
+
+            while (!granted_)
+            {
+                beast::error_code ec;
+                co_await queue_timer_.async_wait(with_error(ec));
+                if (granted_ || ec == net::error::operation_aborted)
+                    continue;
+
+                if (pass_.limiter().cancel(waiter_))
+                {
+                    waiter_.reset();
+                    release_probe();
+                    gate_metrics.add(gate_counter::upstream_shed);
+                    finish_error(http::status::service_unavailable, "upstream queue timeout");
+                    co_return false;
+                }
+
+                // 超时的同时名额已经给了出来，等grant投递过来
+                queue_timer_.expires_at(net::steady_timer::time_point::max());
+            }
+            break;
+
+        case concurrency_limiter::result::rejected:
+            waiter_.reset();
+            release_probe();
+            gate_metrics.add(gate_counter::upstream_shed);
+            finish_error(http::status::service_unavailable, "upstream is overloaded");
+            co_return false;
+        }
+
+        waiter_.reset(); // grant里持有自己，要断开引用
 
-        stream_.expires_after(std::chrono::seconds(30));
+        acquired_ = true;
+        acquired_at_ = std::chrono::steady_clock::now();
+        co_return true;
+    }
 
-        http::async_write(stream_, req_, beast::bind_front_handler(&proxy_session::on_write, shared_from_this()));
+    // 没有向熔断器报告结果就结束时调用，否则熔断器会一直等这个试探请求
+    void release_probe()
+    {
+        if (std::exchange(probe_, false))
+            pass_.breaker().release_probe();
     }
 
-    void on_write(const beast::error_code& ec, std::size_t)
+    // 连接当前的地址，发出请求并读到响应头
+    net::awaitable<attempt_error> attempt()
     {
+        buffer_.clear();
+        parser_.emplace();
+
+        stream_.expires_after(pass_.options().connect_timeout);
+
+        // 缓冲区大小、TCP_NODELAY之类的在connect之前设置，见upstream_options::socket
+        beast::error_code ec;
+        open_upstream_socket(stream_.socket(), endpoints_[endpoint_].protocol(), pass_.options().socket, ec);
+        if (ec)
+            co_return attempt_error{ec, "connect"};
+
+        co_await stream_.async_connect(endpoints_[endpoint_], with_error(ec));
+        if (ec)
+            co_return attempt_error{ec, "connect"};
+
+        trace_mark(trace_, trace_phase::upstream_connected);
+        gate_metrics.record_upstream(upstream_, upstream_phase::connect, std::chrono::steady_clock::now() - start_);
+
+        stream_.expires_after(pass_.options().idle_timeout);
+
+        if (pass_.options().proxy_protocol != proxy_protocol_version::none)
+        {
+            proxy_header_ = make_proxy_protocol_header(pass_.options().proxy_protocol, client_.remote, client_.local);
+            co_await net::async_write(stream_, net::buffer(proxy_header_), with_error(ec));
+            if (ec)
+                co_return attempt_error{ec, "write"};
+        }
+
+        if (body_)
+        {
+            if (auto error = co_await write_upload(); error.ec)
+                co_return error;
+        }
+        else
+        {
+            co_await http::async_write(stream_, req_, with_error(ec));
+            if (ec)
+                co_return attempt_error{ec, "write", true};
+        }
+
+        trace_mark(trace_, trace_phase::upstream_written);
+
+        stream_.expires_after(pass_.options().header_timeout);
+
+        co_await http::async_read_header(stream_, buffer_, *parser_, with_error(ec));
         if (ec)
-            return fail(ec, "write");
+            co_return attempt_error{ec, "read", true};
 
-        http::async_read(stream_, buffer_, res_,
-                         beast::bind_front_handler(&proxy_session::on_read, shared_from_this()));
+        co_return attempt_error{};
     }
 
-    void on_read(const beast::error_code& ec, std::size_t)
+    // 从客户端读下一段请求体，完成时回到本连接的strand上
+    template <class CompletionToken>
+    auto async_read_body(CompletionToken&& token)
     {
-        if (ec)
-            return fail(ec, "read");
+        return net::async_initiate<CompletionToken, void(beast::error_code, net::const_buffer, bool)>(
+            [this](auto handler)
+            {
+                auto executor = net::get_associated_executor(handler, stream_.get_executor());
+
+                body_->read_body([executor, handler = std::move(handler)](const beast::error_code& ec,
+                                                                          net::const_buffer data,
+                                                                          const bool done) mutable
+                {
+                    net::post(executor, [handler = std::move(handler), ec, data, done]() mutable
+                    {
+                        handler(ec, data, done);
+                    });
+                });
+            },
+            token);
+    }
+
+    // 请求体读一段写一段，网关里最多只有一段
+    net::awaitable<attempt_error> write_upload()
+    {
+        upload_req_.emplace(req_.base());
+        upload_req_->body().data = nullptr;
+        upload_req_->body().more = true;
+        upload_sr_.emplace(*upload_req_);
+
+        beast::error_code ec;
+        co_await http::async_write_header(stream_, *upload_sr_, with_error(ec));
+
+        while (true)
+        {
+            // 这一段写完了，还要更多数据
+            if (ec == http::error::need_buffer)
+                ec = {};
+
+            if (ec)
+                co_return attempt_error{ec, "write", true};
+
+            if (upload_sr_->is_done())
+                co_return attempt_error{};
+
+            body_started_ = true;
+            const auto [data, done] = co_await async_read_body(with_error(ec));
+            if (ec)
+                co_return attempt_error{ec, "upload", true, true};
+
+            auto& body = upload_req_->body();
+            body.data = data.size() > 0 ? const_cast<void*>(data.data()) : nullptr;
+            body.size = data.size();
+            body.more = !done;
+
+            stream_.expires_after(pass_.options().idle_timeout);
+
+            co_await http::async_write(stream_, *upload_sr_, with_error(ec));
+        }
+    }
+
+    void finish()
+    {
+        trace_mark(trace_, trace_phase::upstream_last_byte);
+        gate_metrics.record_upstream(upstream_, upstream_phase::total, std::chrono::steady_clock::now() - start_);
+
+        // 上游自己报告不可用时也算一次失败
+        const auto status = parser_->get().result();
+        ok_ = status != http::status::bad_gateway && status != http::status::service_unavailable &&
+            status != http::status::gateway_timeout;
+        if (ok_)
+            pass_.breaker().success();
+        else
+            pass_.breaker().failure();
 
         // 调用回调函数
-        callback_func_(std::move(res_));
+        callback_func_(parser_->release());
 
         do_close();
     }
 
+    // 上游不可用时也要给客户端一个响应，否则客户端要等到自己超时
+    void finish_error(const http::status status, const std::string& what)
+    {
+        if (http::to_status_class(status) == http::status_class::server_error)
+            gate_metrics.add(gate_counter::upstream_errors);
+
+        auto msg = [&]() -> http::message_generator
+        {
+            switch (status)
+            {
+            case http::status::service_unavailable:
+                return service_unavailable(std::move(req_), what);
+            case http::status::gateway_timeout:
+                return gateway_timeout(std::move(req_), what);
+            case http::status::payload_too_large:
+                return payload_too_large(std::move(req_));
+            case http::status::bad_request:
+                return bad_request(std::move(req_), what);
+            default:
+                return bad_gateway(std::move(req_), what);
+            }
+        }();
+
+        callback_func_(pass_.error_response(std::move(msg)));
+    }
+
     void do_close()
     {
         beast::error_code ec;
@@ -96,17 +500,21 @@ public:
 };
 
 void proxy_pass::handle(net::io_context& ioc,
+                        const size_t upstream,
                         http::request<http::dynamic_body>&& req,
-                        ProxyCallbackFunc&& handler
+                        ProxyCallbackFunc&& handler,
+                        const client_info& client,
+                        request_trace* trace,
+                        std::shared_ptr<request_body_source> body
 ) const
 {
     const auto old_target = req.target().substr(prefix_.length());
     const auto new_target = std::string(url_.encoded_path()) + std::string(old_target);
 
-    std::make_shared<proxy_session>(ioc, std::move(req), std::move(handler))->run(
-        url_.host(), url_.port(), new_target, 11);
-}
-
-
-
+    // 地址里没写端口时按协议的默认端口
+    const auto port = url_.port().empty() ? url_.scheme() : url_.port();
 
+    std::make_shared<proxy_session>(ioc, *this, upstream, std::move(req), std::move(handler), client,
+                                    trace, std::move(body))->run(
+        url_.host(), port, new_target, 11);
+}
@@ -5,7 +5,10 @@
 #ifndef PROXYPASS_H
 #define PROXYPASS_H
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <string>
 #include <boost/beast/http/message_generator.hpp>
@@ -14,6 +17,12 @@
 #include <boost/url.hpp>
 #include <utility>
 
+#include "ConcurrencyLimiter.h"
+#include "ProxyProtocol.h"
+#include "SocketOptions.h"
+#include "Trace.h"
+#include "utils/UniqueHandler.hpp"
+
 namespace beast = boost::beast; // from <boost/beast.hpp>
 namespace http = beast::http; // from <boost/beast/http.hpp>
 namespace net = boost::asio; // from <boost/asio.hpp>
@@ -21,23 +30,170 @@ using tcp = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 
 
 typedef std::function<http::message_generator(http::message_generator&&)> ErrorHandlerFunc;
-typedef std::function<void(http::message_generator&&)> ProxyCallbackFunc;
+// 每个请求都要创建，用只能移动的unique_handler，小的回调不分配内存
+typedef unique_handler<void(http::message_generator&&)> ProxyCallbackFunc;
+
+/**
+ * \brief 客户端连接的信息，转发时用来生成X-Forwarded-*头和PROXY协议头。
+ */
+struct client_info
+{
+    tcp::endpoint remote;
+    tcp::endpoint local;
+    bool secure{false};
+    net::any_io_executor executor; // 连接所在的strand，后台工作完成后回到这里
+};
+
+struct upstream_options
+{
+    std::chrono::seconds connect_timeout{5};
+    std::chrono::seconds header_timeout{30}; // 发完请求到收到响应头
+    std::chrono::seconds idle_timeout{30}; // 写请求、读响应体时两次读写之间的最长间隔
+    unsigned retries{1}; // 失败后换一个地址重试的次数，请求已经发出去时只重试幂等的请求
+    unsigned failure_threshold{5}; // 连续失败多少次后熔断，0表示不熔断
+    std::chrono::seconds open_timeout{10}; // 熔断多久之后放一个请求过去试探
+    concurrency_options concurrency;
+    proxy_protocol_version proxy_protocol{proxy_protocol_version::none}; // 连接上游后先发PROXY协议头
+    uint64_t max_body_size{1024 * 1024}; // 请求体的上限，超出返回413
+    uint64_t stream_threshold{64 * 1024}; // 请求体超过这个大小（或者分块传输）时边读边转发，不在网关里缓存
+    socket_options socket; // 默认打开TCP_NODELAY：请求头、PROXY协议头和请求体分开写，不能让Nagle算法拖住后面的
+};
+
+/**
+ * \brief 流式上传时请求体的来源，由客户端连接实现。
+ */
+class request_body_source
+{
+public:
+    // data在下一次调用read_body之前有效，done表示请求体已经读完
+    typedef unique_handler<void(const beast::error_code&, net::const_buffer data, bool done)> read_handler;
+
+    virtual ~request_body_source() = default;
+
+    /**
+     * \brief 读下一段请求体，handler在客户端连接的strand上被调用。
+     * 客户端发了Expect: 100-continue时，第一次调用才回复100 Continue。
+     */
+    virtual void read_body(read_handler&& handler) = 0;
+};
+
+/**
+ * \brief 熔断器：连续失败达到阈值后打开，直接拒绝请求；过了open_timeout只放一个请求试探，成功后关闭。
+ */
+class circuit_breaker
+{
+    const unsigned threshold_;
+    const std::chrono::steady_clock::duration open_timeout_;
+
+    std::atomic<unsigned> failures_{0};
+    std::atomic<int64_t> open_until_{0}; // steady_clock的计数，0表示没有熔断
+    std::atomic_bool probing_{false};
+
+public:
+    circuit_breaker(const unsigned threshold, const std::chrono::steady_clock::duration open_timeout):
+        threshold_(threshold), open_timeout_(open_timeout)
+    {
+    }
+
+    /**
+     * \param probe 不为空时，拿到了半开状态下唯一的试探名额就设为true
+     */
+    [[nodiscard]] bool allow(bool* probe = nullptr)
+    {
+        const auto until = open_until_.load(std::memory_order_relaxed);
+        if (until == 0)
+            return true;
+
+        if (std::chrono::steady_clock::now().time_since_epoch().count() < until)
+            return false;
+
+        // 半开状态，只让一个请求通过
+        bool expected = false;
+        if (!probing_.compare_exchange_strong(expected, true))
+            return false;
+        if (probe)
+            *probe = true;
+        return true;
+    }
+
+    // 试探请求在到达上游之前就结束了（排队超时、被拒绝），既不算成功也不算失败，让下一个请求去试探
+    void release_probe()
+    {
+        probing_.store(false);
+    }
+
+    void success()
+    {
+        failures_.store(0, std::memory_order_relaxed);
+        if (open_until_.load(std::memory_order_relaxed) != 0)
+        {
+            open_until_.store(0, std::memory_order_relaxed);
+            probing_.store(false);
+        }
+    }
+
+    void failure()
+    {
+        if (threshold_ == 0)
+            return;
+
+        if (probing_.load() || failures_.fetch_add(1, std::memory_order_relaxed) + 1 >= threshold_)
+        {
+            open_until_.store((std::chrono::steady_clock::now() + open_timeout_).time_since_epoch().count(),
+                              std::memory_order_relaxed);
+            probing_.store(false);
+        }
+    }
+
+    [[nodiscard]] unsigned failures() const { return failures_.load(std::memory_order_relaxed); }
+
+    // "closed"、"open"，或者过了open_timeout等待试探的"half_open"
+    [[nodiscard]] const char* state() const
+    {
+        const auto until = open_until_.load(std::memory_order_relaxed);
+        if (until == 0)
+            return "closed";
+        return std::chrono::steady_clock::now().time_since_epoch().count() < until ? "open" : "half_open";
+    }
+};
 
 class proxy_pass : public std::enable_shared_from_this<proxy_pass>
 {
     std::string prefix_;
-    boost::url_view url_;
+    boost::url url_; // 地址来自配置文件，需要自己持有
     std::optional<std::string> expires_;
     bool need_real_ip_{false};
     std::optional<
         ErrorHandlerFunc
     > error_handler_;
 
+    // 所有请求共享的上游状态，proxy_pass本身可以被复制
+    struct upstream_state
+    {
+        circuit_breaker breaker;
+        concurrency_limiter limiter;
+        std::atomic<size_t> next_endpoint{0}; // 解析出多个地址时轮流使用
+
+        explicit upstream_state(const upstream_options& options):
+            breaker(options.failure_threshold, options.open_timeout),
+            limiter(options.concurrency)
+        {
+        }
+    };
+
+    upstream_options options_;
+    std::shared_ptr<upstream_state> state_{std::make_shared<upstream_state>(options_)};
+
 public:
     proxy_pass(std::string prefix, const boost::url_view& url): prefix_(std::move(prefix)), url_(url)
     {
     }
 
+    proxy_pass(std::string prefix, const boost::url_view& url, const bool need_real_ip): prefix_(std::move(prefix)),
+        url_(url), need_real_ip_(need_real_ip)
+    {
+    }
+
     proxy_pass(std::string prefix, const boost::url_view& url, std::string expires): prefix_(std::move(prefix)),
         url_(url), expires_(std::optional(std::move(expires)))
     {
@@ -59,6 +215,40 @@ public:
     {
     }
 
+    [[nodiscard]] const std::string& prefix() const { return prefix_; }
+
+    [[nodiscard]] const boost::url& url() const { return url_; }
+
+    [[nodiscard]] const upstream_options& options() const { return options_; }
+
+    // 是否给上游加上X-Real-IP和X-Forwarded-*头
+    [[nodiscard]] bool need_real_ip() const { return need_real_ip_; }
+
+    void configure(const upstream_options& options)
+    {
+        options_ = options;
+        state_ = std::make_shared<upstream_state>(options_);
+    }
+
+    [[nodiscard]] circuit_breaker& breaker() const { return state_->breaker; }
+
+    [[nodiscard]] concurrency_limiter& limiter() const { return state_->limiter; }
+
+    [[nodiscard]] size_t next_endpoint() const
+    {
+        return state_->next_endpoint.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * \brief 网关自己生成的错误响应（502、503、504）先交给error_handler_处理。
+     */
+    [[nodiscard]] http::message_generator error_response(http::message_generator&& msg) const
+    {
+        if (error_handler_)
+            return (*error_handler_)(std::move(msg));
+        return std::move(msg);
+    }
+
     /**
      * \brief Match if the target matches this proxy.
      */
@@ -67,10 +257,20 @@ public:
         return target_str.substr(0, prefix_.length()) == prefix_;
     }
 
+    /**
+     * \param upstream 指标中这个上游的编号
+     * \param client 客户端连接的信息
+     * \param trace 不追踪时为空，否则必须在handler被调用前一直有效
+     * \param body 不为空时req只有请求头，请求体在连上上游之后从body读
+     */
     void handle(
         net::io_context& ioc,
+        size_t upstream,
         http::request<http::dynamic_body>&& req,
-        ProxyCallbackFunc&& handler) const;
+        ProxyCallbackFunc&& handler,
+        const client_info& client,
+        request_trace* trace = nullptr,
+        std::shared_ptr<request_body_source> body = nullptr) const;
 };
 
 #endif
@@ -0,0 +1,285 @@
+//
+// Created by cinea on 24-3-4.
+//
+
+#include "ProxyProtocol.h"
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+
+namespace
+{
+    constexpr char v2_signature[] = "\r\n\r\n\0\r\nQUIT\n";
+    constexpr size_t v2_signature_size = 12;
+
+    // v4映射的v6地址当作v4处理，两端地址族不同时不能用TCP4/TCP6表示
+    boost::asio::ip::address normalize(const boost::asio::ip::address& address)
+    {
+        if (address.is_v6() && address.to_v6().is_v4_mapped())
+            return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6());
+        return address;
+    }
+
+    void append_u16(std::string& out, const uint16_t value)
+    {
+        out += static_cast<char>(value >> 8);
+        out += static_cast<char>(value & 0xff);
+    }
+
+    uint16_t read_u16(const std::string_view data, const size_t offset)
+    {
+        return static_cast<uint16_t>(static_cast<unsigned char>(data[offset]) << 8 |
+            static_cast<unsigned char>(data[offset + 1]));
+    }
+
+    std::array<unsigned char, 16> to_v6_bytes(const boost::asio::ip::address& address)
+    {
+        if (address.is_v4())
+            return boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, address.to_v4()).to_bytes();
+        return address.to_v6().to_bytes();
+    }
+
+    bool parse_port(const std::string_view str, unsigned short& port)
+    {
+        const auto result = std::from_chars(str.data(), str.data() + str.size(), port);
+        return result.ec == std::errc() && result.ptr == str.data() + str.size();
+    }
+
+    proxy_parse_result parse_v1(const std::string_view data, size_t& size,
+                                boost::asio::ip::tcp::endpoint& source,
+                                boost::asio::ip::tcp::endpoint& destination)
+    {
+        constexpr size_t max_line = 107;
+
+        const auto end = data.substr(0, max_line).find("\r\n");
+        if (end == std::string_view::npos)
+            return data.size() < max_line ? proxy_parse_result::incomplete : proxy_parse_result::invalid;
+
+        size = end + 2;
+
+        // PROXY TCP4 源地址 目的地址 源端口 目的端口
+        std::string_view fields[6];
+        size_t count = 0;
+        auto line = data.substr(0, end);
+        while (!line.empty() && count < std::size(fields))
+        {
+            const auto space = line.find(' ');
+            fields[count++] = line.substr(0, space);
+            line = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+        }
+
+        if (count >= 2 && fields[1] == "UNKNOWN")
+            return proxy_parse_result::complete;
+
+        if (count != 6 || !line.empty() || (fields[1] != "TCP4" && fields[1] != "TCP6"))
+            return proxy_parse_result::invalid;
+
+        boost::system::error_code ec;
+        const auto src = boost::asio::ip::make_address(std::string(fields[2]), ec);
+        if (ec)
+            return proxy_parse_result::invalid;
+        const auto dst = boost::asio::ip::make_address(std::string(fields[3]), ec);
+        if (ec)
+            return proxy_parse_result::invalid;
+
+        unsigned short src_port, dst_port;
+        if (!parse_port(fields[4], src_port) || !parse_port(fields[5], dst_port))
+            return proxy_parse_result::invalid;
+
+        source = {src, src_port};
+        destination = {dst, dst_port};
+        return proxy_parse_result::complete;
+    }
+
+    proxy_parse_result parse_v2(const std::string_view data, size_t& size,
+                                boost::asio::ip::tcp::endpoint& source,
+                                boost::asio::ip::tcp::endpoint& destination)
+    {
+        if (data.size() < 16)
+            return proxy_parse_result::incomplete;
+
+        const auto ver_cmd = static_cast<unsigned char>(data[12]);
+        const auto family = static_cast<unsigned char>(data[13]);
+        const auto length = read_u16(data, 14);
+
+        if ((ver_cmd & 0xf0) != 0x20)
+            return proxy_parse_result::invalid;
+        if (16 + static_cast<size_t>(length) > proxy_protocol_max_header)
+            return proxy_parse_result::invalid;
+        if (data.size() < 16 + static_cast<size_t>(length))
+            return proxy_parse_result::incomplete;
+
+        size = 16 + length;
+
+        // LOCAL命令（健康检查等）使用连接本身的地址
+        if ((ver_cmd & 0x0f) == 0x00)
+            return proxy_parse_result::complete;
+        if ((ver_cmd & 0x0f) != 0x01)
+            return proxy_parse_result::invalid;
+
+        const auto body = data.substr(16, length);
+        if (family == 0x11) // TCP over IPv4
+        {
+            if (body.size() < 12)
+                return proxy_parse_result::invalid;
+
+            boost::asio::ip::address_v4::bytes_type src, dst;
+            std::memcpy(src.data(), body.data(), 4);
+            std::memcpy(dst.data(), body.data() + 4, 4);
+            source = {boost::asio::ip::address_v4(src), read_u16(body, 8)};
+            destination = {boost::asio::ip::address_v4(dst), read_u16(body, 10)};
+        }
+        else if (family == 0x21) // TCP over IPv6
+        {
+            if (body.size() < 36)
+                return proxy_parse_result::invalid;
+
+            boost::asio::ip::address_v6::bytes_type src, dst;
+            std::memcpy(src.data(), body.data(), 16);
+            std::memcpy(dst.data(), body.data() + 16, 16);
+            source = {boost::asio::ip::address_v6(src), read_u16(body, 32)};
+            destination = {boost::asio::ip::address_v6(dst), read_u16(body, 34)};
+        }
+
+        // 其他地址族（UDP、UNIX套接字）跳过，TLV也不需要
+        return proxy_parse_result::complete;
+    }
+
+    template <size_t N>
+    void append_bytes(std::string& out, const std::array<unsigned char, N>& bytes)
+    {
+        out.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    }
+}
+
+std::string make_proxy_protocol_header(const proxy_protocol_version version,
+                                       const boost::asio::ip::tcp::endpoint& source,
+                                       const boost::asio::ip::tcp::endpoint& destination)
+{
+    const auto src = normalize(source.address());
+    const auto dst = normalize(destination.address());
+    const bool known = !src.is_unspecified() && src.is_v4() == dst.is_v4();
+
+    std::string out;
+
+    if (version == proxy_protocol_version::v1)
+    {
+        if (!known)
+            return "PROXY UNKNOWN\r\n";
+
+        out.reserve(108); // v1头最长107字节
+        out += src.is_v4() ? "PROXY TCP4 " : "PROXY TCP6 ";
+        out += src.to_string();
+        out += ' ';
+        out += dst.to_string();
+        out += ' ';
+        out += std::to_string(source.port());
+        out += ' ';
+        out += std::to_string(destination.port());
+        out += "\r\n";
+        return out;
+    }
+
+    if (version == proxy_protocol_version::v2)
+    {
+        out.reserve(v2_signature_size + 4 + 36);
+        out.append(v2_signature, v2_signature_size);
+
+        if (!known)
+        {
+            // LOCAL命令，上游按连接本身的地址处理
+            out += static_cast<char>(0x20);
+            out += static_cast<char>(0x00);
+            append_u16(out, 0);
+            return out;
+        }
+
+        out += static_cast<char>(0x21); // 版本2，PROXY命令
+        if (src.is_v4())
+        {
+            out += static_cast<char>(0x11); // TCP over IPv4
+            append_u16(out, 12);
+            append_bytes(out, src.to_v4().to_bytes());
+            append_bytes(out, dst.to_v4().to_bytes());
+        }
+        else
+        {
+            out += static_cast<char>(0x21); // TCP over IPv6
+            append_u16(out, 36);
+            append_bytes(out, src.to_v6().to_bytes());
+            append_bytes(out, dst.to_v6().to_bytes());
+        }
+        append_u16(out, source.port());
+        append_u16(out, destination.port());
+        return out;
+    }
+
+    return out;
+}
+
+proxy_parse_result parse_proxy_protocol_header(const std::string_view data, size_t& size,
+                                               boost::asio::ip::tcp::endpoint& source,
+                                               boost::asio::ip::tcp::endpoint& destination)
+{
+    // 先按已有的数据判断是哪个版本
+    const auto v2_prefix = std::string_view(v2_signature, v2_signature_size).substr(0, data.size());
+    if (data.substr(0, v2_signature_size) == v2_prefix)
+        return data.size() < v2_signature_size
+                   ? proxy_parse_result::incomplete
+                   : parse_v2(data, size, source, destination);
+
+    constexpr std::string_view v1_prefix = "PROXY ";
+    if (data.substr(0, v1_prefix.size()) == v1_prefix.substr(0, data.size()))
+        return data.size() < v1_prefix.size()
+                   ? proxy_parse_result::incomplete
+                   : parse_v1(data, size, source, destination);
+
+    return proxy_parse_result::invalid;
+}
+
+bool trusted_networks::add(const std::string_view cidr)
+{
+    const auto slash = cidr.find('/');
+
+    boost::system::error_code ec;
+    const auto address = boost::asio::ip::make_address(std::string(cidr.substr(0, slash)), ec);
+    if (ec)
+        return false;
+
+    const unsigned max_prefix = address.is_v4() ? 32 : 128;
+    unsigned prefix = max_prefix;
+    if (slash != std::string_view::npos)
+    {
+        const auto str = cidr.substr(slash + 1);
+        const auto result = std::from_chars(str.data(), str.data() + str.size(), prefix);
+        if (result.ec != std::errc() || result.ptr != str.data() + str.size() || prefix > max_prefix)
+            return false;
+    }
+
+    networks_.push_back({to_v6_bytes(address), address.is_v4() ? prefix + 96 : prefix});
+    return true;
+}
+
+bool trusted_networks::contains(const boost::asio::ip::address& address) const
+{
+    const auto bytes = to_v6_bytes(address);
+    for (const auto& network : networks_)
+    {
+        const auto whole = network.prefix / 8;
+        const auto rest = network.prefix % 8;
+
+        if (std::memcmp(bytes.data(), network.bytes.data(), whole) != 0)
+            continue;
+
+        if (rest != 0)
+        {
+            const auto mask = static_cast<unsigned char>(0xff << (8 - rest));
+            if ((bytes[whole] & mask) != (network.bytes[whole] & mask))
+                continue;
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,75 @@
+//
+// Created by cinea on 24-3-4.
+//
+
+#ifndef PROXYPROTOCOL_H
+#define PROXYPROTOCOL_H
+
+#include <array>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio/ip/tcp.hpp>
+
+enum class proxy_protocol_version
+{
+    none,
+    v1, // 文本格式
+    v2, // 二进制格式
+};
+
+/**
+ * \brief 生成PROXY协议头，连接上游后在请求之前发出去。
+ * \param source 客户端的地址
+ * \param destination 客户端连接的本机地址
+ */
+std::string make_proxy_protocol_header(proxy_protocol_version version,
+                                       const boost::asio::ip::tcp::endpoint& source,
+                                       const boost::asio::ip::tcp::endpoint& destination);
+
+enum class proxy_parse_result
+{
+    complete,
+    incomplete, // 需要更多数据
+    invalid,
+};
+
+// 连接开头的PROXY协议头最多读这么多字节（v2头加上TLV）
+constexpr size_t proxy_protocol_max_header = 16 + 4096;
+
+/**
+ * \brief 解析连接开头的PROXY协议头，v1和v2都支持。
+ * \param size 完整时是头的长度，之后的数据属于HTTP或者TLS
+ * \param source 客户端的地址；LOCAL命令或者UNKNOWN时不修改
+ * \param destination 客户端连接的地址；同上
+ */
+proxy_parse_result parse_proxy_protocol_header(std::string_view data, size_t& size,
+                                               boost::asio::ip::tcp::endpoint& source,
+                                               boost::asio::ip::tcp::endpoint& destination);
+
+/**
+ * \brief 可信的来源网段，只有从这些地址来的连接才解析PROXY协议头。
+ */
+class trusted_networks
+{
+    struct network
+    {
+        std::array<unsigned char, 16> bytes; // IPv4按映射后的IPv6地址保存
+        unsigned prefix;
+    };
+
+    std::vector<network> networks_;
+
+public:
+    /**
+     * \brief 添加一个网段，形如"10.0.0.0/8"、"::1/128"，没有前缀长度时表示单个地址。
+     * \return 格式不对时返回false
+     */
+    bool add(std::string_view cidr);
+
+    [[nodiscard]] bool contains(const boost::asio::ip::address& address) const;
+
+    [[nodiscard]] bool empty() const { return networks_.empty(); }
+};
+
+#endif //PROXYPROTOCOL_H
@@ -0,0 +1,159 @@
+//
+// Created by cinea on 24-3-2.
+//
+
+#include "RateLimiter.h"
+
+#include <algorithm>
+
+rate_limiter gate_limiter;
+
+namespace
+{
+    constexpr unsigned token_bits = 24;
+    constexpr uint64_t token_mask = (uint64_t{1} << token_bits) - 1;
+    constexpr uint64_t token_scale = 1024; // 令牌数的小数部分有10位
+    constexpr unsigned max_burst = token_mask / token_scale;
+
+    uint64_t mix(uint64_t x)
+    {
+        // splitmix64
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t hash_key(const boost::asio::ip::address& remote, const size_t route)
+    {
+        uint64_t h;
+        if (remote.is_v4())
+        {
+            h = mix(remote.to_v4().to_uint());
+        }
+        else
+        {
+            const auto bytes = remote.to_v6().to_bytes();
+            uint64_t hi = 0, lo = 0;
+            for (size_t i = 0; i < 8; i++)
+            {
+                hi = hi << 8 | bytes[i];
+                lo = lo << 8 | bytes[i + 8];
+            }
+            h = mix(hi ^ mix(lo));
+        }
+
+        h = mix(h ^ route);
+        return h ? h : 1; // 0留给空槽位
+    }
+
+    uint64_t pack(const uint64_t time, const uint64_t tokens)
+    {
+        return time << token_bits | tokens;
+    }
+}
+
+rate_limiter::rate_limiter()
+{
+    configure({});
+}
+
+void rate_limiter::configure(const rate_limit_options& options)
+{
+    options_ = options;
+    options_.per_ip.burst = std::clamp(options_.per_ip.burst, 1u, max_burst);
+
+    size_t groups = 1;
+    while (groups * group_slots < options_.buckets)
+        groups <<= 1;
+
+    groups_ = std::make_unique<group[]>(groups);
+    mask_ = groups - 1;
+    epoch_ = std::chrono::steady_clock::now();
+}
+
+void rate_limiter::limit_routes(std::vector<token_rate> routes)
+{
+    routes_ = std::move(routes);
+    for (auto& rate : routes_)
+        rate.burst = std::clamp(rate.burst, 1u, max_burst);
+}
+
+bool rate_limiter::allow(const boost::asio::ip::address& remote, const size_t route)
+{
+    if (!options_.enabled)
+        return true;
+
+    const auto now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - epoch_).count());
+
+    // 路由的限制单独计数，route + 1避免和IP总限制的键重复
+    if (route < routes_.size() && routes_[route].rate > 0 && !take(hash_key(remote, route + 1), routes_[route], now))
+        return false;
+
+    return options_.per_ip.rate <= 0 || take(hash_key(remote, 0), options_.per_ip, now);
+}
+
+bool rate_limiter::take(const uint64_t key, const token_rate& rate, const uint64_t now)
+{
+    const auto full = static_cast<uint64_t>(rate.burst) * token_scale;
+    auto& g = groups_[key & mask_];
+
+    // 找到这个键的槽位，没有的话占一个空的，再没有就覆盖最久没用的
+    slot* target = nullptr;
+    slot* oldest = nullptr;
+    uint64_t oldest_time = UINT64_MAX;
+    for (auto& s : g.slots)
+    {
+        auto k = s.key.load(std::memory_order_acquire);
+        if (k == 0 && s.key.compare_exchange_strong(k, key, std::memory_order_acq_rel))
+        {
+            s.state.store(pack(now, full), std::memory_order_release);
+            target = &s;
+            break;
+        }
+        if (k == key)
+        {
+            target = &s;
+            break;
+        }
+
+        const auto time = s.state.load(std::memory_order_relaxed) >> token_bits;
+        if (time < oldest_time)
+        {
+            oldest_time = time;
+            oldest = &s;
+        }
+    }
+
+    if (!target)
+    {
+        // 并发覆盖同一个槽位时可能会多放过几个请求，限流允许这点误差
+        oldest->key.store(key, std::memory_order_release);
+        oldest->state.store(pack(now, full), std::memory_order_release);
+        target = oldest;
+    }
+
+    auto old = target->state.load(std::memory_order_acquire);
+    while (true)
+    {
+        auto last = old >> token_bits;
+        auto tokens = old & token_mask;
+
+        // 补充的令牌不足最小单位时不更新时间，否则请求很密集时低速率的桶永远补不满
+        if (const auto added = now > last
+                                   ? static_cast<uint64_t>(static_cast<double>(now - last) * rate.rate *
+                                       token_scale / 1000)
+                                   : 0; added > 0)
+        {
+            tokens = std::min(full, tokens + added);
+            last = now;
+        }
+
+        if (tokens < token_scale)
+            return false;
+
+        if (target->state.compare_exchange_weak(old, pack(last, tokens - token_scale), std::memory_order_acq_rel))
+            return true;
+    }
+}
@@ -0,0 +1,81 @@
+//
+// Created by cinea on 24-3-2.
+//
+
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <boost/asio/ip/address.hpp>
+
+struct token_rate
+{
+    double rate{0}; // 每秒补充多少个令牌，0表示不限制
+    unsigned burst{0}; // 桶的容量
+};
+
+struct rate_limit_options
+{
+    bool enabled{false};
+    token_rate per_ip{50, 100}; // 每个IP的总限制
+    size_t buckets{65536}; // 哈希表的大小，向上取到2的幂
+};
+
+/**
+ * \brief 按客户端IP（以及路由）限流的令牌桶。
+ *
+ * 桶放在固定大小的哈希表里，每个缓存行4个槽位，一个键只会落在一个缓存行里。
+ * 槽位的状态（令牌数和上次补充的时间）压缩在一个64位整数里，用CAS更新，不需要加锁。
+ * 缓存行满了就覆盖其中最久没有用过的桶，所以内存是固定的；被覆盖的桶多半早就补满了，
+ * 重新开始计数和原来没有区别。
+ */
+class rate_limiter
+{
+    struct slot
+    {
+        std::atomic<uint64_t> key{0}; // 0表示空
+        std::atomic<uint64_t> state{0}; // 高40位是毫秒时间，低24位是令牌数（定点数）
+    };
+
+    static constexpr size_t group_slots = 4;
+
+    struct alignas(64) group
+    {
+        slot slots[group_slots];
+    };
+
+    rate_limit_options options_;
+    std::vector<token_rate> routes_;
+    std::unique_ptr<group[]> groups_;
+    size_t mask_{0};
+    std::chrono::steady_clock::time_point epoch_;
+
+public:
+    rate_limiter();
+
+    // 必须在IO线程启动前调用
+    void configure(const rate_limit_options& options);
+
+    /**
+     * \brief 设置各个路由单独的限制，按路由编号索引，rate为0的不限制。
+     */
+    void limit_routes(std::vector<token_rate> routes);
+
+    [[nodiscard]] bool enabled() const { return options_.enabled; }
+
+    /**
+     * \brief 消耗一个令牌，没有令牌时返回false。
+     */
+    bool allow(const boost::asio::ip::address& remote, size_t route);
+
+private:
+    bool take(uint64_t key, const token_rate& rate, uint64_t now);
+};
+
+extern rate_limiter gate_limiter;
+
+#endif //RATELIMITER_H
@@ -0,0 +1,117 @@
+//
+// Created by cinea on 24-3-7.
+//
+
+#include "SocketOptions.h"
+
+#include <netinet/tcp.h>
+
+namespace
+{
+    template <int Level, int Name>
+    using int_option = net::detail::socket_option::integer<Level, Name>;
+
+    // 设置一个选项，值为0时保持系统默认；只用于每个连接上，失败不影响连接
+    template <class Option, class Socket>
+    void set_if(Socket& socket, const int value)
+    {
+        if (value == 0)
+            return;
+
+        beast::error_code ignored;
+        boost::ignore_unused(socket.set_option(Option(value), ignored));
+    }
+
+    template <class Socket>
+    void set_buffers(Socket& socket, const socket_options& options)
+    {
+        set_if<net::socket_base::receive_buffer_size>(socket, options.receive_buffer);
+        set_if<net::socket_base::send_buffer_size>(socket, options.send_buffer);
+    }
+
+    // 缓冲区以外的选项
+    void set_connection_options(tcp::socket& socket, const socket_options& options)
+    {
+        if (options.no_delay)
+        {
+            beast::error_code ignored;
+            boost::ignore_unused(socket.set_option(tcp::no_delay(true), ignored));
+        }
+
+#ifdef TCP_NOTSENT_LOWAT
+        set_if<int_option<IPPROTO_TCP, TCP_NOTSENT_LOWAT>>(socket, options.notsent_lowat);
+#endif
+#ifdef SO_BUSY_POLL
+        set_if<int_option<SOL_SOCKET, SO_BUSY_POLL>>(socket, options.busy_poll);
+#endif
+#ifdef TCP_QUICKACK
+        set_if<int_option<IPPROTO_TCP, TCP_QUICKACK>>(socket, options.quick_ack);
+#endif
+    }
+
+    // 监听端口上的选项失败时要报告，配置写错了不能悄悄忽略
+    template <class Option>
+    void set_listener_option(tcp::acceptor& acceptor, const int value, const char* what)
+    {
+        if (value == 0)
+            return;
+
+        beast::error_code ec;
+        boost::ignore_unused(acceptor.set_option(Option(value), ec));
+        if (ec)
+            fail(ec, what);
+    }
+}
+
+void read_socket_options(const toml::value& table, socket_options& options)
+{
+    options.no_delay = toml::find_or(table, "no_delay", options.no_delay);
+    options.receive_buffer = toml::find_or(table, "receive_buffer", options.receive_buffer);
+    options.send_buffer = toml::find_or(table, "send_buffer", options.send_buffer);
+    options.notsent_lowat = toml::find_or(table, "notsent_lowat", options.notsent_lowat);
+    options.busy_poll = toml::find_or(table, "busy_poll", options.busy_poll);
+    options.quick_ack = toml::find_or(table, "quick_ack", options.quick_ack);
+}
+
+void apply_listener_options(tcp::acceptor& acceptor, const listener_options& options)
+{
+    set_listener_option<net::socket_base::receive_buffer_size>(acceptor, options.socket.receive_buffer,
+                                                               "receive_buffer");
+    set_listener_option<net::socket_base::send_buffer_size>(acceptor, options.socket.send_buffer, "send_buffer");
+
+#ifdef TCP_DEFER_ACCEPT
+    set_listener_option<int_option<IPPROTO_TCP, TCP_DEFER_ACCEPT>>(acceptor, options.defer_accept, "defer_accept");
+#endif
+#ifdef TCP_FASTOPEN
+    set_listener_option<int_option<IPPROTO_TCP, TCP_FASTOPEN>>(acceptor, options.fast_open, "fast_open");
+#endif
+
+    // 检查一次每个连接上的选项能不能设置，之后每个连接就不再报告了
+#ifdef SO_BUSY_POLL
+    set_listener_option<int_option<SOL_SOCKET, SO_BUSY_POLL>>(acceptor, options.socket.busy_poll, "busy_poll");
+#endif
+}
+
+void apply_accepted_options(tcp::socket& socket, const socket_options& options)
+{
+    set_connection_options(socket, options);
+}
+
+void open_upstream_socket(tcp::socket& socket, const tcp& protocol, const socket_options& options,
+                          beast::error_code& ec)
+{
+    if (!socket.is_open())
+    {
+        boost::ignore_unused(socket.open(protocol, ec));
+        if (ec)
+            return;
+    }
+
+    // 缓冲区要在connect之前设置，握手时才会按它协商窗口缩放
+    set_buffers(socket, options);
+    set_connection_options(socket, options);
+
+#ifdef TCP_FASTOPEN_CONNECT
+    set_if<int_option<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>>(socket, options.fast_open);
+#endif
+}
@@ -0,0 +1,60 @@
+//
+// Created by cinea on 24-3-7.
+//
+
+#ifndef SOCKETOPTIONS_H
+#define SOCKETOPTIONS_H
+
+#include <toml.hpp>
+
+#include "Common.h"
+
+/**
+ * \brief 每个TCP连接的选项，客户端连接和上游连接各有一份。0表示用系统的默认值。
+ */
+struct socket_options
+{
+    bool no_delay{true}; // TCP_NODELAY，关掉Nagle算法，小响应不用等上一个包的确认
+    int receive_buffer{0}; // SO_RCVBUF，字节
+    int send_buffer{0}; // SO_SNDBUF，字节
+    int notsent_lowat{0}; // TCP_NOTSENT_LOWAT，发送缓冲区里还没发出的数据低于这个值才算可写
+    int busy_poll{0}; // SO_BUSY_POLL，微秒，读的时候忙等网卡队列；超过net.core.busy_poll需要CAP_NET_ADMIN
+    bool quick_ack{false}; // TCP_QUICKACK，连接建立后立即确认；内核之后可能恢复延迟确认
+    bool fast_open{false}; // TCP_FASTOPEN_CONNECT，只用于上游：请求和SYN一起发出
+};
+
+/**
+ * \brief 监听端口的选项。
+ */
+struct listener_options
+{
+    int backlog{net::socket_base::max_listen_connections};
+    int defer_accept{0}; // TCP_DEFER_ACCEPT，秒，客户端发来数据之后才接受连接
+    int fast_open{0}; // TCP_FASTOPEN，等待握手完成的TFO连接的队列长度，0表示不开启
+    socket_options socket; // 接受的连接用这些选项
+};
+
+/**
+ * \brief 从配置表里读出连接选项，没有写的项保持options里原来的值。
+ * fast_open在监听端口和上游上的含义不同，由调用者读。
+ */
+void read_socket_options(const toml::value& table, socket_options& options);
+
+/**
+ * \brief 在listen之前设置监听端口。缓冲区大小设置在监听端口上，接受的连接继承它，
+ * 这样窗口缩放在握手时就按新的大小协商。设置失败的选项会报告，但不影响监听。
+ */
+void apply_listener_options(tcp::acceptor& acceptor, const listener_options& options);
+
+/**
+ * \brief 设置刚接受的连接，缓冲区以外的选项。每个连接都会调用，失败的选项直接忽略。
+ */
+void apply_accepted_options(tcp::socket& socket, const socket_options& options);
+
+/**
+ * \brief 打开连接上游的socket并在connect之前设置全部选项。已经打开时只设置选项。
+ */
+void open_upstream_socket(tcp::socket& socket, const tcp& protocol, const socket_options& options,
+                          beast::error_code& ec);
+
+#endif //SOCKETOPTIONS_H
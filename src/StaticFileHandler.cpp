@@ -1,6 +1,12 @@
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cstring>
 #include <filesystem>
-#include <iostream>
-#include <shared_mutex>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 #include <boost/beast/core/string_type.hpp>
@@ -13,198 +19,725 @@
 #include <date-rfc/date-rfc.h>
 
 #include "Common.h"
-#include "../libs/MimeTypes/MimeTypes.h"
 #include "../libs/lrucache11/LRUCache11.hpp"
 
+#include "AccessLog.h"
+#include "BlockingPool.h"
 #include "Errors.h"
+#include "FileReader.h"
+#include "MimeTable.h"
+#include "Metrics.h"
+#include "StaticFileHandler.h"
 
-inline beast::string_view mime_type(const std::filesystem::path& path) {
-  if (const auto type = MimeTypes::getType(path.c_str())) {
-    return type;
+namespace {
+  // 多个响应共享同一份内容的响应体，发送时不用复制
+  struct shared_file_body {
+    using value_type = std::shared_ptr<const std::vector<u_char>>;
+
+    static std::uint64_t size(const value_type& body) { return body ? body->size() : 0; }
+
+    class writer {
+      const value_type& body_;
+
+    public:
+      using const_buffers_type = net::const_buffer;
+
+      template <bool isRequest, class Fields>
+      writer(const http::header<isRequest, Fields>&, const value_type& body) : body_(body) {}
+
+      void init(beast::error_code& ec) { ec = {}; }
+
+      boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+        ec = {};
+        if (!body_ || body_->empty())
+          return boost::none;
+        return {{const_buffers_type(body_->data(), body_->size()), false}};
+      }
+    };
+  };
+
+  char* append(char* out, const beast::string_view str) {
+    std::memcpy(out, str.data(), str.size());
+    return out + str.size();
+  }
+
+  /**
+   * 缓存文件的响应头。不变的字段放进缓存时已经拼好（cached_file::header），每个请求只格式化状态行和
+   * Content-Length、Connection、Expires几行。序列化出来是三个缓冲区，和响应体一起用一次writev写出，
+   * 不像basic_fields那样每个字段分配一次内存、各占一个缓冲区。304和小文件就是一次系统调用。
+   */
+  class cached_file_fields {
+    std::shared_ptr<const cached_file> file_;
+    std::optional<std::uint64_t> content_length_; // 304没有
+    bool expires_{false};
+    bool keep_alive_{true};
+
+  public:
+    class writer {
+      std::array<char, 48> status_{};
+      size_t status_size_{0};
+      const std::string& fields_;
+      std::array<char, 128> tail_{};
+      size_t tail_size_{0};
+
+    public:
+      using const_buffers_type = std::array<net::const_buffer, 3>;
+
+      writer(const cached_file_fields& f, const unsigned version, const unsigned status) : fields_(f.file_->header) {
+        // 状态行，例如 HTTP/1.1 304 Not Modified
+        auto out = append(status_.data(), "HTTP/");
+        *out++ = static_cast<char>('0' + version / 10);
+        *out++ = '.';
+        *out++ = static_cast<char>('0' + version % 10);
+        *out++ = ' ';
+        out = std::to_chars(out, out + 3, status).ptr;
+        *out++ = ' ';
+        out = append(out, http::obsolete_reason(http::int_to_status(status)));
+        out = append(out, "\r\n");
+        status_size_ = out - status_.data();
+
+        out = tail_.data();
+        if (f.content_length_) {
+          out = append(out, "Content-Length: ");
+          out = std::to_chars(out, out + 20, *f.content_length_).ptr;
+          out = append(out, "\r\n");
+        }
+
+        // 和basic_fields一样：1.1默认长连接，1.0默认关闭
+        if (version >= 11 && !f.keep_alive_)
+          out = append(out, "Connection: close\r\n");
+        else if (version < 11 && f.keep_alive_)
+          out = append(out, "Connection: keep-alive\r\n");
+
+        if (f.expires_) {
+          std::ostringstream oss;
+          auto exp_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now() + std::chrono::hours(12));
+          oss << date::format_rfc1123(exp_time);
+          out = append(out, "Expires: ");
+          out = append(out, oss.str());
+          out = append(out, "\r\n");
+        }
+
+        out = append(out, "\r\n");
+        tail_size_ = out - tail_.data();
+      }
+
+      const_buffers_type get() const {
+        return {net::const_buffer(status_.data(), status_size_), net::buffer(fields_),
+                net::const_buffer(tail_.data(), tail_size_)};
+      }
+    };
+
+    cached_file_fields(std::shared_ptr<const cached_file> file, const std::optional<std::uint64_t> content_length,
+                       const bool expires)
+      : file_(std::move(file)), content_length_(content_length), expires_(expires) {}
+
+  protected:
+    // http::header通过这些访问字段，这里只有固定的几个；方法和目标只有请求才有
+    beast::string_view get_method_impl() const { return {}; }
+    beast::string_view get_target_impl() const { return {}; }
+    beast::string_view get_reason_impl() const { return {}; }
+    bool get_chunked_impl() const { return false; }
+    bool get_keep_alive_impl(unsigned) const { return keep_alive_; }
+    bool has_content_length_impl() const { return content_length_.has_value(); }
+    void set_method_impl(beast::string_view) {}
+    void set_target_impl(beast::string_view) {}
+    void set_reason_impl(beast::string_view) {}
+    void set_chunked_impl(bool) {}
+    void set_content_length_impl(const boost::optional<std::uint64_t>& value) {
+      content_length_ = value ? std::optional(*value) : std::nullopt;
+    }
+    void set_keep_alive_impl(unsigned, const bool value) { keep_alive_ = value; }
+  };
+
+  constexpr size_t max_cached_size = 10 * 1024 * 1024; // 10MB
+
+  using file_cache = lru11::Cache<std::string, std::shared_ptr<const cached_file>>;
+
+  static_file_options static_options;
+
+  // 缓存的LRU顺序在查找时也会变，所以只用普通的锁；锁里只复制指针
+  std::unique_ptr<file_cache> static_file_cache = std::make_unique<file_cache>(static_options.cache_entries);
+  std::mutex mutex;
+
+  // 预热时退出，不再读剩下的文件
+  std::atomic_bool warm_up_stopped{false};
+
+  // 最近确认不存在的路径和它过期的时间
+  std::unique_ptr<lru11::Cache<std::string, std::chrono::steady_clock::time_point, std::mutex>> negative_cache;
+
+  // SPA入口文档固定在内存里，不会被缓存挤出去
+  struct spa_document {
+    std::shared_ptr<const cached_file> file;
+    std::chrono::steady_clock::time_point checked; // 上次检查文件是否更新的时间
+  };
+
+  std::shared_ptr<const spa_document> spa_doc;
+  std::mutex spa_mutex;
+
+  bool known_missing(const std::string& path) {
+    if (!negative_cache)
+      return false;
+
+    std::chrono::steady_clock::time_point expires;
+    if (!negative_cache->tryGet(path, expires))
+      return false;
+
+    if (std::chrono::steady_clock::now() < expires)
+      return true;
+
+    negative_cache->remove(path);
+    return false;
+  }
+
+  void remember_missing(const std::string& path) {
+    if (negative_cache)
+      negative_cache->insert(path, std::chrono::steady_clock::now() + static_options.negative_ttl);
+  }
+
+  // 响应头里不变的部分在放进缓存时就准备好
+  std::shared_ptr<cached_file> make_cached_file(const std::string& path, const std::time_t last_modified) {
+    auto file = std::make_shared<cached_file>();
+    file->last_modified = last_modified;
+    file->content_type = mime_type(path);
+
+    std::ostringstream oss;
+    oss << date::format_rfc1123(last_modified);
+    file->last_modified_str = oss.str();
+
+    file->header.append("Server: " BOOST_BEAST_VERSION_STRING "\r\nCache-Control: public\r\nContent-Type: ");
+    file->header.append(file->content_type.data(), file->content_type.size());
+    file->header.append("\r\nLast-Modified: ");
+    file->header.append(file->last_modified_str);
+    file->header.append("\r\n");
+
+    const auto extension = std::filesystem::path(path).extension();
+    file->expires = extension == ".js" || extension == ".css";
+    file->validated = std::chrono::steady_clock::now().time_since_epoch().count();
+    return file;
+  }
+
+  // 从最近使用的开始加大小，超出cache_bytes之后的都去掉，返回去掉了几个；调用时要拿着mutex
+  size_t trim_static_cache() {
+    uint64_t bytes = 0;
+    std::vector<std::string> over;
+    auto walk = [&](const auto& node) {
+      bytes += node.value->body.size();
+      if (bytes > static_options.cache_bytes)
+        over.push_back(node.key);
+    };
+    static_file_cache->cwalk(walk);
+
+    for (const auto& key : over)
+      static_file_cache->remove(key);
+    return over.size();
+  }
+
+  void count_hit(const cached_file& file) {
+    // 查缓存时已经拿过全局的锁，这里多一次原子加不会成为瓶颈
+    file.hits.fetch_add(1, std::memory_order_relaxed);
+    gate_metrics.add(gate_counter::static_cache_hits);
+    gate_metrics.add(gate_counter::static_cache_hit_bytes, file.body.size());
+  }
+
+  // 缓存里最近检查过的文件直接用，不访问文件系统
+  std::shared_ptr<const cached_file> fresh_cached_file(const std::string& path) {
+    if (static_options.revalidate.count() <= 0)
+      return nullptr;
+
+    std::shared_ptr<const cached_file> cached;
+    {
+      std::lock_guard guard(mutex);
+      static_file_cache->tryGet(path, cached);
+    }
+
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    const auto revalidate = std::chrono::duration_cast<std::chrono::steady_clock::duration>(static_options.revalidate);
+    if (!cached || now.count() - cached->validated.load(std::memory_order_relaxed) >= revalidate.count())
+      return nullptr;
+
+    count_hit(*cached);
+    return cached;
+  }
+
+  // 在executor上把响应交给handler
+  void post_response(const net::any_io_executor& executor, static_file_handler&& handler,
+                     http::message_generator&& msg) {
+    net::post(executor, [handler = std::move(handler), msg = std::move(msg)]() mutable {
+      handler(std::move(msg));
+    });
   }
-  return "application/text";
 }
 
-std::vector<u_char> load_static_file(const std::string& path, beast::error_code& ec)
-{
-  // 打开文件
-  beast::file_posix file;
-  file.open(path.c_str(), beast::file_mode::scan, ec);
+void configure_static_files(const static_file_options& options) {
+  static_options = options;
 
-  if (ec) { return std::vector<u_char>{}; }
+  file_reader_options reader_options;
+  reader_options.io_uring = options.io_uring;
+  gate_files.start(reader_options);
 
-  // 读取文件内容到缓存
-  std::vector<u_char> file_contents(file.size(ec));
-  file.read(file_contents.data(), file.size(ec), ec);
+  {
+    std::lock_guard guard(mutex);
+    static_file_cache = std::make_unique<file_cache>(options.cache_entries);
+  }
 
-  if (ec) { return std::vector<u_char>{}; }
+  negative_cache.reset();
+  if (options.negative_ttl.count() > 0 && options.negative_entries > 0)
+    negative_cache = std::make_unique<lru11::Cache<std::string, std::chrono::steady_clock::time_point, std::mutex>>(
+      options.negative_entries, options.negative_entries / 8);
 
-  return file_contents;
+  std::lock_guard guard(spa_mutex);
+  spa_doc.reset();
 }
 
-std::tuple<http::vector_body<u_char>::value_type, std::time_t> get_static_file(
+// 查缓存的结果：file不为空时直接用；pending不为空时还要把文件读进来
+struct static_lookup {
+  std::shared_ptr<const cached_file> file;
+  std::shared_ptr<cached_file> pending;
+  uint64_t size{0};
+};
+
+static_lookup lookup_static_file(
   const std::filesystem::path& path, const std::optional<std::time_t> if_modified_since, beast::error_code& ec)
 {
-  static lru11::Cache<std::string, std::vector<u_char>> static_file_cache(20);
-  static std::unordered_map<std::string, std::time_t> static_file_version;
-  static std::shared_mutex mutex;
+  const auto& path_str = path.native();
 
-  if (!exists(path))
+  // 文件不存在时这里就会失败，不用再单独检查；读文件需要的大小也一起拿到
+  struct stat st{};
+  if (::stat(path_str.c_str(), &st) != 0)
   {
-    ec = beast::error_code(beast::errc::no_such_file_or_directory, boost::system::generic_category());
-    return std::make_tuple(std::vector<u_char>(), 0);
+    ec = errno == ENOENT || errno == ENOTDIR
+           ? beast::error_code(beast::errc::no_such_file_or_directory, boost::system::generic_category())
+           : beast::error_code(errno, boost::system::generic_category());
+    return {};
   }
+  const auto last_modified = st.st_mtime;
 
-  const auto path_str = std::string(path);
-  const auto last_modified = fs_time_to_time_t(last_write_time(path));
+  {
+    std::shared_ptr<const cached_file> cached;
+    {
+      std::lock_guard guard(mutex);
+      static_file_cache->tryGet(path_str, cached);
+    }
+
+    // 检查最后修改时间
+    if (cached && last_modified <= cached->last_modified)
+    {
+      cached->validated.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                              std::memory_order_relaxed);
+      count_hit(*cached);
+      return {cached};
+    }
+  }
+
+  auto file = make_cached_file(path_str, last_modified);
 
   if (if_modified_since.has_value() && *if_modified_since >= last_modified)
   {
-    // 客户端缓存有效
-    return std::make_tuple(std::vector<u_char>(), last_modified);
+    // 客户端缓存有效，不用读文件
+    return {file};
+  }
+
+  return {nullptr, file, static_cast<uint64_t>(st.st_size)};
+}
+
+// 读进来的文件放进缓存
+void store_static_file(const std::string& path, const std::shared_ptr<const cached_file>& file)
+{
+  gate_metrics.add(gate_counter::static_cache_misses);
+  gate_metrics.add(gate_counter::static_cache_load_bytes, file->body.size());
+
+  if (file->body.size() < max_cached_size && file->body.size() <= static_options.cache_bytes)
+  {
+    std::lock_guard guard(mutex);
+
+    // 插入时超出个数的条目会被挤出去，然后再按总大小挤
+    static_file_cache->remove(path);
+    const auto size_before = static_file_cache->size();
+    static_file_cache->insert(path, file);
+    const auto evicted = size_before + 1 - static_file_cache->size() + trim_static_cache();
+    if (evicted > 0)
+      gate_metrics.add(gate_counter::static_cache_evictions, evicted);
+  }
+}
+
+std::shared_ptr<const cached_file> get_static_file(
+  const std::filesystem::path& path, const std::optional<std::time_t> if_modified_since, beast::error_code& ec)
+{
+  auto found = lookup_static_file(path, if_modified_since, ec);
+  if (!found.pending)
+    return found.file;
+
+  found.pending->body = read_whole_file(path.native(), ec);
+  if (ec) return nullptr;
+
+  store_static_file(path.native(), found.pending);
+  return found.pending;
+}
+
+bool warm_static_cache(const std::filesystem::path& doc_root)
+{
+  if (!static_options.warm_up)
+    return true;
+
+  const auto started = std::chrono::steady_clock::now();
+  const auto root = doc_root.native();
+
+  // 先按上次记下的清单，没有时再扫描doc_root。个数和总大小都不超过缓存的上限，不然读进来也会被挤掉
+  std::vector<std::string> paths;
+  uint64_t bytes = 0;
+  auto fits = [&](const uint64_t size) {
+    return paths.size() < static_options.cache_entries && bytes + size <= static_options.cache_bytes;
+  };
+
+  if (!static_options.manifest.empty())
+  {
+    // 清单里最热的文件在前面，装不下时后面的就不要了
+    std::ifstream manifest(static_options.manifest);
+    for (std::string line; !warm_up_stopped && std::getline(manifest, line);)
+    {
+      std::error_code fs_ec;
+      if (line.compare(0, root.size(), root) != 0)
+        continue;
+      const auto size = std::filesystem::file_size(line, fs_ec);
+      if (fs_ec || size >= max_cached_size)
+        continue;
+      if (!fits(size))
+        break;
+
+      bytes += size;
+      paths.push_back(std::move(line));
+    }
   }
 
+  if (paths.empty())
   {
-    std::shared_lock guard(mutex);
-    if (static_file_cache.contains(path_str))
+    std::error_code fs_ec;
+    for (auto it = std::filesystem::recursive_directory_iterator(
+           doc_root, std::filesystem::directory_options::skip_permission_denied, fs_ec);
+         !fs_ec && !warm_up_stopped && it != std::filesystem::recursive_directory_iterator() &&
+         paths.size() < static_options.cache_entries;
+         it.increment(fs_ec))
     {
-      // 检查最后修改时间
-      if (last_modified <= static_file_version.find(path_str)->second)
-        return std::make_tuple(static_file_cache.get(path), last_modified);
+      if (!it->is_regular_file(fs_ec))
+        continue;
+      const auto size = it->file_size(fs_ec);
+      if (fs_ec || size >= max_cached_size || !fits(size))
+        continue;
+      bytes += size;
+
+      // 和请求时拼出来的路径一样，才能命中缓存
+      const auto relative = it->path().lexically_relative(doc_root).generic_string();
+      paths.push_back((doc_root / ("./" + relative)).native());
     }
   }
 
-  auto body = load_static_file(path, ec);
-  if (ec) return std::make_tuple(std::move(body), last_modified);
+  // 清单是按最近使用排的，倒着读，最热的文件最后放进去，不会先被挤掉
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> loaded{0};
+  auto worker = [&]
+  {
+    for (size_t i; !warm_up_stopped && (i = next.fetch_add(1)) < paths.size();)
+    {
+      beast::error_code ec;
+      if (get_static_file(paths[paths.size() - 1 - i], std::nullopt, ec))
+        loaded.fetch_add(1);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < static_options.warm_threads; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto& t : workers)
+    t.join();
+
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+  const bool stopped = warm_up_stopped;
+  gate_log.error("static cache", (stopped ? "warm-up stopped after " : "warmed ") +
+                 std::to_string(loaded.load()) + " files in " + std::to_string(elapsed.count()) + "ms");
+  return !stopped;
+}
+
+void stop_static_warm_up()
+{
+  warm_up_stopped = true;
+}
+
+void save_static_manifest()
+{
+  if (static_options.manifest.empty())
+    return;
 
-  if (body.size() < 10 * 1024 * 1024) // 10MB
+  // 只在锁里复制路径，写文件在锁外面
+  std::vector<std::string> paths;
   {
     std::lock_guard guard(mutex);
+    paths.reserve(static_file_cache->size());
+    auto collect = [&](const auto& node) { paths.push_back(node.key); };
+    static_file_cache->cwalk(collect);
+  }
 
-    static_file_version.insert_or_assign(path_str, last_modified);
-    static_file_cache.remove(path_str);
-    static_file_cache.insert(path_str, body);
+  // 先写临时文件再改名，中途崩溃也不会留下半个清单
+  const auto temp = static_options.manifest + ".tmp";
+  {
+    std::ofstream out(temp, std::ios::trunc);
+    for (const auto& path : paths)
+      out << path << '\n';
+    if (!out)
+      return;
   }
 
-  return std::make_tuple(std::move(body), last_modified);
+  std::error_code fs_ec;
+  std::filesystem::rename(temp, static_options.manifest, fs_ec);
 }
 
+std::vector<static_cache_entry> static_cache_entries()
+{
+  std::vector<static_cache_entry> entries;
+  std::lock_guard guard(mutex);
+  entries.reserve(static_file_cache->size());
+  auto collect = [&](const auto& node) {
+    entries.push_back({node.key, node.value->body.size(), node.value->hits.load(std::memory_order_relaxed),
+                       node.value->last_modified_str});
+  };
+  static_file_cache->cwalk(collect);
+  return entries;
+}
+
+size_t static_cache_capacity()
+{
+  return static_options.cache_entries;
+}
+
+size_t static_negative_entries()
+{
+  return negative_cache ? negative_cache->size() : 0;
+}
+
+size_t purge_static_cache(const std::string& path, const bool prefix)
+{
+  auto matches = [&](const std::string& key) {
+    return prefix ? key.compare(0, path.size(), path) == 0 : key == path;
+  };
+
+  size_t purged = 0;
+  {
+    std::lock_guard guard(mutex);
+    std::vector<std::string> keys;
+    auto collect = [&](const auto& node) {
+      if (matches(node.key))
+        keys.push_back(node.key);
+    };
+    static_file_cache->cwalk(collect);
+    for (const auto& key : keys)
+      purged += static_file_cache->remove(key);
+  }
+
+  // 换上新文件以后，记住的“不存在”就不对了
+  if (negative_cache) {
+    std::vector<std::string> keys;
+    auto collect = [&](const auto& node) {
+      if (matches(node.key))
+        keys.push_back(node.key);
+    };
+    negative_cache->cwalk(collect);
+    for (const auto& key : keys)
+      negative_cache->remove(key);
+  }
+
+  // SPA入口文档固定在内存里，不在缓存中；不管是不是它，下次都重新取
+  std::lock_guard guard(spa_mutex);
+  spa_doc.reset();
+
+  return purged;
+}
+
+std::chrono::steady_clock::duration spa_recheck_interval() {
+  return std::max<std::chrono::steady_clock::duration>(static_options.negative_ttl, std::chrono::seconds(1));
+}
+
+// 不用访问文件系统就能拿到SPA入口文档（或者根本不需要）
+bool spa_document_fresh() {
+  if (static_options.spa_fallback.empty())
+    return true;
+
+  std::lock_guard guard(spa_mutex);
+  return spa_doc && std::chrono::steady_clock::now() - spa_doc->checked < spa_recheck_interval();
+}
+
+// 取SPA入口文档，最多每negative_ttl检查一次文件有没有更新
+std::shared_ptr<const cached_file> get_spa_document(const std::filesystem::path& doc_root) {
+  std::shared_ptr<const spa_document> doc;
+  {
+    std::lock_guard guard(spa_mutex);
+    doc = spa_doc;
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  if (doc && now - doc->checked < spa_recheck_interval())
+    return doc->file;
+
+  // 文件没变时直接从缓存拿到原来的内容
+  beast::error_code ec;
+  std::error_code fs_ec;
+  const auto path = doc_root / ("." + static_options.spa_fallback);
+  auto file = is_directory(path, fs_ec) ? nullptr : get_static_file(path, std::nullopt, ec);
+
+  std::lock_guard guard(spa_mutex);
+  spa_doc = file ? std::make_shared<const spa_document>(spa_document{file, now}) : nullptr;
+  return file;
+}
 
 http::message_generator
-handle_static_file(const std::filesystem::path& doc_root,
-                   http::request<http::dynamic_body> &&req) {
-  // 确保HTTP方法合理
-  if( req.method() != http::verb::get &&
-      req.method() != http::verb::head)
-    return bad_request(std::move(req), "Unknown HTTP-method");
+file_response(http::request<http::dynamic_body> &&req, const std::shared_ptr<const cached_file>& file,
+              const std::optional<std::time_t> if_modified_since) {
+  // 客户端缓存是否命中？
+  if (if_modified_since.has_value() && *if_modified_since >= file->last_modified)
+  {
+    http::response<http::empty_body, cached_file_fields> res{
+      std::piecewise_construct, std::make_tuple(), std::make_tuple(file, std::nullopt, false)};
+    res.result(http::status::not_modified);
+    res.version(req.version());
+    res.keep_alive(req.keep_alive());
+    return res;
+  }
 
-  if (req.target().empty() || req.target()[0] != '/')
+  // HEAD
+  if(req.method() == http::verb::head)
   {
-    return bad_request(std::move(req), "Illegal request-target");
+    http::response<http::empty_body, cached_file_fields> res{
+      std::piecewise_construct, std::make_tuple(), std::make_tuple(file, file->body.size(), false)};
+    res.result(http::status::ok);
+    res.version(req.version());
+    res.keep_alive(req.keep_alive());
+    return res;
   }
 
-  // std::cout << doc_root / ("." + std::string(req.target())) << std::endl;
+  // GET，响应体和缓存共享同一份内容；js和css加上Expires
+  http::response<shared_file_body, cached_file_fields> res{
+    std::piecewise_construct,
+    std::make_tuple(shared_file_body::value_type(file, &file->body)),
+    std::make_tuple(file, file->body.size(), file->expires)};
+  res.result(http::status::ok);
+  res.version(req.version());
+  res.keep_alive(req.keep_alive());
+  return res;
+}
 
-  std::filesystem::path path = doc_root / ("." + std::string(req.target()));
-  if(is_directory(path))
+// 文件不存在：返回SPA入口文档，或者404
+http::message_generator
+missing_file(const std::filesystem::path& doc_root, http::request<http::dynamic_body> &&req,
+             const std::optional<std::time_t> if_modified_since) {
+  if (!static_options.spa_fallback.empty() && req.target() != static_options.spa_fallback) {
+    if (const auto file = get_spa_document(doc_root)) {
+      gate_metrics.add(gate_counter::static_spa_fallbacks);
+      return file_response(std::move(req), file, if_modified_since);
+    }
+  }
+
+  return not_found(std::move(req), req.target());
+}
+
+// 需要访问文件系统的部分，在gate_blocking的线程上运行
+void
+serve_static_file(const net::any_io_executor& executor, const std::filesystem::path& doc_root,
+                  std::filesystem::path path, http::request<http::dynamic_body> &&req,
+                  const std::optional<std::time_t> if_modified_since, static_file_handler&& handler) {
+  // 最近确认过不存在的路径（多半是前端路由）不再访问文件系统
+  const auto requested = path.native();
+  if (known_missing(requested))
   {
-    path /= "index.html";
+    gate_metrics.add(gate_counter::static_negative_hits);
+    return post_response(executor, std::move(handler), missing_file(doc_root, std::move(req), if_modified_since));
   }
 
-  // 解析缓存相关属性
-  std::optional<std::time_t> if_modified_since;
-  if (const auto str = req[http::field::if_modified_since]; !str.empty())
+  if (std::error_code fs_ec; is_directory(path, fs_ec))
   {
-    time_t dt;
-    std::istringstream iss(str);
-    iss >> date::format_rfc1123(dt);
-    if_modified_since = std::optional(dt);
+    path /= "index.html";
   }
 
   // 尝试打开文件
   beast::error_code ec;
-  http::vector_body<u_char>::value_type body;
-  std::time_t last_modified;
-  std::tie(body, last_modified) = get_static_file(path, if_modified_since, ec);
+  auto found = lookup_static_file(path, if_modified_since, ec);
 
   if (ec == beast::errc::no_such_file_or_directory)
   {
-    using namespace std::string_view_literals;
-
-    if (req.target() != "/index.html"sv)
-    {
-      req.target("/index.html");
-      return handle_static_file(doc_root, std::move(req)); // 使用index.html重试，目的是兼容Vue Router的h5历史
-    }
-
-    return not_found(std::move(req), req.target());
+    remember_missing(requested);
+    return post_response(executor, std::move(handler), missing_file(doc_root, std::move(req), if_modified_since));
   }
 
   if(ec)
   {
-    return server_error(std::move(req), ec.message());
+    return post_response(executor, std::move(handler), server_error(std::move(req), ec.message()));
   }
 
-  // 制作LastModified字符串
-  std::string last_modified_http_date;
+  if (!found.pending)
   {
-    std::ostringstream oss;
-    oss << date::format_rfc1123(last_modified);
-    last_modified_http_date = oss.str();
+    return post_response(executor, std::move(handler), file_response(std::move(req), found.file, if_modified_since));
   }
 
-  // 提前计算文件大小
-  auto const size = body.size();
+  // 不在缓存里：有io_uring时交给内核读，这个线程可以去做别的；否则就在这里读
+  auto path_str = path.native();
+  const auto size = found.size;
+  gate_files.async_read(
+    path_str, size,
+    [executor, path_str, file = std::move(found.pending), req = std::move(req), if_modified_since,
+      handler = std::move(handler)](const beast::error_code& ec, std::vector<u_char>&& data) mutable {
+      if (ec)
+        return post_response(executor, std::move(handler), server_error(std::move(req), ec.message()));
+
+      file->body = std::move(data);
+      store_static_file(path_str, file);
+      post_response(executor, std::move(handler), file_response(std::move(req), file, if_modified_since));
+    });
+}
 
-  // 客户端缓存是否命中？
-  if (if_modified_since.has_value() && *if_modified_since >= last_modified)
+void
+handle_static_file(const net::any_io_executor& executor, const std::filesystem::path& doc_root,
+                   http::request<http::dynamic_body> &&req, static_file_handler&& handler) {
+  // 确保HTTP方法合理
+  if( req.method() != http::verb::get &&
+      req.method() != http::verb::head)
+    return handler(bad_request(std::move(req), "Unknown HTTP-method"));
+
+  if (req.target().empty() || req.target()[0] != '/')
   {
-    http::response<http::empty_body> res{http::status::not_modified, req.version()};
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::cache_control, "public");
-    res.set(http::field::content_type, mime_type(path));
-    res.set(http::field::last_modified, last_modified_http_date);
-    res.keep_alive(req.keep_alive());
-    return res;
+    return handler(bad_request(std::move(req), "Illegal request-target"));
   }
 
-  // HEAD
-  if(req.method() == http::verb::head)
+  // std::cout << doc_root / ("." + std::string(req.target())) << std::endl;
+
+  std::filesystem::path path = doc_root / ("." + std::string(req.target()));
+
+  // 解析缓存相关属性
+  std::optional<std::time_t> if_modified_since;
+  if (const auto str = req[http::field::if_modified_since]; !str.empty())
   {
-    http::response<http::empty_body> res{http::status::ok, req.version()};
-    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-    res.set(http::field::content_type, mime_type(path));
-    res.set(http::field::last_modified, last_modified_http_date);
-    res.content_length(size);
-    res.keep_alive(req.keep_alive());
-    return res;
+    time_t dt;
+    std::istringstream iss(str);
+    iss >> date::format_rfc1123(dt);
+    if_modified_since = std::optional(dt);
   }
 
-  // 制作Expires字符串
-  std::string expires;
+  // 只用内存就能回复的情况不用切换线程
+  if (known_missing(path.native()) && spa_document_fresh())
   {
-    std::ostringstream oss;
-    auto exp_time = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now() + std::chrono::hours(12));
-    oss << date::format_rfc1123(exp_time);
-    expires = oss.str();
+    gate_metrics.add(gate_counter::static_negative_hits);
+    return handler(missing_file(doc_root, std::move(req), if_modified_since));
   }
 
-  // GET
-  http::response<http::vector_body<u_char>> res{
-    std::piecewise_construct,
-    std::make_tuple(std::move(body)),
-    std::make_tuple(http::status::ok, req.version())};
-  res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-  res.set(http::field::cache_control, "public");
-  res.set(http::field::content_type, mime_type(path));
-  res.set(http::field::last_modified, last_modified_http_date);
-  res.content_length(size);
-  res.keep_alive(req.keep_alive());
-
-  if(path.extension()==".js" || path.extension()==".css")
+  // 以/结尾的一定是目录，和serve_static_file拼出来的路径一样
+  const auto cached = fresh_cached_file(
+    req.target().back() == '/' ? (path / "index.html").native() : path.native());
+  if (cached)
   {
-    res.set(http::field::expires, expires);
+    return handler(file_response(std::move(req), cached, if_modified_since));
   }
 
-  return res;
+  gate_blocking.post(
+    [executor, &doc_root, path = std::move(path), req = std::move(req), if_modified_since,
+      handler = std::move(handler)]() mutable {
+      serve_static_file(executor, doc_root, std::move(path), std::move(req), if_modified_since, std::move(handler));
+    });
 }
@@ -5,12 +5,118 @@
 #ifndef STATICFILEHANDLER_H
 #define STATICFILEHANDLER_H
 
+#include <atomic>
+#include <chrono>
+#include <ctime>
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 #include "Common.h"
+#include "utils/UniqueHandler.hpp"
 
-http::message_generator
-handle_static_file(const std::filesystem::path& doc_root,
-                   http::request<http::dynamic_body> &&req);
+struct static_file_options
+{
+    std::string spa_fallback{"/index.html"}; // 找不到文件时返回的文档（兼容Vue Router的h5历史），留空时返回404
+    std::chrono::seconds negative_ttl{5}; // 不存在的路径记住多久，同时也是检查SPA文档是否更新的间隔；0表示不记
+    size_t negative_entries{4096}; // 最多记住多少个不存在的路径
+    size_t cache_entries{20}; // 内存里最多缓存多少个文件
+    uint64_t cache_bytes{64 * 1024 * 1024}; // 缓存的文件加起来最多多大，超出时从最久未用的开始去掉
+    bool warm_up{false}; // 启动时预先把文件读进缓存
+    unsigned warm_threads{4}; // 预热时并行读文件的线程数
+    std::string manifest; // 记录缓存中的文件，下次启动时按它预热；留空时扫描doc_root
+    std::chrono::seconds revalidate{1}; // 缓存里的文件多久检查一次有没有更新，期间直接从内存返回；0表示每次都检查
+    bool io_uring{true}; // 不在缓存里的文件用io_uring读（需要编译时找到liburing），否则在gate_blocking的线程上读
+};
+
+/**
+ * \brief 内存里的静态文件，响应头需要的字符串在放进缓存时就准备好了。
+ */
+struct cached_file
+{
+    std::vector<u_char> body; // 客户端缓存仍然有效时可能为空
+    std::time_t last_modified{0};
+    std::string last_modified_str;
+    beast::string_view content_type;
+    std::string header; // 不随请求变化的响应头（Server到Last-Modified），每行以\r\n结尾
+    bool expires{false}; // 是否加上Expires头（js和css）
+    mutable std::atomic<std::chrono::steady_clock::rep> validated{0}; // 上次确认文件没有更新的时间
+    mutable std::atomic<uint64_t> hits{0}; // 放进缓存以后命中的次数
+};
+
+/**
+ * \brief 缓存里的一个文件，给管理接口用。
+ */
+struct static_cache_entry
+{
+    std::string path;
+    size_t size{0};
+    uint64_t hits{0};
+    std::string last_modified;
+};
+
+/**
+ * \brief 必须在IO线程启动前调用。
+ */
+void configure_static_files(const static_file_options& options);
+
+/**
+ * \brief 读取静态文件，优先使用内存中的缓存。
+ * \return 出错时为空；不在缓存里而且客户端缓存仍然有效时不读文件，内容为空
+ */
+std::shared_ptr<const cached_file> get_static_file(
+  const std::filesystem::path& path, std::optional<std::time_t> if_modified_since, beast::error_code& ec);
+
+/**
+ * \brief 打开了warm_up时，按清单（没有时扫描doc_root）把文件读进缓存，直到个数或者总大小到了上限。
+ * 会阻塞，应该在单独的线程上调用。
+ * \return 被stop_static_warm_up打断时为false
+ */
+bool warm_static_cache(const std::filesystem::path& doc_root);
+
+/**
+ * \brief 让进行中的预热尽快结束，正在读的文件读完就返回。
+ */
+void stop_static_warm_up();
+
+/**
+ * \brief 把缓存中的文件按最近使用的顺序写进清单，没有配置清单时什么都不做。
+ */
+void save_static_manifest();
+
+/**
+ * \brief 缓存中的文件，从最近使用的开始。
+ */
+std::vector<static_cache_entry> static_cache_entries();
+
+/**
+ * \brief 缓存最多放多少个文件，和记住了多少个不存在的路径。
+ */
+size_t static_cache_capacity();
+size_t static_negative_entries();
+
+/**
+ * \brief 从缓存里去掉文件，下次请求时重新读；记住的不存在路径和SPA入口文档也一起清掉。
+ * \param path 和请求时拼出来的路径相同的文件系统路径
+ * \param prefix 为true时去掉所有以path开头的
+ * \return 去掉了多少个文件
+ */
+size_t purge_static_cache(const std::string& path, bool prefix);
+
+// 和ProxyCallbackFunc是同一个类型，网关可以直接传进来
+using static_file_handler = unique_handler<void(http::message_generator&&)>;
+
+/**
+ * \brief 处理静态文件请求。
+ *
+ * 缓存里最近检查过的文件和已知不存在的路径直接在当前线程上调用handler；
+ * 其他情况要访问文件系统，交给gate_blocking，完成后在executor上调用handler。
+ * doc_root在handler被调用之前必须一直有效。
+ */
+void
+handle_static_file(const net::any_io_executor& executor, const std::filesystem::path& doc_root,
+                   http::request<http::dynamic_body> &&req, static_file_handler&& handler);
 
 #endif //STATICFILEHANDLER_H
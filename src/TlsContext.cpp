@@ -0,0 +1,150 @@
+//
+// Created by cinea on 24-2-25.
+//
+
+#include "TlsContext.h"
+
+#include <cstring>
+#include <utility>
+
+namespace
+{
+    // ALPN线格式的协议列表，按偏好排序
+    constexpr char alpn_h2[] = "\x02h2\x08http/1.1";
+    constexpr char alpn_http1[] = "\x08http/1.1";
+
+    int select_alpn(SSL*, const unsigned char** out, unsigned char* outlen,
+                    const unsigned char* in, const unsigned int inlen, void* arg)
+    {
+        const auto* protos = static_cast<const unsigned char*>(arg);
+        const auto protos_len = static_cast<unsigned int>(std::strlen(static_cast<const char*>(arg)));
+
+        if (SSL_select_next_proto(const_cast<unsigned char**>(out), outlen, protos, protos_len, in, inlen) !=
+            OPENSSL_NPN_NEGOTIATED)
+            return SSL_TLSEXT_ERR_NOACK;
+
+        return SSL_TLSEXT_ERR_OK;
+    }
+}
+
+tls_context::tls_context(net::io_context& ioc, tls_options options):
+    options_(std::move(options)), timer_(make_strand(ioc))
+{
+}
+
+void tls_context::load(beast::error_code& ec)
+{
+    auto ctx = build(ec);
+    if (ec)
+        return;
+
+    std::error_code fs_ec;
+    std::lock_guard guard(mutex_);
+    ctx_ = std::move(ctx);
+    cert_time_ = std::filesystem::last_write_time(options_.cert_file, fs_ec);
+    key_time_ = std::filesystem::last_write_time(options_.key_file, fs_ec);
+}
+
+std::shared_ptr<net::ssl::context> tls_context::get()
+{
+    std::lock_guard guard(mutex_);
+    return ctx_;
+}
+
+void tls_context::run()
+{
+    if (options_.reload_interval > 0)
+        do_wait();
+}
+
+std::shared_ptr<net::ssl::context> tls_context::build(beast::error_code& ec) const
+{
+    auto ctx = std::make_shared<net::ssl::context>(net::ssl::context::tls_server);
+
+    boost::ignore_unused(ctx->set_options(net::ssl::context::default_workarounds |
+                                         net::ssl::context::no_sslv2 |
+                                         net::ssl::context::no_sslv3 |
+                                         net::ssl::context::no_tlsv1 |
+                                         net::ssl::context::no_tlsv1_1 |
+                                         net::ssl::context::single_dh_use, ec));
+    if (ec)
+        return nullptr;
+
+    boost::ignore_unused(ctx->use_certificate_chain_file(options_.cert_file, ec));
+    if (ec)
+        return nullptr;
+
+    boost::ignore_unused(ctx->use_private_key_file(options_.key_file, net::ssl::context::pem, ec));
+    if (ec)
+        return nullptr;
+
+    auto* native = ctx->native_handle();
+
+    if (!options_.ciphers.empty() && SSL_CTX_set_cipher_list(native, options_.ciphers.c_str()) != 1)
+    {
+        ec = beast::error_code(beast::errc::invalid_argument, boost::system::generic_category());
+        return nullptr;
+    }
+
+    if (!options_.ciphersuites.empty() && SSL_CTX_set_ciphersuites(native, options_.ciphersuites.c_str()) != 1)
+    {
+        ec = beast::error_code(beast::errc::invalid_argument, boost::system::generic_category());
+        return nullptr;
+    }
+
+    // 会话恢复：服务端会话缓存 + 会话票据
+    static constexpr unsigned char session_id_context[] = "forum-gate";
+    SSL_CTX_set_session_id_context(native, session_id_context, sizeof(session_id_context) - 1);
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(native, options_.session_cache_size);
+    if (!options_.session_tickets)
+    {
+        SSL_CTX_set_options(native, SSL_OP_NO_TICKET);
+        SSL_CTX_set_num_tickets(native, 0);
+    }
+
+    SSL_CTX_set_alpn_select_cb(native, &select_alpn,
+                               const_cast<char*>(options_.http2 ? alpn_h2 : alpn_http1));
+
+    return ctx;
+}
+
+void tls_context::do_wait()
+{
+    timer_.expires_after(std::chrono::seconds(options_.reload_interval));
+    timer_.async_wait(beast::bind_front_handler(&tls_context::on_wait, shared_from_this()));
+}
+
+void tls_context::on_wait(const beast::error_code& ec)
+{
+    if (ec)
+        return fail(ec, "tls timer");
+
+    std::error_code fs_ec;
+    const auto cert_time = std::filesystem::last_write_time(options_.cert_file, fs_ec);
+    const auto key_time = std::filesystem::last_write_time(options_.key_file, fs_ec);
+
+    bool changed;
+    {
+        std::lock_guard guard(mutex_);
+        changed = !fs_ec && (cert_time != cert_time_ || key_time != key_time_);
+    }
+
+    if (changed)
+    {
+        // 证书和私钥可能不是同时写完的，加载失败时保留旧的上下文，下次再试
+        beast::error_code build_ec;
+        if (auto ctx = build(build_ec); !build_ec)
+        {
+            std::lock_guard guard(mutex_);
+            ctx_ = std::move(ctx);
+            cert_time_ = cert_time;
+            key_time_ = key_time;
+            gate_log.error("tls", "certificate reloaded");
+        }
+        else
+            fail(build_ec, "tls reload");
+    }
+
+    do_wait();
+}
@@ -0,0 +1,87 @@
+//
+// Created by cinea on 24-2-25.
+//
+
+#ifndef TLSCONTEXT_H
+#define TLSCONTEXT_H
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast/ssl.hpp>
+
+#include "Common.h"
+
+template <class Stream>
+struct is_ssl_stream : std::false_type
+{
+};
+
+template <class NextLayer>
+struct is_ssl_stream<beast::ssl_stream<NextLayer>> : std::true_type
+{
+};
+
+struct tls_options
+{
+    std::string cert_file;
+    std::string key_file;
+    std::string ciphers; // TLS 1.2及以下，OpenSSL格式
+    std::string ciphersuites; // TLS 1.3
+    long session_cache_size{20480}; // 服务端会话缓存，用于会话恢复
+    bool session_tickets{true};
+    int reload_interval{60}; // 秒，检查证书是否更新，0表示不检查
+    bool http2{false}; // ALPN是否提供h2
+};
+
+/**
+ * \brief 持有当前的SSL上下文，定期检查证书文件，有变化时重新加载。
+ *
+ * 新连接通过get()拿到最新的上下文，已经建立的连接继续使用旧的。
+ */
+class tls_context : public std::enable_shared_from_this<tls_context>
+{
+    tls_options options_;
+    net::steady_timer timer_;
+
+    std::mutex mutex_;
+    std::shared_ptr<net::ssl::context> ctx_;
+    std::filesystem::file_time_type cert_time_;
+    std::filesystem::file_time_type key_time_;
+
+public:
+    tls_context(net::io_context& ioc, tls_options options);
+
+    /**
+     * \brief 首次加载证书，失败时ec被设置。
+     */
+    void load(beast::error_code& ec);
+
+    [[nodiscard]] std::shared_ptr<net::ssl::context> get();
+
+    // 开始定期检查证书
+    void run();
+
+private:
+    [[nodiscard]] std::shared_ptr<net::ssl::context> build(beast::error_code& ec) const;
+
+    void do_wait();
+    void on_wait(const beast::error_code& ec);
+};
+
+/**
+ * \brief 握手后协商出的ALPN协议，没有协商时为空。
+ */
+template <class NextLayer>
+std::string_view negotiated_alpn(beast::ssl_stream<NextLayer>& stream)
+{
+    const unsigned char* data = nullptr;
+    unsigned int len = 0;
+    SSL_get0_alpn_selected(stream.native_handle(), &data, &len);
+    return {reinterpret_cast<const char*>(data), len};
+}
+
+#endif //TLSCONTEXT_H
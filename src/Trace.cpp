@@ -0,0 +1,138 @@
+//
+// Created by cinea on 24-3-1.
+//
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+
+request_tracer gate_trace;
+
+namespace
+{
+    constexpr const char* phase_names[] = {
+        "accept",
+        "header_parsed",
+        "route_matched",
+        "cache_lookup",
+        "upstream_resolved",
+        "upstream_connected",
+        "upstream_written",
+        "upstream_first_byte",
+        "upstream_last_byte",
+        "response_written",
+    };
+    static_assert(std::size(phase_names) == static_cast<size_t>(trace_phase::count_));
+}
+
+void append_json_string(std::string& out, const std::string_view value)
+{
+    out += '"';
+    for (const auto c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void request_tracer::configure(const trace_options& options)
+{
+    std::lock_guard guard(mutex_);
+
+    options_ = options;
+    ring_.clear();
+    ring_.resize(std::max<size_t>(options_.samples, 1));
+    next_ = 0;
+    recorded_ = 0;
+
+    enabled_.store(options_.enabled);
+}
+
+void request_tracer::finish(const request_trace& trace, const std::string_view method, const std::string_view target,
+                            const unsigned status)
+{
+    const auto total = std::chrono::steady_clock::now() - trace.start;
+    if (total < options_.slow_threshold)
+        return;
+
+    std::lock_guard guard(mutex_);
+
+    auto& s = ring_[next_];
+    s.time = std::chrono::system_clock::now();
+    s.method = method;
+    s.target = target;
+    s.status = status;
+    s.total_us = std::chrono::duration_cast<std::chrono::microseconds>(total).count();
+    s.offsets_us = trace.offsets_us;
+
+    next_ = (next_ + 1) % ring_.size();
+    recorded_++;
+}
+
+std::string request_tracer::dump() const
+{
+    std::lock_guard guard(mutex_);
+
+    std::string out;
+    out += "{\"slow_threshold_ms\":" + std::to_string(options_.slow_threshold.count());
+    out += ",\"recorded\":" + std::to_string(recorded_);
+    out += ",\"samples\":[";
+
+    const auto count = std::min<uint64_t>(recorded_, ring_.size());
+    for (size_t i = 0; i < count; i++)
+    {
+        const auto& s = ring_[(next_ + ring_.size() - 1 - i) % ring_.size()];
+
+        char time[32];
+        const auto t = std::chrono::system_clock::to_time_t(s.time);
+        std::tm tm{};
+        gmtime_r(&t, &tm);
+        std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+        if (i > 0)
+            out += ',';
+        out += "{\"time\":\"";
+        out += time;
+        out += "\",\"method\":";
+        append_json_string(out, s.method);
+        out += ",\"target\":";
+        append_json_string(out, s.target);
+        out += ",\"status\":" + std::to_string(s.status);
+        out += ",\"total_us\":" + std::to_string(s.total_us);
+        out += ",\"phases_us\":{";
+
+        bool first = true;
+        for (size_t p = 0; p < s.offsets_us.size(); p++)
+        {
+            if (s.offsets_us[p] == request_trace::unset)
+                continue;
+
+            if (!first)
+                out += ',';
+            first = false;
+            out += '"';
+            out += phase_names[p];
+            out += "\":" + std::to_string(s.offsets_us[p]);
+        }
+        out += "}}";
+    }
+
+    out += "]}\n";
+    return out;
+}
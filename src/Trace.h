@@ -0,0 +1,124 @@
+//
+// Created by cinea on 24-3-1.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class trace_phase : size_t
+{
+    accept, // 只有连接上的第一个请求有
+    header_parsed,
+    route_matched,
+    cache_lookup,
+    upstream_resolved,
+    upstream_connected,
+    upstream_written,
+    upstream_first_byte,
+    upstream_last_byte,
+    response_written,
+    count_
+};
+
+/**
+ * \brief 一个请求各阶段的单调时间戳，以相对start的微秒数保存。
+ *
+ * 请求在session和proxy_session之间是沿着一条异步调用链传递的，同一时间只有一方在写，不需要加锁。
+ */
+struct request_trace
+{
+    static constexpr uint32_t unset = UINT32_MAX;
+
+    std::chrono::steady_clock::time_point start;
+    std::array<uint32_t, static_cast<size_t>(trace_phase::count_)> offsets_us{};
+
+    void reset(const std::chrono::steady_clock::time_point time)
+    {
+        start = time;
+        offsets_us.fill(unset);
+    }
+
+    void mark(trace_phase phase)
+    {
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        offsets_us[static_cast<size_t>(phase)] = static_cast<uint32_t>(std::min<int64_t>(us, unset - 1));
+    }
+};
+
+// 追踪没打开时传进来的是空指针
+inline void trace_mark(request_trace* trace, const trace_phase phase)
+{
+    if (trace)
+        trace->mark(phase);
+}
+
+struct trace_options
+{
+    bool enabled{false};
+    std::chrono::milliseconds slow_threshold{500}; // 超过这个时间的请求才会被记下来
+    size_t samples{256}; // 最多保留多少个慢请求，从管理端口的GET /trace导出
+};
+
+/**
+ * \brief 慢请求采样。请求结束时超过阈值的追踪记录放进环形缓冲区，旧的被覆盖。
+ *
+ * 慢请求很少，直接加锁就够了；大多数请求只做一次比较。
+ */
+class request_tracer
+{
+    struct sample
+    {
+        std::chrono::system_clock::time_point time;
+        std::string method;
+        std::string target;
+        unsigned status{0};
+        uint64_t total_us{0};
+        std::array<uint32_t, static_cast<size_t>(trace_phase::count_)> offsets_us{};
+    };
+
+    trace_options options_;
+    std::atomic_bool enabled_{false};
+
+    mutable std::mutex mutex_;
+    std::vector<sample> ring_;
+    size_t next_{0};
+    uint64_t recorded_{0};
+
+public:
+    // 必须在IO线程启动前调用
+    void configure(const trace_options& options);
+
+    [[nodiscard]] bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] const trace_options& options() const { return options_; }
+
+    /**
+     * \brief 请求结束时调用，超过阈值时保存一份。
+     */
+    void finish(const request_trace& trace, std::string_view method, std::string_view target, unsigned status);
+
+    /**
+     * \brief 以JSON输出保存的慢请求，最新的在前。
+     */
+    [[nodiscard]] std::string dump() const;
+};
+
+extern request_tracer gate_trace;
+
+/**
+ * \brief 把value转义成JSON字符串（带引号）追加到out。
+ */
+void append_json_string(std::string& out, std::string_view value);
+
+#endif //TRACE_H
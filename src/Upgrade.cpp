@@ -0,0 +1,212 @@
+//
+// Created by cinea on 24-3-7.
+//
+
+#include "Upgrade.h"
+
+#include <atomic>
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+namespace
+{
+    constexpr std::string_view listen_fds_env = "FORUM_GATE_LISTEN_FDS";
+    constexpr std::string_view predecessor_env = "FORUM_GATE_PREDECESSOR";
+
+    // 正在预热的新进程，0表示没有
+    std::atomic<pid_t> successor{0};
+
+    // 上一个进程传下来、还没有被监听端口接过去的socket
+    struct inherited_listeners
+    {
+        std::mutex mutex;
+        std::vector<int> fds;
+
+        inherited_listeners()
+        {
+            const auto value = std::getenv(listen_fds_env.data());
+            if (!value)
+                return;
+
+            std::string_view list(value);
+            while (!list.empty())
+            {
+                int fd = -1;
+                const auto [end, ec] = std::from_chars(list.data(), list.data() + list.size(), fd);
+                if (ec == std::errc() && fd > 2)
+                    fds.push_back(fd);
+
+                const auto comma = list.find(',');
+                if (comma == std::string_view::npos)
+                    break;
+                list.remove_prefix(comma + 1);
+            }
+        }
+    };
+
+    inherited_listeners& inherited()
+    {
+        static inherited_listeners listeners;
+        return listeners;
+    }
+
+    bool has_name(const char* entry, const std::string_view name)
+    {
+        const std::string_view view(entry);
+        return view.size() > name.size() && view.starts_with(name) && view[name.size()] == '=';
+    }
+}
+
+int take_inherited_listener(const tcp::endpoint& endpoint)
+{
+    auto& listeners = inherited();
+    std::lock_guard guard(listeners.mutex);
+
+    for (auto it = listeners.fds.begin(); it != listeners.fds.end(); ++it)
+    {
+        tcp::endpoint local;
+        socklen_t size = local.capacity();
+        if (getsockname(*it, local.data(), &size) != 0)
+            continue;
+
+        local.resize(size);
+        if (local == endpoint)
+        {
+            const auto fd = *it;
+            listeners.fds.erase(it);
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+void close_inherited_listeners()
+{
+    auto& listeners = inherited();
+    std::lock_guard guard(listeners.mutex);
+
+    for (const auto fd : listeners.fds)
+        ::close(fd);
+    listeners.fds.clear();
+}
+
+void spawn_successor(const std::vector<int>& listen_fds, beast::error_code& ec)
+{
+    if (upgrade_in_progress())
+    {
+        ec = beast::errc::make_error_code(beast::errc::operation_in_progress);
+        return;
+    }
+
+    // 可执行文件被替换以后，/proc/self/exe指向已经删除的旧文件，要按原来的路径启动新的
+    std::error_code fs_ec;
+    auto exe = std::filesystem::read_symlink("/proc/self/exe", fs_ec).string();
+    if (fs_ec)
+    {
+        ec = beast::error_code(fs_ec.value(), beast::system_category());
+        return;
+    }
+
+    constexpr std::string_view deleted = " (deleted)";
+    if (exe.ends_with(deleted))
+        exe.resize(exe.size() - deleted.size());
+
+    // fork之后只能调用异步信号安全的函数，参数和环境变量都要先准备好
+    auto fds_var = std::string(listen_fds_env) + "=";
+    for (const auto fd : listen_fds)
+        fds_var += std::to_string(fd) + ",";
+    auto predecessor_var = std::string(predecessor_env) + "=" + std::to_string(getpid());
+
+    std::vector<char*> envp;
+    for (auto entry = environ; *entry; entry++)
+    {
+        if (!has_name(*entry, listen_fds_env) && !has_name(*entry, predecessor_env))
+            envp.push_back(*entry);
+    }
+    envp.push_back(fds_var.data());
+    envp.push_back(predecessor_var.data());
+    envp.push_back(nullptr);
+
+    char* argv[] = {exe.data(), nullptr};
+
+    rlimit limit{};
+    const auto max_fd = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+                            ? static_cast<int>(limit.rlim_cur)
+                            : 65536;
+
+    const auto pid = fork();
+    if (pid < 0)
+    {
+        ec = beast::error_code(errno, beast::system_category());
+        return;
+    }
+
+    if (pid == 0)
+    {
+        // 客户端连接、日志文件都不能留给新进程，否则旧进程关闭连接时不会真正断开
+        bool marked = false;
+#ifdef SYS_close_range
+        marked = syscall(SYS_close_range, 3U, ~0U, 4U /* CLOSE_RANGE_CLOEXEC */) == 0;
+#endif
+        for (int fd = 3; !marked && fd < max_fd; fd++)
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        for (const auto fd : listen_fds)
+            fcntl(fd, F_SETFD, 0);
+
+        execve(exe.c_str(), argv, envp.data());
+        _exit(127);
+    }
+
+    successor = pid;
+}
+
+bool upgrade_in_progress()
+{
+    return successor.load() != 0;
+}
+
+void reap_successor()
+{
+    const auto pid = successor.load();
+    if (pid == 0)
+        return;
+
+    int status = 0;
+    if (waitpid(pid, &status, WNOHANG) != pid)
+        return;
+
+    successor = 0;
+    gate_log.error("upgrade", "successor " + std::to_string(pid) + " exited with status " +
+                   std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)));
+}
+
+void notify_predecessor()
+{
+    static std::once_flag once;
+    std::call_once(once, []
+    {
+        const auto value = std::getenv(predecessor_env.data());
+        if (!value)
+            return;
+
+        // 上一个进程已经先退出了的话，父进程变成了init，pid也可能被别人用了
+        const auto pid = std::atoi(value);
+        if (pid > 0 && pid == getppid())
+            kill(pid, SIGTERM);
+    });
+}
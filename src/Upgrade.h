@@ -0,0 +1,49 @@
+//
+// Created by cinea on 24-3-7.
+//
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <vector>
+
+#include "Common.h"
+
+/**
+ * 平滑升级：收到SIGUSR2时用同样的工作目录启动新的可执行文件，监听socket作为继承的fd传过去
+ * （环境变量FORUM_GATE_LISTEN_FDS），两个进程从同一个接受队列里取连接，不会有连接被拒绝。
+ * 新进程按刚保存的清单预热完缓存后给旧进程发SIGTERM，旧进程停止接受连接，处理完已有的请求后退出。
+ */
+
+/**
+ * \brief 取出上一个进程传下来的、监听在endpoint上的socket，没有时返回-1。
+ */
+int take_inherited_listener(const tcp::endpoint& endpoint);
+
+/**
+ * \brief 关闭没有用上的继承socket（新配置里去掉的端口）。
+ */
+void close_inherited_listeners();
+
+/**
+ * \brief 启动新进程并把listen_fds传给它，失败时写入ec。新进程启动以后的错误（例如配置有误）
+ * 只会写在它自己的日志里，旧进程照常运行。
+ */
+void spawn_successor(const std::vector<int>& listen_fds, beast::error_code& ec);
+
+/**
+ * \brief 已经启动了新进程、还在等它预热完。这期间不能再启动一个，否则两代进程会一直共用同一组端口。
+ */
+bool upgrade_in_progress();
+
+/**
+ * \brief 收到SIGCHLD时调用。新进程在通知本进程退出之前就退出了（例如配置有误）的话，回收它并允许再次升级。
+ */
+void reap_successor();
+
+/**
+ * \brief 本进程是平滑升级启动的话，通知上一个进程开始退出。只有第一次调用有效。
+ */
+void notify_predecessor();
+
+#endif //UPGRADE_H
@@ -4,11 +4,13 @@
 
 #ifndef LRULIST_H
 #define LRULIST_H
+#include <cassert>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <unordered_map>
+#include <vector>
 #include <algorithm>
 
 template <typename Key, typename Value, typename Lock = std::mutex>
@@ -30,6 +32,23 @@ public:
 
     [[nodiscard]] std::optional<std::pair<Key, Value>> insert(const Key& key, Value&& new_item);
     bool remove(const Key& key);
+
+    // 取出全部条目，从最近使用的开始
+    [[nodiscard]] std::vector<std::pair<Key, Value>> take_all()
+    {
+        const std::lock_guard<Lock> guard(lock_);
+        std::vector<std::pair<Key, Value>> items(std::make_move_iterator(list_.begin()),
+                                                 std::make_move_iterator(list_.end()));
+        list_.clear();
+        map_.clear();
+        return items;
+    }
+
+    [[nodiscard]] size_t size()
+    {
+        const std::lock_guard<Lock> guard(lock_);
+        return list_.size();
+    }
 };
 
 
@@ -63,6 +82,7 @@ std::optional<std::pair<Key, Value>> lru_list<Key, Value, Lock>::insert(const Ke
 template <typename Key, typename Value, typename Lock>
 bool lru_list<Key, Value, Lock>::remove(const Key& key)
 {
+    const std::lock_guard<Lock> guard(lock_);
     auto it = map_.find(key);
     if (it == map_.end())
     {
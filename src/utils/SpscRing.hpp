@@ -0,0 +1,63 @@
+//
+// Created by cinea on 24-2-28.
+//
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * \brief 单生产者单消费者的无锁环形缓冲区，容量向上取整到2的幂。
+ */
+template <typename T>
+class spsc_ring
+{
+    std::vector<T> slots_;
+    size_t mask_;
+
+    alignas(64) std::atomic_size_t head_{0}; // 生产者写入的位置
+    alignas(64) std::atomic_size_t tail_{0}; // 消费者读取的位置
+
+public:
+    explicit spsc_ring(const size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+
+        slots_.resize(size);
+        mask_ = size - 1;
+    }
+
+    /**
+     * \brief 只能由生产者调用，满了返回false。
+     */
+    bool push(const T& item)
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) > mask_)
+            return false;
+
+        slots_[head & mask_] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * \brief 只能由消费者调用，空了返回false。
+     */
+    bool pop(T& item)
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+            return false;
+
+        item = slots_[tail & mask_];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif //SPSCRING_H
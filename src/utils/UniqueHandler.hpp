@@ -0,0 +1,143 @@
+//
+// Created by cinea on 24-3-7.
+//
+
+#ifndef UNIQUEHANDLER_H
+#define UNIQUEHANDLER_H
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <typename Signature, size_t InlineSize = 128>
+class unique_handler;
+
+/**
+ * \brief 只能移动的回调，代替std::function用在每个请求都要创建的完成处理器上。
+ *
+ * 不超过InlineSize的可调用对象直接放在内部的缓冲区里，不分配内存；默认的大小能放下
+ * 协程的完成处理器（asio的awaitable_handler）再加一个any_io_executor。放不下的才分配到堆上。
+ * 因为只需要能移动，asio的完成处理器可以直接放进来，不用再包一层shared_ptr。
+ */
+template <typename R, typename... Args, size_t InlineSize>
+class unique_handler<R(Args...), InlineSize>
+{
+    struct vtable
+    {
+        R (*invoke)(void* storage, Args&&... args);
+        void (*relocate)(void* from, void* to) noexcept; // 移动到to并销毁from
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename F>
+    static constexpr bool stored_inline = sizeof(F) <= InlineSize && alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible_v<F>;
+
+    template <typename F>
+    static constexpr vtable inline_vtable{
+        [](void* storage, Args&&... args) -> R
+        {
+            return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+        },
+        [](void* from, void* to) noexcept
+        {
+            ::new(to) F(std::move(*static_cast<F*>(from)));
+            static_cast<F*>(from)->~F();
+        },
+        [](void* storage) noexcept
+        {
+            static_cast<F*>(storage)->~F();
+        }
+    };
+
+    template <typename F>
+    static constexpr vtable heap_vtable{
+        [](void* storage, Args&&... args) -> R
+        {
+            return (**static_cast<F**>(storage))(std::forward<Args>(args)...);
+        },
+        [](void* from, void* to) noexcept
+        {
+            *static_cast<F**>(to) = *static_cast<F**>(from);
+        },
+        [](void* storage) noexcept
+        {
+            delete *static_cast<F**>(storage);
+        }
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[InlineSize];
+    const vtable* vtable_{nullptr};
+
+public:
+    unique_handler() noexcept = default;
+
+    unique_handler(std::nullptr_t) noexcept
+    {
+    }
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, unique_handler> &&
+                                                      std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+    unique_handler(F&& f)
+    {
+        using stored = std::decay_t<F>;
+        if constexpr (stored_inline<stored>)
+        {
+            ::new(static_cast<void*>(storage_)) stored(std::forward<F>(f));
+            vtable_ = &inline_vtable<stored>;
+        }
+        else
+        {
+            ::new(static_cast<void*>(storage_)) stored*(new stored(std::forward<F>(f)));
+            vtable_ = &heap_vtable<stored>;
+        }
+    }
+
+    unique_handler(unique_handler&& other) noexcept : vtable_(std::exchange(other.vtable_, nullptr))
+    {
+        if (vtable_)
+            vtable_->relocate(other.storage_, storage_);
+    }
+
+    unique_handler& operator=(unique_handler&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            vtable_ = std::exchange(other.vtable_, nullptr);
+            if (vtable_)
+                vtable_->relocate(other.storage_, storage_);
+        }
+        return *this;
+    }
+
+    unique_handler& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    unique_handler(const unique_handler&) = delete;
+    unique_handler& operator=(const unique_handler&) = delete;
+
+    ~unique_handler()
+    {
+        reset();
+    }
+
+    explicit operator bool() const noexcept { return vtable_ != nullptr; }
+
+    R operator()(Args... args)
+    {
+        return vtable_->invoke(storage_, std::forward<Args>(args)...);
+    }
+
+private:
+    void reset() noexcept
+    {
+        if (const auto table = std::exchange(vtable_, nullptr))
+            table->destroy(storage_);
+    }
+};
+
+#endif //UNIQUEHANDLER_H